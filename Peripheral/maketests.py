@@ -30,3 +30,58 @@ for hash_length, hash_func in hash_sizes:
             digest = hash_func(string).hexdigest()
             outfile.write(f"{len(string)} {string.decode('utf-8')} {digest}\n")
         outfile.write("0")
+
+
+# Nonce search tests
+# Each line has the header length, the hash size, the nonce word offset and
+# width, the first nonce, the attempt limit, the target, the expected result
+# and finally the header template as big endian words.
+nonce_hash_funcs = [
+    hashlib.sha3_512,
+    hashlib.sha3_384,
+    hashlib.sha3_256,
+    hashlib.sha3_224,
+]
+
+nonce_tests = [
+    # (header, out_size, word_offset, width, start, limit, search_window)
+    (bytes(range(80)), 2, 19, 4, 0, 0, 12),
+    (b"A header that ends unaligned.........", 0, 9, 1, 253, 0, 10),
+    (b"tiny hdr", 3, 0, 2, 0, 5, 0),
+    (bytes((i * 7) & 0xFF for i in range(136)), 1, 3, 4, 1000, 0, 8),
+]
+
+
+def nonce_digest(header, out_size, word_offset, width, nonce):
+    message = bytearray(header)
+    nonce_bytes = (nonce & ((1 << (8 * width)) - 1)).to_bytes(width, "big")
+    for i, byte in enumerate(nonce_bytes):
+        if 4 * word_offset + i < len(message):
+            message[4 * word_offset + i] = byte
+    digest = nonce_hash_funcs[out_size](bytes(message)).digest()
+    return int.from_bytes(digest[:8], "big")
+
+
+with open("./testvectors/nonce.mem", "w") as outfile:
+    for header, out_size, word_offset, width, start, limit, window in nonce_tests:
+        if window > 0:
+            # Pick the smallest digest in the window, so that the first hit is known
+            digests = [
+                nonce_digest(header, out_size, word_offset, width, start + i)
+                for i in range(window)
+            ]
+            hit = digests.index(min(digests))
+            target = digests[hit] + 1
+            found, nonce, attempts = 1, (start + hit) & 0xFFFFFFFF, hit + 1
+        else:
+            target = 0
+            found, nonce, attempts = 0, 0, limit
+
+        padded = header + bytes(-len(header) % 4)
+        words = [padded[i:i + 4].hex() for i in range(0, len(padded), 4)]
+
+        outfile.write(
+            f"{len(header)} {out_size} {word_offset} {width} {start} {limit} "
+            f"{target:016x} {found} {nonce} {attempts} {' '.join(words)}\n"
+        )
+    outfile.write("0")
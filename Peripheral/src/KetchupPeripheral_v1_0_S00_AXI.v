@@ -131,16 +131,109 @@
 
 	assign sha3_input = reg_input;
 
-	
+	// Nonce search engine
+	// Hashes the header template stored in nonce_template over and over,
+	// substituting an incrementing nonce into one of its words, until the
+	// leading 64 bits of the digest are below the target.
+	// Nonce Registers:
+	// 0x50 - Control (W: bit 0 start, bit 1 abort)
+	//        Status  (R: bit 0 busy, bit 1 found, bit 2 exhausted)
+	// 0x54 - Template write address, in words
+	// 0x58 - Template data, the write address auto increments
+	// 0x5C - Header length in bytes (at most 255)
+	// 0x60 - Bit 5:0 word offset of the nonce, bit 17:16 nonce width in bytes minus one
+	// 0x64 - First nonce to try
+	// 0x68 - Maximum number of attempts (0 means no limit)
+	// 0x6C - Target, most significant word
+	// 0x70 - Target, least significant word
+	// 0x74 - Nonce that produced the first hit (R)
+	// 0x78 - Number of hashes computed (R)
+	localparam integer NONCE_TEMPLATE_WORDS = 64;
+	localparam integer NONCE_TEMPLATE_BITS  = 6;
+
+	localparam [2:0] NONCE_IDLE  = 3'd0,
+	                 NONCE_RESET = 3'd1,
+	                 NONCE_FEED  = 3'd2,
+	                 NONCE_LAST  = 3'd3,
+	                 NONCE_WAIT  = 3'd4;
+
+	reg  [31:0] nonce_template [0:NONCE_TEMPLATE_WORDS-1];
+	reg  [NONCE_TEMPLATE_BITS-1:0] nonce_template_waddr;
+	wire [NONCE_TEMPLATE_BITS-1:0] nonce_template_raddr;
+	reg  [31:0] nonce_template_rdata;
+
+	reg  [7:0]  reg_nonce_length;
+	reg  [31:0] reg_nonce_position;
+	reg  [31:0] reg_nonce_start;
+	reg  [31:0] reg_nonce_limit;
+	reg  [63:0] reg_nonce_target;
+	reg         nonce_start_pulse;
+	reg         nonce_abort_pulse;
+
+	reg  [2:0]  nonce_state;
+	reg  [NONCE_TEMPLATE_BITS-1:0] nonce_word_idx;
+	reg  [31:0] nonce_current;
+	reg  [31:0] nonce_result;
+	reg  [31:0] nonce_attempts;
+	reg         nonce_found;
+	reg         nonce_exhausted;
+
+	wire [NONCE_TEMPLATE_BITS-1:0] nonce_full_words;
+	wire [1:0]  nonce_tail_bytes;
+	wire [NONCE_TEMPLATE_BITS-1:0] nonce_word_offset;
+	wire [1:0]  nonce_width_m1;
+	wire [31:0] nonce_mask;
+	wire [31:0] nonce_field;
+	wire [31:0] nonce_word;
+	wire        nonce_busy;
+	wire        nonce_feed_accept;
+	wire        nonce_last_accept;
+	wire        nonce_hit;
+	wire [REG_ADDR_BITS-1:0] nonce_wr_addr;
+
+	assign nonce_full_words  = reg_nonce_length[7:2];
+	assign nonce_tail_bytes  = reg_nonce_length[1:0];
+	assign nonce_word_offset = reg_nonce_position[NONCE_TEMPLATE_BITS-1:0];
+	assign nonce_width_m1    = reg_nonce_position[17:16];
+
+	// The nonce is stored big endian in the first nonce_width bytes of its word
+	assign nonce_mask  = 32'hFFFFFFFF  << (8 * (3 - nonce_width_m1));
+	assign nonce_field = nonce_current << (8 * (3 - nonce_width_m1));
+	assign nonce_word  = (nonce_word_idx == nonce_word_offset) ?
+	                     ((nonce_template_rdata & ~nonce_mask) | (nonce_field & nonce_mask)) :
+	                     nonce_template_rdata;
+
+	assign nonce_busy        = nonce_state != NONCE_IDLE;
+	assign nonce_feed_accept = (nonce_state == NONCE_FEED) && !sha3_buffer_full;
+	assign nonce_last_accept = (nonce_state == NONCE_LAST) && !sha3_buffer_full;
+	assign nonce_hit         = sha3_output[511:448] < reg_nonce_target;
+
+	// Prefetch the next word so that it's ready when the core accepts the current one
+	assign nonce_template_raddr = nonce_word_idx + nonce_feed_accept;
+
+	assign nonce_wr_addr = axi_awaddr[ADDR_LSB +: REG_ADDR_BITS];
+
+	// The core is shared between the register interface and the nonce engine
+	wire        core_reset;
+	wire [31:0] core_input;
+	wire        core_in_ready;
+	wire        core_is_last;
+	wire [1:0]  core_byte_num;
+
+	assign core_reset    = sha3_reset | (nonce_state == NONCE_RESET);
+	assign core_input    = nonce_busy ? nonce_word : sha3_input;
+	assign core_in_ready = sha3_is_sending_bytes | nonce_feed_accept | nonce_last_accept;
+	assign core_is_last  = sha3_is_last | nonce_last_accept;
+	assign core_byte_num = nonce_busy ? nonce_tail_bytes : sha3_byte_to_send;
 
 	keccak 
 	 sha512_core (
 	   .clk(S_AXI_ACLK), 
-	   .reset(sha3_reset),
-	   .in(sha3_input), 
-	   .in_ready(sha3_is_sending_bytes),
-	   .is_last(sha3_is_last), 
-	   .byte_num(sha3_byte_to_send), 
+	   .reset(core_reset),
+	   .in(core_input), 
+	   .in_ready(core_in_ready),
+	   .is_last(core_is_last), 
+	   .byte_num(core_byte_num), 
 	   .buffer_full(sha3_buffer_full), 
 	   .out(sha3_core_output), 
 	   .out_ready(sha3_out_ready),
@@ -281,9 +374,21 @@
 				sha3_reset <= 1;
 				sha3_is_last <= 0;
 
+				nonce_template_waddr <= 0;
+				reg_nonce_length <= 0;
+				reg_nonce_position <= 0;
+				reg_nonce_start <= 0;
+				reg_nonce_limit <= 0;
+				reg_nonce_target <= 0;
+				nonce_start_pulse <= 0;
+				nonce_abort_pulse <= 0;
+
         end else if (slv_reg_wren) begin
 			reg_idx  = axi_awaddr[ADDR_LSB +: REG_ADDR_BITS];
 
+			nonce_start_pulse <= 0;
+			nonce_abort_pulse <= 0;
+
 			if (reg_idx == 5'h00) begin
 				reg_control <= wrdata_control;
 			end else if (reg_idx == 5'h02) begin
@@ -305,15 +410,111 @@
 			end else if (reg_idx == 5'h03) begin
 				if (wrdata_command[0] == 1) begin
 					sha3_reset <= 1;
+					// A reset also stops any running nonce search
+					nonce_abort_pulse <= 1;
 				end
+			end else if (reg_idx == 5'h14) begin
+				nonce_start_pulse <= wrdata_command[0];
+				nonce_abort_pulse <= wrdata_command[1];
+			end else if (reg_idx == 5'h15) begin
+				nonce_template_waddr <= S_AXI_WDATA[NONCE_TEMPLATE_BITS-1:0];
+			end else if (reg_idx == 5'h16) begin
+				nonce_template_waddr <= nonce_template_waddr + 1;
+			end else if (reg_idx == 5'h17) begin
+				reg_nonce_length <= S_AXI_WDATA[7:0];
+			end else if (reg_idx == 5'h18) begin
+				reg_nonce_position <= apply_wstrb(reg_nonce_position, S_AXI_WDATA, S_AXI_WSTRB);
+			end else if (reg_idx == 5'h19) begin
+				reg_nonce_start <= apply_wstrb(reg_nonce_start, S_AXI_WDATA, S_AXI_WSTRB);
+			end else if (reg_idx == 5'h1A) begin
+				reg_nonce_limit <= apply_wstrb(reg_nonce_limit, S_AXI_WDATA, S_AXI_WSTRB);
+			end else if (reg_idx == 5'h1B) begin
+				reg_nonce_target[63:32] <= apply_wstrb(reg_nonce_target[63:32], S_AXI_WDATA, S_AXI_WSTRB);
+			end else if (reg_idx == 5'h1C) begin
+				reg_nonce_target[31:0] <= apply_wstrb(reg_nonce_target[31:0], S_AXI_WDATA, S_AXI_WSTRB);
 			end
         end else begin
             sha3_reset <= 0;
             sha3_is_sending_bytes <= 0;        
 			sha3_is_last <= 0;
+			nonce_start_pulse <= 0;
+			nonce_abort_pulse <= 0;
         end
     end
 
+	// Header template memory, one write port for the bus
+	// and one read port for the nonce engine
+	always @( posedge S_AXI_ACLK )
+	begin
+		if (slv_reg_wren && nonce_wr_addr == 5'h16) begin
+			nonce_template[nonce_template_waddr] <= S_AXI_WDATA;
+		end
+		nonce_template_rdata <= nonce_template[nonce_template_raddr];
+	end
+
+	// Nonce engine state machine
+	always @( posedge S_AXI_ACLK )
+	begin
+		if (!S_AXI_ARESETN || nonce_abort_pulse) begin
+			nonce_state     <= NONCE_IDLE;
+			nonce_word_idx  <= 0;
+			nonce_current   <= 0;
+			nonce_result    <= 0;
+			nonce_attempts  <= 0;
+			nonce_found     <= 0;
+			nonce_exhausted <= 0;
+		end else begin
+			case (nonce_state)
+				NONCE_IDLE: begin
+					if (nonce_start_pulse) begin
+						nonce_word_idx  <= 0;
+						nonce_current   <= reg_nonce_start;
+						nonce_attempts  <= 0;
+						nonce_found     <= 0;
+						nonce_exhausted <= 0;
+						nonce_state     <= NONCE_RESET;
+					end
+				end
+				NONCE_RESET: begin
+					// The core is held in reset for this cycle
+					nonce_state <= (nonce_full_words == 0) ? NONCE_LAST : NONCE_FEED;
+				end
+				NONCE_FEED: begin
+					if (nonce_feed_accept) begin
+						nonce_word_idx <= nonce_word_idx + 1;
+						if (nonce_word_idx + 1 == nonce_full_words) begin
+							nonce_state <= NONCE_LAST;
+						end
+					end
+				end
+				NONCE_LAST: begin
+					if (nonce_last_accept) begin
+						nonce_state <= NONCE_WAIT;
+					end
+				end
+				NONCE_WAIT: begin
+					if (sha3_out_ready) begin
+						nonce_attempts <= nonce_attempts + 1;
+						nonce_word_idx <= 0;
+
+						if (nonce_hit) begin
+							nonce_result <= nonce_current;
+							nonce_found  <= 1;
+							nonce_state  <= NONCE_IDLE;
+						end else if (reg_nonce_limit != 0 && nonce_attempts + 1 == reg_nonce_limit) begin
+							nonce_exhausted <= 1;
+							nonce_state     <= NONCE_IDLE;
+						end else begin
+							nonce_current <= nonce_current + 1;
+							nonce_state   <= NONCE_RESET;
+						end
+					end
+				end
+				default: nonce_state <= NONCE_IDLE;
+			endcase
+		end
+	end
+
 	// Implement write response logic generation
 	// The write response and response valid signals are asserted by the slave 
 	// when axi_wready, S_AXI_WVALID, axi_wready and S_AXI_WVALID are asserted.  
@@ -421,6 +622,16 @@
 	        5'h01   : reg_data_out <= reg_status;
 	        5'h02   : reg_data_out <= reg_input;
 	        5'h03   : reg_data_out <= 0; // NOTE: reg_command cannot be read 
+	        5'h14   : reg_data_out <= {29'b0, nonce_exhausted, nonce_found, nonce_busy};
+	        5'h15   : reg_data_out <= nonce_template_waddr;
+	        5'h17   : reg_data_out <= reg_nonce_length;
+	        5'h18   : reg_data_out <= reg_nonce_position;
+	        5'h19   : reg_data_out <= reg_nonce_start;
+	        5'h1A   : reg_data_out <= reg_nonce_limit;
+	        5'h1B   : reg_data_out <= reg_nonce_target[63:32];
+	        5'h1C   : reg_data_out <= reg_nonce_target[31:0];
+	        5'h1D   : reg_data_out <= nonce_result;
+	        5'h1E   : reg_data_out <= nonce_attempts;
 			default : reg_data_out <= 0;
 		endcase
 
@@ -0,0 +1,315 @@
+`timescale 1ns / 1ps
+`define PERIOD 20
+
+
+module nonce_search_tb;
+    reg axi_clock;
+    reg axi_aresetn;
+    reg [6:0] axi_awaddr;
+    reg [2:0] axi_awprot;
+    reg axi_awvalid;
+    wire axi_awready;
+    reg [31:0] axi_wdata;
+    reg [3:0] axi_wstrb;
+    reg axi_wvalid;
+    wire axi_wready;
+    wire [1:0] axi_bresp;
+    wire axi_bvalid;
+    reg axi_bready; 
+    reg [6:0] axi_araddr;
+    reg [2:0] axi_arprot;
+    reg axi_arvalid;
+    wire axi_arready;
+    wire [31:0] axi_rdata;
+    wire [1:0] axi_rresp;
+    wire axi_rvalid;
+    reg axi_rready;
+
+    reg [31:0] read_value;
+
+    integer i, j;
+    integer line_number;
+    integer fileno;
+    integer length, ret;
+
+    integer out_size, word_offset, width, start, limit;
+    integer expected_found, expected_nonce, expected_attempts;
+    integer words;
+
+    reg [63:0] target;
+    reg [31:0] template_word;
+    reg [31:0] nonce_status;
+
+    KetchupPeripheral_v1_0_S00_AXI 
+        keccak_instance (
+        // Global Clock Signal
+        .S_AXI_ACLK(axi_clock),
+        // Global Reset Signal. This Signal is Active LOW
+        .S_AXI_ARESETN(axi_aresetn),
+        // Write address (issued by master, acceped by Slave)
+        .S_AXI_AWADDR(axi_awaddr),
+        // Write channel Protection type. This signal indicates the
+            // privilege and security level of the transaction, and whether
+            // the transaction is a data access or an instruction access.
+        .S_AXI_AWPROT(axi_awprot),
+        // Write address valid. This signal indicates that the master signaling
+            // valid write address and control information.
+        .S_AXI_AWVALID(axi_awvalid),
+        // Write address ready. This signal indicates that the slave is ready
+            // to accept an address and associated control signals.
+        .S_AXI_AWREADY(axi_awready),
+        // Write data (issued by master, acceped by Slave) 
+        .S_AXI_WDATA(axi_wdata),
+        // Write strobes. This signal indicates which byte lanes hold
+            // valid data. There is one write strobe bit for each eight
+            // bits of the write data bus.    
+        .S_AXI_WSTRB(axi_wstrb),
+        // Write valid. This signal indicates that valid write
+            // data and strobes are available.
+        .S_AXI_WVALID(axi_wvalid),
+        // Write ready. This signal indicates that the slave
+            // can accept the write data.
+        .S_AXI_WREADY(axi_wready),
+        // Write response. This signal indicates the status
+            // of the write transaction.
+        .S_AXI_BRESP(axi_bresp),
+        // Write response valid. This signal indicates that the channel
+            // is signaling a valid write response.
+        .S_AXI_BVALID(axi_bvalid),
+        // Response ready. This signal indicates that the master
+            // can accept a write response.
+        .S_AXI_BREADY(axi_bready),
+        // Read address (issued by master, acceped by Slave)
+        .S_AXI_ARADDR(axi_araddr),
+        // Protection type. This signal indicates the privilege
+            // and security level of the transaction, and whether the
+            // transaction is a data access or an instruction access.
+        .S_AXI_ARPROT(axi_arprot),
+        // Read address valid. This signal indicates that the channel
+            // is signaling valid read address and control information.
+        .S_AXI_ARVALID(axi_arvalid),
+        // Read address ready. This signal indicates that the slave is
+            // ready to accept an address and associated control signals.
+        .S_AXI_ARREADY(axi_arready),
+        // Read data (issued by slave)
+        .S_AXI_RDATA(axi_rdata),
+        // Read response. This signal indicates the status of the
+            // read transfer.
+        .S_AXI_RRESP(axi_rresp),
+        // Read valid. This signal indicates that the channel is
+            // signaling the required read data.
+        .S_AXI_RVALID(axi_rvalid),
+        // Read ready. This signal indicates that the master can
+            // accept the read data and response information.
+        .S_AXI_RREADY(axi_rready)
+    );
+
+    initial begin
+        $dumpfile("nonce_signals.vcd");
+        $dumpvars(0, nonce_search_tb);
+
+        axi_clock = 0;
+
+        axi_awvalid = 0;
+        axi_wvalid = 0;
+        axi_bready = 0;
+
+        axi_arvalid = 0;
+        axi_rready = 0;
+
+        axi_araddr = 0;
+        axi_awaddr = 0;
+
+        // Reset Procedure
+        axi_aresetn = 0;
+        #(`PERIOD);
+        axi_aresetn = 1;
+        #(`PERIOD);
+
+        `define REG_CONTROL        7'h00
+        `define REG_COMMAND        7'h0C
+        `define REG_NONCE_CONTROL  7'h50
+        `define REG_NONCE_ADDR     7'h54
+        `define REG_NONCE_DATA     7'h58
+        `define REG_NONCE_LENGTH   7'h5C
+        `define REG_NONCE_POSITION 7'h60
+        `define REG_NONCE_START    7'h64
+        `define REG_NONCE_LIMIT    7'h68
+        `define REG_NONCE_TARGET_H 7'h6C
+        `define REG_NONCE_TARGET_L 7'h70
+        `define REG_NONCE_RESULT   7'h74
+        `define REG_NONCE_ATTEMPTS 7'h78
+
+        fileno = $fopen("./testvectors/nonce.mem", "r");
+        $display("Nonce Search Tests:");
+        run_nonce_tests(fileno);
+        $display("");
+        $fclose(fileno);
+
+        $finish;
+    end
+
+    task run_nonce_tests;
+        input [31:0] fileno;
+        begin
+            line_number = 0;
+            ret = $fscanf(fileno, "%d ", length);
+            while (length > 0) begin
+                line_number = line_number + 1;
+
+                ret = $fscanf(fileno, "%d %d %d %d %d ", out_size, word_offset, width, start, limit);
+                ret = $fscanf(fileno, "%h ", target);
+                ret = $fscanf(fileno, "%d %d %d ", expected_found, expected_nonce, expected_attempts);
+
+                // Reset the Peripheral
+                write_procedure(`REG_COMMAND, 32'h1);
+                write_procedure(`REG_CONTROL, out_size << 4);
+
+                // Load the header template
+                write_procedure(`REG_NONCE_ADDR, 32'h0);
+                words = (length + 3) / 4;
+                for (i = 0; i < words; i = i + 1) begin
+                    ret = $fscanf(fileno, "%h ", template_word);
+                    write_procedure(`REG_NONCE_DATA, template_word);
+                end
+
+                // Configure and start the search
+                write_procedure(`REG_NONCE_LENGTH, length);
+                write_procedure(`REG_NONCE_POSITION, ((width - 1) << 16) | word_offset);
+                write_procedure(`REG_NONCE_START, start);
+                write_procedure(`REG_NONCE_LIMIT, limit);
+                write_procedure(`REG_NONCE_TARGET_H, target[63:32]);
+                write_procedure(`REG_NONCE_TARGET_L, target[31:0]);
+                write_procedure(`REG_NONCE_CONTROL, 32'h1);
+
+                // Wait for the engine to stop
+                read_procedure(`REG_NONCE_CONTROL);
+                while ((read_value & 32'h1) != 0) begin
+                    read_procedure(`REG_NONCE_CONTROL);
+                end
+                nonce_status = read_value;
+
+                read_procedure(`REG_NONCE_ATTEMPTS);
+                if (read_value !== expected_attempts) begin
+                    $display("ERROR: attempts do not match for line %1d.", line_number);
+                    $display("Expected attempts: %1d", expected_attempts);
+                    $display("Output attempts:   %1d", read_value);
+                    $finish;
+                end
+
+                if (expected_found) begin
+                    read_procedure(`REG_NONCE_RESULT);
+                    if (nonce_status[1] !== 1'b1 || read_value !== expected_nonce) begin
+                        $display("ERROR: nonce does not match for line %1d.", line_number);
+                        $display("Expected nonce: %1d", expected_nonce);
+                        $display("Output nonce:   %1d (status = %h)", read_value, nonce_status);
+                        $finish;
+                    end
+                end else if (nonce_status[2] !== 1'b1) begin
+                    $display("ERROR: search should have been exhausted for line %1d.", line_number);
+                    $finish;
+                end
+
+                $display("Search %3d matches", line_number);
+
+                // Go ahead to next test case
+                ret = $fscanf(fileno, "%d ", length);
+            end
+
+            $display("All searches match!");
+        end
+    endtask
+
+    task write_procedure;
+        input [8:0] write_address;
+        input [31:0] write_data;
+        begin
+            // Put address and write data on the bus
+            axi_awaddr = write_address;
+            axi_wdata = write_data;
+
+            // All byte writes are valid, so write all ones
+            axi_wstrb = 4'b1111;
+
+            // Wait for clock
+            @(posedge axi_clock);
+
+
+            // The address is valid
+            axi_awvalid = 1;
+
+            // The written value is also valid
+            axi_wvalid = 1;
+
+            // Wait for the slave to ACK us about that
+            @(!(axi_awready && axi_wready));
+
+            // Signal the slave that I'm ready to receive a response
+            axi_bready = 1;
+
+            // Wait for the slave to send me the repsonse
+            @(axi_bvalid);
+
+            // Check if the slave said that everything is ok
+            if (axi_rresp != 2'b00) begin
+                $display("ERROR IN READING: %02b", axi_rresp);
+            end
+
+            // We're done here, we can reset all signals now
+            axi_awvalid <= 0;
+            axi_wvalid <= 0;
+
+            @(!axi_bvalid);
+
+            axi_bready <= 0;
+        end
+    endtask
+
+    task read_procedure;
+        input [8:0] read_address;
+        begin
+
+            // Wait for clock
+            @(posedge axi_clock);
+
+            // I'm ready to receive data
+            axi_rready = 1;
+
+            // The address on the line is valid
+            axi_arvalid = 1;
+
+            // Sending the Read Address
+            axi_araddr = read_address; 
+
+            // Wait for the slave to ACK my ready
+            @(axi_arready == 1);
+
+            // After one clock period, we can lower arvalid
+            #(`PERIOD * 1);
+            axi_arvalid <= 0;
+            axi_araddr <= 0;
+
+            // Wait for the slave to send valid data
+            @(axi_rvalid == 1);
+
+            // Check for read success. Response hould be 00
+            if (axi_rresp != 2'b00) begin
+                $display("ERROR IN READING: %02b", axi_rresp);
+            end
+
+            // Now read your value
+            read_value = axi_rdata;
+
+            // Wait for next transmission
+            @(axi_rvalid == 0);
+
+            // We're done here, remove rready 
+            axi_rready = 0;
+
+        end
+    endtask
+
+
+    always #(`PERIOD/2) axi_clock = ~axi_clock;
+
+endmodule
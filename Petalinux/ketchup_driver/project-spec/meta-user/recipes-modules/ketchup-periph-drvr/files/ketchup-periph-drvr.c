@@ -16,17 +16,52 @@
 #include <linux/ioctl.h>
 
 // Concurrency Primitives
-#include <linux/semaphore.h>
+#include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/xarray.h>
 #include <linux/signal.h>
+#include <linux/sched/signal.h>
 
 // Utilities
 #include <linux/errno.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/file.h>
+#include <linux/fadvise.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/io_uring.h>
+#include <linux/wait_bit.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/cred.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/scatterlist.h>
+#include <crypto/hash.h>
+#include <crypto/internal/hash.h>
+#include <crypto/engine.h>
+#include <crypto/sha3.h>
+#include <asm/unaligned.h>
 
 #include "ketchup-periph-drvr.h"
 
+#define CREATE_TRACE_POINTS
+#include "ketchup_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Ivan Piri was here");
 MODULE_DESCRIPTION("ketchup-driver - a character device driver for the ketchup peripheral");
@@ -41,18 +76,51 @@ MODULE_DESCRIPTION("ketchup-driver - a character device driver for the ketchup p
 
 #define kc_err(...) pr_err(DRIVER_NAME ": " __VA_ARGS__)
 
-// How big the buffer for copying data to kernel space is
+// How big the buffer of a session for copying data to kernel space is.
+// Writes larger than this are read directly from the pinned user pages.
 #define KC_BUF_SIZE 1024
 
-// How many devices we can support at maximum
+// How many user pages we pin at a time for large writes
+#define KC_PIN_BATCH 16
+
+// How much of a file we read at a time in RW_PERIPH_HASH_FILE
+#define KC_FILE_CHUNK (64 * 1024)
+
+// How many devices we can support at maximum. Only the bitmaps of the
+// container and the range of minors are sized on it, the peripherals
+// themselves are kept in an xarray
 #define MAX_DEVICES 128
 
+// /dev/ketchup_driver, /dev/ketchup_handle, the algorithm nodes and a core node per peripheral
+#define KC_MINORS (KC_MINOR_CORES + MAX_DEVICES)
+
+// How long to sleep between two polls of a running nonce search
+#define NONCE_POLL_MIN_US 50
+#define NONCE_POLL_MAX_US 100
+
+// A ring is drained by its own peripheral plus up to KC_RING_WORKERS - 1
+// borrowed ones, one more for every KC_RING_HELPER_BATCH pending submissions
+#define KC_RING_WORKERS 4
+#define KC_RING_HELPER_BATCH 16
+
+// Longest message accepted by an io_uring hash command
+#define KC_URING_MAX_LENGTH (1024 * 1024)
+
+// Highest fallback_threshold, since every message served in
+// software keeps up to that many bytes aside to replay them
+#define KC_FALLBACK_MAX_THRESHOLD (1024 * 1024)
+
 /**
  * Struct representing the character device
 */
 static struct file_operations fops = {
 	.read=ketchup_read,
 	.write=ketchup_write,
+	.write_iter=ketchup_write_iter,
+	.splice_write=ketchup_splice_write,
+	.mmap=ketchup_mmap,
+	.uring_cmd=ketchup_uring_cmd,
+	.poll=ketchup_poll,
 	.open=ketchup_open,
 	.unlocked_ioctl=ketchup_ioctl,
 	.release=ketchup_release,
@@ -78,6 +146,69 @@ static struct platform_driver ketchup_driver_driver = {
 	.remove		= ketchup_driver_remove,
 };
 
+// Buckets of the latency histograms: bucket 0 is under 1us,
+// bucket i counts the samples between 2^(i-1) and 2^i us
+#define KC_HISTOGRAM_BUCKETS 24
+
+// Weight of the users that weren't given one, for fair sharing
+#define KC_SHARE_DEFAULT_WEIGHT 1024
+
+/**
+ * Distribution of a latency, with power of two buckets
+*/
+struct kc_histogram {
+	atomic64_t count;
+	atomic64_t total_ns;
+	atomic64_t max_ns;
+	atomic64_t buckets[KC_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * What a peripheral has been up to, shown in debugfs
+*/
+struct kc_peripheral_stats {
+	// Times it was acquired, by fds starting a message or by the driver
+	atomic64_t acquires;
+	atomic64_t bytes;
+	// Digests computed
+	atomic64_t messages;
+	// Time spent acquired by someone
+	atomic64_t busy_ns;
+	// Time waited by those who acquired it
+	atomic64_t acquire_wait_ns;
+	// Reads of the status register while waiting for digests
+	atomic64_t poll_iterations;
+
+	struct kc_histogram acquire_wait;
+	// Duration of the write system calls
+	struct kc_histogram write;
+	// From sending the last packet to the digest being ready
+	struct kc_histogram digest;
+};
+
+/**
+ * Peripheral time used by a user, for fair sharing
+*/
+struct kc_uid_share {
+	struct list_head node;
+	kuid_t uid;
+	uint32_t weight;
+	// Nanoseconds of peripheral time, scaled by the weight
+	uint64_t vtime;
+};
+
+/**
+ * A process sleeping until someone hands it a peripheral. The queues
+ * are kept in arrival order, so the position in them is its ticket.
+*/
+struct kc_waiter {
+	struct list_head node;
+	struct task_struct *task;
+	struct kc_uid_share *share;
+	// Set to the peripheral handed to the waiter
+	int index;
+};
+
 /**
  * Struct representing a peripheral
 */
@@ -92,27 +223,98 @@ struct ketchup_device {
 	void __iomem *input;
 	void __iomem *command;
 	void __iomem *output_base;
+	void __iomem *nonce_base;
 
-	char data_to_send[4];
+	uint8_t data_to_send[4];
 	int data_to_send_length;
 
-	Availability peripheral_available;
 	pid_t current_process;
 	HashSize hash_size;
+
+	// Position in registered_devices
+	int index;
+
+	// When the peripheral was acquired, and with fair sharing
+	// the user to charge the time it's held for
+	uint64_t bound_at;
+	struct kc_uid_share *share;
+
+	struct kc_peripheral_stats stats;
+
+	// Submission ring of the fd that owns this peripheral, if it set one up.
+	// While it exists, the peripheral is only driven by the ring workers.
+	struct kc_ring *ring;
+
+	// Set once the fd that owns this peripheral sends an io_uring command,
+	// from then on the peripheral is only used to serve those.
+	bool uring_mode;
+	// Bit 0 is held by the io_uring request using the peripheral
+	unsigned long uring_busy;
+
+	// Queue of crypto API requests, see kc_ahash_enqueue
+	struct crypto_engine *engine;
+
+	// /dev/ketchup/coreN, whose sysfs directory has the attributes of the peripheral
+	struct device *core_device;
 };
 
 /**
  * This is a collection of all registered peripherals
 */ 
 struct ketchup_devices_container {
-	// Used to protect the registered_devices array
+	// Used to protect the registered_devices array while
+	// peripherals are added or removed
 	struct mutex array_write_lock;
 
-	// Used to make sure that only registered_devices_len
-	// processes at a time can access a peripheral
-	struct semaphore dev_free_sema;
-
-	struct ketchup_device *registered_devices[MAX_DEVICES];
+	// One bit per peripheral, set while someone is using it.
+	// Peripherals are taken and given back with atomic bit
+	// operations alone, without taking array_write_lock
+	unsigned long busy_map[BITS_TO_LONGS(MAX_DEVICES)];
+
+	// Peripherals pinned through their /dev/ketchup/coreN node, or
+	// waiting to be. They're never handed out to anybody else
+	unsigned long pinned_map[BITS_TO_LONGS(MAX_DEVICES)];
+
+	// Woken up whenever a peripheral is released, for poll
+	wait_queue_head_t dev_free_wait;
+
+	// Protects everything below but the statistics
+	spinlock_t wait_lock;
+
+	// Processes waiting for a peripheral, one queue per priority class.
+	// Released peripherals are handed straight to them, so that
+	// nobody can take one while there's someone waiting
+	struct list_head waiters[KC_PRIO_CLASSES];
+	int waiting;
+
+	// Per user accounting of the peripheral time. When fair sharing is on,
+	// the waiter whose user used the least time is served first
+	bool fair_share;
+	struct list_head shares;
+	uint64_t min_vtime;
+
+	// How long the processes of each class waited for a peripheral
+	struct kc_histogram wait_stats[KC_PRIO_CLASSES];
+
+	// How many times a fd got a peripheral and gave it back,
+	// exposed in sysfs to keep an eye on the binding rate
+	atomic64_t binds;
+	atomic64_t unbinds;
+
+	// Messages longer than this many bytes can't move from the software
+	// fallback to a peripheral anymore. 0 turns the fallback off
+	size_t fallback_threshold;
+
+	// Messages started in software, and moved to a peripheral later on.
+	// Out of the digests read, soft_digests were computed in software
+	atomic64_t fallbacks;
+	atomic64_t migrations;
+	atomic64_t digests;
+	atomic64_t soft_digests;
+
+	// Indexed by the position of the peripherals, which are only added
+	// at the end. Lookups don't take any lock, see kc_device
+	struct xarray registered_devices;
 	size_t registered_devices_len;
 };
 
@@ -133,11 +335,39 @@ static struct char_dev {
 	// show up inside /dev
     struct device *registered_device;
 
+	// Same, but for /dev/ketchup_handle
+    struct device *handle_device;
+
+	// /dev/ketchup/sha3-512 to /dev/ketchup/sha3-224, NULL if they couldn't be created
+	struct device *algorithm_devices[4];
+
 	// This is a container for all registered peripherals,
 	// with some concurrency primitives to keep processes 
 	// from accessing the same peripheral at the same time
 	struct ketchup_devices_container devices;
 
+	// Where the submission rings are drained
+	struct workqueue_struct *ring_wq;
+
+	// Software SHA3 of each HashSize, for the fallback. NULL if
+	// the kernel doesn't have it, then there's no fallback
+	struct crypto_shash *soft_tfm[4];
+
+	// Registered as a crypto API provider, and the
+	// engine the next crypto request goes to
+	bool crypto_registered;
+	atomic_t crypto_next;
+	// Set while the peripherals are removed, so that new crypto requests are
+	// hashed in software, and how many requests are still on the engines
+	bool crypto_stopping;
+	atomic_t crypto_queued;
+	wait_queue_head_t crypto_idle;
+
+	// /sys/kernel/debug/ketchup, with the peripheral statistics,
+	// and when they were last reset
+	struct dentry *debugfs_dir;
+	uint64_t stats_since;
+
 } ketchup_drvr_data = {
 	.driver_class = NULL,
 };
@@ -145,105 +375,344 @@ static struct char_dev {
 
 // ======================= Character Device ========================
 
+/**
+ * Looks up a peripheral by its index. Peripherals are only removed all
+ * together when the driver goes away, so the pointer stays valid after
+ * the lookup, and the lookup itself is lockless.
+*/
+static inline struct ketchup_device *kc_device(int index)
+{
+	return xa_load(&ketchup_drvr_data.devices.registered_devices, index);
+}
+
 /**
  * Completely clears all the internal state of a given peripheral
 */
 static void peripheral_clear(struct ketchup_device *device) {
-	device->peripheral_available = AVAILABLE;
 	device->current_process = 0;
 	device->data_to_send_length = 0;
 	device->hash_size = HASH_512;
+	// The next fd to bind it hasn't sent any io_uring command yet
+	WRITE_ONCE(device->uring_mode, false);
 
 	// Clears internal state and output
 	writel(1, device->command);
 }
 
 /**
- * This function is called only by ketchup_open.
+ * Tries to take a free peripheral, without ever sleeping.
+ * Returns its index, or -EAGAIN if they're all taken.
+*/
+static int peripheral_try_claim(struct ketchup_devices_container *container)
+{
+	// Pairs with the release in probe, so the device is there if its bit is
+	size_t len = smp_load_acquire(&container->registered_devices_len);
+	unsigned long index;
+
+	for (index = find_first_zero_bit(container->busy_map, len); index < len;
+	     index = find_next_zero_bit(container->busy_map, len, index + 1)) {
+		// Kept free for the fd that's waiting to pin it
+		if (test_bit(index, container->pinned_map)) {
+			continue;
+		}
+
+		// Someone else might have taken it after we found it
+		if (!test_and_set_bit_lock(index, container->busy_map)) {
+			return index;
+		}
+	}
+
+	return -EAGAIN;
+}
+
+/**
+ * Adds a sample to a histogram
+*/
+static void kc_histogram_record(struct kc_histogram *histogram, uint64_t ns)
+{
+	uint64_t us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = us ? min(ilog2(us) + 1, KC_HISTOGRAM_BUCKETS - 1) : 0;
+	s64 max = atomic64_read(&histogram->max_ns), seen;
+
+	atomic64_inc(&histogram->count);
+	atomic64_add(ns, &histogram->total_ns);
+	atomic64_inc(&histogram->buckets[bucket]);
+
+	while ((s64)ns > max) {
+		seen = atomic64_cmpxchg(&histogram->max_ns, max, ns);
+		if (seen == max) {
+			break;
+		}
+		max = seen;
+	}
+}
+
+static void kc_histogram_reset(struct kc_histogram *histogram)
+{
+	atomic64_set(&histogram->count, 0);
+	atomic64_set(&histogram->total_ns, 0);
+	atomic64_set(&histogram->max_ns, 0);
+	for (int bucket = 0; bucket < KC_HISTOGRAM_BUCKETS; bucket++) {
+		atomic64_set(&histogram->buckets[bucket], 0);
+	}
+}
+
+static inline uint64_t kc_waiter_vtime(const struct kc_waiter *waiter)
+{
+	return waiter->share ? waiter->share->vtime : 0;
+}
+
+/**
+ * Chooses who gets the next free peripheral: the first waiter of the most
+ * urgent class or, with fair sharing, the one in that class whose user used
+ * the least peripheral time. Called with wait_lock held.
+*/
+static struct kc_waiter *kc_pick_waiter(struct ketchup_devices_container *container)
+{
+	struct kc_waiter *waiter, *best = NULL;
+
+	for (int class = 0; class < KC_PRIO_CLASSES; class++) {
+		if (list_empty(&container->waiters[class])) {
+			continue;
+		}
+
+		if (!container->fair_share) {
+			return list_first_entry(&container->waiters[class], struct kc_waiter, node);
+		}
+
+		// On a tie, the one that's been waiting the longest wins
+		list_for_each_entry(waiter, &container->waiters[class], node) {
+			if (!best || kc_waiter_vtime(waiter) < kc_waiter_vtime(best)) {
+				best = waiter;
+			}
+		}
+		return best;
+	}
+
+	return NULL;
+}
+
+/**
+ * Hands free peripherals to the waiters until we run out of either.
+ * Called with wait_lock held.
+*/
+static void peripheral_dispatch_locked(struct ketchup_devices_container *container)
+{
+	struct kc_waiter *waiter;
+	struct task_struct *task;
+	int index;
+
+	while ((waiter = kc_pick_waiter(container)) != NULL) {
+		index = peripheral_try_claim(container);
+		if (index < 0) {
+			return;
+		}
+
+		list_del(&waiter->node);
+		container->waiting--;
+		if (kc_waiter_vtime(waiter) > container->min_vtime) {
+			container->min_vtime = kc_waiter_vtime(waiter);
+		}
+
+		// As soon as it sees the index the waiter can return, and
+		// the task could even exit before we get to wake it up
+		task = waiter->task;
+		get_task_struct(task);
+		smp_store_release(&waiter->index, index);
+		wake_up_process(task);
+		put_task_struct(task);
+	}
+}
+
+static void peripheral_dispatch(struct ketchup_devices_container *container)
+{
+	spin_lock(&container->wait_lock);
+	peripheral_dispatch_locked(container);
+	spin_unlock(&container->wait_lock);
+}
+
+/**
+ * Queues the calling process in its priority class, and sleeps until
+ * it's handed a peripheral. Returns its index, or -EINTR.
+*/
+static int peripheral_wait(struct ketchup_devices_container *container, PriorityClass class, struct kc_uid_share *share)
+{
+	struct kc_waiter waiter = {
+		.task = current,
+		.share = share,
+		.index = -1,
+	};
+
+	spin_lock(&container->wait_lock);
+
+	// A user coming back after a while doesn't get to
+	// make up for all the time it didn't use
+	if (share && share->vtime < container->min_vtime) {
+		share->vtime = container->min_vtime;
+	}
+
+	list_add_tail(&waiter.node, &container->waiters[class]);
+	container->waiting++;
+
+	// Pairs with peripheral_release: either it sees us waiting,
+	// or we see the peripheral it released
+	smp_mb();
+	peripheral_dispatch_locked(container);
+
+	spin_unlock(&container->wait_lock);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (smp_load_acquire(&waiter.index) >= 0) {
+			break;
+		}
+
+		if (signal_pending(current)) {
+			spin_lock(&container->wait_lock);
+			// We might have been handed one in the meantime
+			if (waiter.index < 0) {
+				list_del(&waiter.node);
+				container->waiting--;
+			}
+			spin_unlock(&container->wait_lock);
+
+			if (waiter.index < 0) {
+				__set_current_state(TASK_RUNNING);
+				return -EINTR;
+			}
+			break;
+		}
+
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return waiter.index;
+}
+
+/**
+ * Sets up a peripheral that was just taken by the calling process, which
+ * started waiting for it at start. The time it's held for is charged to share.
+*/
+static void peripheral_assign(struct ketchup_device *curr_device, uint64_t start, struct kc_uid_share *share)
+{
+	uint64_t waited;
+
+	// First clear all previous state
+	peripheral_clear(curr_device);
+
+	// Assign peripheral to owner process
+	curr_device->current_process = task_pid_nr(current);
+
+	// Set the default hash size
+	curr_device->hash_size = HASH_512;
+
+	curr_device->share = share;
+	curr_device->bound_at = ktime_get_ns();
+
+	waited = curr_device->bound_at - start;
+	atomic64_inc(&curr_device->stats.acquires);
+	atomic64_add(waited, &curr_device->stats.acquire_wait_ns);
+	kc_histogram_record(&curr_device->stats.acquire_wait, waited);
+	trace_ketchup_acquire_finish(curr_device->index, waited);
+}
+
+/**
+ * Called whenever a fd starts a message, and by the ring and io_uring workers.
  * Checks if any peripherals are available to use, and assigns one
  * to the process requesting it. If there are none, it either makes
  * the process sleep until one becomes available, or if nonblocking
  * behaviour is requested returns -EAGAIN. 
+ * Sleeping processes are served by priority class, and in arrival order
+ * within a class. The time the peripheral is held for is charged to share,
+ * if there is one.
  * This returns the index of the assigned peripheral on success.
 */
-static int peripheral_acquire(int should_block) 
+static int peripheral_acquire_as(int should_block, PriorityClass class, struct kc_uid_share *share)
 {
-	int i, found, assigned_index;
-	int down_retval, is_sig;
-	struct ketchup_device *curr_device;
 	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	int index = -EAGAIN;
+	uint64_t start = ktime_get_ns();
 
 	pid_t pid = task_pid_nr(current);
 
 	kc_info("[peripheral_acquire] task %d trying to acquire peripheral (blocking = %d)\n", pid, should_block);
+	trace_ketchup_acquire_start(should_block, class);
 
-	if (should_block) {
-		kc_info("[peripheral_acquire] task %d before locking\n", pid);
-		// Block if all peripherals are taken
-		down_retval = down_interruptible(&container->dev_free_sema);
-		kc_info("[peripheral_acquire] task %d got unblocked. down_retval = %d\n", pid, down_retval);
-
-		// We should immediately return if it was a signal that unblocked us
-        for (i = 0; i < _NSIG_WORDS && !is_sig; i++)  {
-            is_sig = current->pending.signal.sig[i] & ~current->blocked.sig[i]; 
-        }
-
-        if (is_sig || down_retval != 0) {
-			kc_err(
-				"[peripheral_acquire] something interrupted task %d. is_sig = %d, down_retval = %d",
-				pid, is_sig, down_retval
-			);
+	// If someone is waiting, the next free peripheral is theirs
+	if (!READ_ONCE(container->waiting)) {
+		index = peripheral_try_claim(container);
+	}
 
-            return -EINTR;
-        }
-	} else {
-		down_retval = down_trylock(&container->dev_free_sema);
+	if (index < 0 && should_block) {
+		index = peripheral_wait(container, class, share);
 
-		if (down_retval != 0) {
-			// Not enough available peripherals
-			return -EAGAIN;
+		if (index < 0) {
+			kc_err("[peripheral_acquire] something interrupted task %d while waiting\n", pid);
+			trace_ketchup_acquire_finish(index, ktime_get_ns() - start);
+			return index;
 		}
 	}
 
-	mutex_lock(&container->array_write_lock);
-	kc_info("[peripheral_acquire] task %d acquired lock. Searching for free peripheral\n", pid);
-
-	found = 0;
-	for (i = 0; i < container->registered_devices_len; i++) {
-		curr_device = container->registered_devices[i];
+	if (index < 0) {
+		// Not enough available peripherals
+		trace_ketchup_acquire_finish(-EAGAIN, 0);
+		return -EAGAIN;
+	}
 
-		if (curr_device->peripheral_available == AVAILABLE) {
-			// We found a suitable peripheral
+	peripheral_assign(kc_device(index), start, share);
 
-			found = 1;
-			assigned_index = i;
+	kc_info("[peripheral_acquire] task %d got device %d\n", pid, index);
+	return index;
+}
 
-			// First clear all previous state
-			peripheral_clear(curr_device);
+/**
+ * Same, for the peripherals the driver borrows for itself
+*/
+static int peripheral_acquire(int should_block)
+{
+	return peripheral_acquire_as(should_block, KC_PRIO_NORMAL, NULL);
+}
 
-			// Make sure no other process can take this peripheral
-			curr_device->peripheral_available = NOT_AVAILABLE;
+/**
+ * Takes one peripheral in particular, for the fds opened through its
+ * /dev/ketchup/coreN node. It's marked as pinned first, so that once it's
+ * released it isn't handed to the processes waiting for any peripheral,
+ * and then we wait for whoever has it to give it back.
+ * Returns 0, or -EBUSY if someone else pinned it, -EAGAIN or -ERESTARTSYS.
+*/
+static int peripheral_pin(int index, int should_block)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	uint64_t start = ktime_get_ns();
+	int error = 0;
 
-			// Assign peripheral to owner process
-			curr_device->current_process = task_pid_nr(current);
-			
-			// Set the default hash size
-			curr_device->hash_size = HASH_512;
-			
-			kc_info("[peripheral_acquire] assigned device %d to process %d.\n", i, task_pid_nr(current));
-			break;
-		}
+	if (test_and_set_bit(index, container->pinned_map)) {
+		return -EBUSY;
 	}
 
-	mutex_unlock(&container->array_write_lock);
+	trace_ketchup_acquire_start(should_block, KC_PRIO_LATENCY);
 
-	if (found) {
-		kc_info("[peripheral_acquire] task %d got device %d\n", pid, assigned_index);
-		return assigned_index;
-	} else {
-		kc_err("[assign_peripheral] could not assign peripheral to process %d past the lock.\n", task_pid_nr(current));
-		return -ENODEV;
+	// peripheral_release wakes up dev_free_wait after clearing the bit
+	if (should_block) {
+		error = wait_event_interruptible(
+			container->dev_free_wait,
+			!test_and_set_bit_lock(index, container->busy_map)
+		);
+	} else if (test_and_set_bit_lock(index, container->busy_map)) {
+		error = -EAGAIN;
+	}
+
+	if (error) {
+		clear_bit(index, container->pinned_map);
+		trace_ketchup_acquire_finish(error, ktime_get_ns() - start);
+		return error;
 	}
+
+	peripheral_assign(kc_device(index), start, NULL);
+
+	kc_info("[peripheral_pin] task %d pinned device %d\n", current->pid, index);
+	return 0;
 }
 
 /** 
@@ -252,84 +721,420 @@ static int peripheral_acquire(int should_block)
 */
 static void peripheral_release(int index)
 {
-	struct ketchup_device *curr_device;
-	struct ketchup_devices_container *container;
-
-	container = &ketchup_drvr_data.devices;
-	mutex_lock(&container->array_write_lock);
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct ketchup_device *curr_device = kc_device(index);
+	uint64_t held = ktime_get_ns() - curr_device->bound_at;
 
 	kc_info("[peripheral_release] releasing device %d\n", index);
-	curr_device = container->registered_devices[index];
+	trace_ketchup_release(index, held);
+
+	atomic64_add(held, &curr_device->stats.busy_ns);
+
+	// Charge the user for the time it held the peripheral
+	if (curr_device->share) {
+		spin_lock(&container->wait_lock);
+		curr_device->share->vtime += div_u64(held * KC_SHARE_DEFAULT_WEIGHT, curr_device->share->weight);
+		spin_unlock(&container->wait_lock);
+
+		curr_device->share = NULL;
+	}
 
 	peripheral_clear(curr_device);
 
-	mutex_unlock(&container->array_write_lock);
-	up(&container->dev_free_sema);
+	// Orders the clear before the peripheral can be taken again
+	clear_bit_unlock(index, container->busy_map);
+
+	// Pairs with peripheral_wait
+	smp_mb__after_atomic();
+	if (READ_ONCE(container->waiting)) {
+		peripheral_dispatch(container);
+	}
+
+	// Let pollers of acquire handles know
+	wake_up_interruptible(&container->dev_free_wait);
+}
+
+/**
+ * Tells whether a peripheral could be acquired right now, without taking it.
+ * Only a hint, another process could get there first.
+*/
+static bool peripheral_any_available(void)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	size_t len = smp_load_acquire(&container->registered_devices_len);
+	DECLARE_BITMAP(taken, MAX_DEVICES);
+
+	if (READ_ONCE(container->waiting)) {
+		return false;
+	}
+
+	// Pinned peripherals aren't for us even when they're free
+	bitmap_or(taken, container->busy_map, container->pinned_map, len);
+	return find_first_zero_bit(taken, len) < len;
+}
+
+/**
+ * State of an open file descriptor. A fd only holds a peripheral while
+ * it's in the middle of a message: it gets one on the first write and
+ * gives it back as soon as the digest is read.
+*/
+struct kc_session {
+	// Peripheral bound to the fd, or -1 between messages
+	int peripheral_index;
+
+	// Hash size of the next message, applied to the peripheral on binding
+	HashSize hash_size;
+
+	// Priority class when waiting for a peripheral
+	PriorityClass priority;
+
+	// Set once a ring or io_uring commands take over the peripheral,
+	// which then stays bound until the fd is closed
+	bool persistent;
+
+	// Opened through /dev/ketchup_handle: poll reserves a peripheral
+	bool handle;
+
+	// Opened through /dev/ketchup/coreN: the fd holds that peripheral
+	// from open to close, and nobody else gets to use it
+	bool pinned;
+
+	// Set from the first write of a message on a peripheral until its digest is read
+	bool in_message;
+
+	// Set when a non-blocking read sent the last
+	// packet, but the digest wasn't ready yet
+	bool finalizing;
+	uint64_t finalize_start;
+	wait_queue_head_t digest_wait;
+	struct delayed_work digest_check;
+
+	// Software hash serving the message when no peripheral was free.
+	// Until the message gets longer than the fallback threshold, what it
+	// absorbed is kept in replay, to send it to a peripheral if one frees up
+	struct shash_desc *soft;
+	uint8_t *replay;
+	size_t replay_length;
+	size_t replay_capacity;
+
+	// Mappings of the registers, which keep the peripheral bound
+	atomic_t mmio_maps;
+
+	// Small writes are copied here. It's too big for the stack of a write,
+	// which can already be deep under io_uring or splice
+	uint8_t buffer[KC_BUF_SIZE];
+};
+
+/**
+ * Small utility that retrieves the index of the peripheral owned by a fd
+*/
+static inline int kc_get_index(struct file *filep) {
+	struct kc_session *session = filep->private_data;
+	return READ_ONCE(session->peripheral_index);
 }
 
 /**
  * Small utility that retrieves a pointer to the peripheral owned by a fd
 */
 static inline struct ketchup_device *kc_get_device(struct file *filep) {
-	int assigned_periph_index = (int)(uintptr_t)filep->private_data;
-	return ketchup_drvr_data.devices.registered_devices[assigned_periph_index];
+	return kc_device(kc_get_index(filep));
 }
 
 /**
- * This is the function that is called whenever a new open syscall is made to our
- * driver device file (/dev/kechtup_driver).
+ * Once an fd hands its peripheral over to a submission ring or to io_uring
+ * commands, it can't be used for plain hashes anymore
 */
-static int ketchup_open(struct inode *inod, struct file *fil)
+static inline bool kc_peripheral_delegated(struct ketchup_device *device)
 {
-	/**
-	 * When a new file descriptor is opened we need to search for an available 
-	 * peripheral that can serve the request.
-	 * If all the peripherals are already assigned, we return -EAGAIN
-	*/
-	int should_block = (fil->f_flags & O_NONBLOCK) == 0;
+	return READ_ONCE(device->ring) || READ_ONCE(device->uring_mode);
+}
 
-	int assigned_peripheral = peripheral_acquire(should_block);
+/**
+ * The priority class the fd waits in, from the nice value of the task unless it picked one
+*/
+static PriorityClass kc_session_class(struct kc_session *session)
+{
+	PriorityClass priority = READ_ONCE(session->priority);
 
-	if (assigned_peripheral < 0) {
-		return assigned_peripheral;
+	if (priority != KC_PRIO_AUTO) {
+		return priority;
 	}
 
-	// Save index for read and write
-	fil->private_data = (void*)(uintptr_t)assigned_peripheral;
-
-	return 0;
+	if (task_nice(current) < 0) {
+		return KC_PRIO_LATENCY;
+	} else if (task_nice(current) > 0) {
+		return KC_PRIO_BULK;
+	}
+	return KC_PRIO_NORMAL;
 }
 
-
 /**
- * #define "ioctl name" __IOX("magic number","command number","argument type")
- * where IOX can be :
- * - “IO“: an ioctl with no parameters
- * - “IOW“: an ioctl with write parameters (copy_from_user)
- * - “IOR“: an ioctl with read parameters (copy_to_user)
- * - “IOWR“: an ioctl with both write and read parameters
- * The Magic Number is a unique number or character that will differentiate our set of ioctl calls 
- * from the other ioctl calls. some times the major number for the device is used here.
- * Command Number is the number that is assigned to the ioctl. This is used to differentiate the 
- * commands from one another in case of an ioctl to the wrong device.
- * We chose 0xFC only because it's not used by anything else in the kernel by default.
- * The last is the type of data.
+ * Finds the fair sharing entry of a user, creating it the first time.
+ * Returns NULL if there's no memory for it, the user then just isn't charged.
 */
-#define WR_PERIPH_HASH_SIZE _IOW(0xFC, 1, uint32_t*)
-#define RD_PERIPH_HASH_SIZE _IOR(0xFC, 2, uint32_t*)
+static struct kc_uid_share *kc_uid_share_get(kuid_t uid)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct kc_uid_share *share, *fresh;
 
-static long ketchup_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+	spin_lock(&container->wait_lock);
+	list_for_each_entry(share, &container->shares, node) {
+		if (uid_eq(share->uid, uid)) {
+			spin_unlock(&container->wait_lock);
+			return share;
+		}
+	}
+	spin_unlock(&container->wait_lock);
+
+	fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+	if (!fresh) {
+		return NULL;
+	}
+	fresh->uid = uid;
+	fresh->weight = KC_SHARE_DEFAULT_WEIGHT;
+
+	// Someone else could have added it while we weren't looking
+	spin_lock(&container->wait_lock);
+	list_for_each_entry(share, &container->shares, node) {
+		if (uid_eq(share->uid, uid)) {
+			spin_unlock(&container->wait_lock);
+			kfree(fresh);
+			return share;
+		}
+	}
+	fresh->vtime = container->min_vtime;
+	list_add_tail(&fresh->node, &container->shares);
+	spin_unlock(&container->wait_lock);
+
+	return fresh;
+}
+
+/**
+ * Gives a peripheral to a fd that doesn't have one yet, set up
+ * with the hash size chosen for the message.
+ * Returns 0 if the fd has a peripheral, or a negative error code.
+*/
+static int kc_session_bind(struct file *filep, int should_block)
 {
-	uint32_t command;
-	int assigned_periph_index = (int)(uintptr_t)filp->private_data;
-	struct ketchup_device *curr_device = kc_get_device(filp);
-	
-	kc_info("[kekkac_ioctl] called!\n");
-	kc_info("[kekkac_ioctl] we are working on the peripheral with index %d\n", assigned_periph_index);
+	struct kc_session *session = filep->private_data;
+	struct ketchup_device *device;
+	struct kc_uid_share *share = NULL;
+	PriorityClass class;
+	uint64_t start;
+	int index;
+
+	if (kc_get_index(filep) >= 0) {
+		return 0;
+	}
 
-	switch (cmd) {
-		case WR_PERIPH_HASH_SIZE:
-			// The command is the hash size we want to write
+	class = kc_session_class(session);
+	if (READ_ONCE(ketchup_drvr_data.devices.fair_share)) {
+		share = kc_uid_share_get(current_uid());
+	}
+
+	start = ktime_get_ns();
+	index = peripheral_acquire_as(should_block, class, share);
+	if (index < 0) {
+		return index;
+	}
+	kc_histogram_record(&ketchup_drvr_data.devices.wait_stats[class], ktime_get_ns() - start);
+
+	device = kc_device(index);
+	device->hash_size = session->hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	// Two threads could be using the same fd
+	if (cmpxchg(&session->peripheral_index, -1, index) != -1) {
+		peripheral_release(index);
+		return 0;
+	}
+
+	atomic64_inc(&ketchup_drvr_data.devices.binds);
+	kc_info("[session_bind] task %d bound peripheral %d\n", current->pid, index);
+	trace_ketchup_bind(index, 0, device->hash_size);
+
+	return 0;
+}
+
+/**
+ * Gives the peripheral back to the pool once a message is done,
+ * unless it belongs to a ring or to io_uring commands.
+*/
+static void kc_session_unbind(struct file *filep)
+{
+	struct kc_session *session = filep->private_data;
+	int index;
+
+	if (session->persistent) {
+		return;
+	}
+
+	index = xchg(&session->peripheral_index, -1);
+	if (index < 0) {
+		return;
+	}
+
+	peripheral_release(index);
+	atomic64_inc(&ketchup_drvr_data.devices.unbinds);
+}
+
+/**
+ * Common checks at the start of a plain hash operation: the fd needs
+ * a peripheral, which must not be in use by a ring or by io_uring.
+ * Writes also can't happen while a non-blocking read is finishing the hash.
+*/
+static int kc_session_prepare(struct file *filep, bool writing)
+{
+	struct kc_session *session = filep->private_data;
+	int error;
+
+	// The message started in software, it must finish there
+	if (session->soft) {
+		return -EBUSY;
+	}
+
+	error = kc_session_bind(filep, (filep->f_flags & O_NONBLOCK) == 0);
+	if (error) {
+		return error;
+	}
+
+	if (kc_peripheral_delegated(kc_get_device(filep))) {
+		return -EBUSY;
+	}
+
+	if (writing && session->finalizing) {
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static void kc_session_digest_check(struct work_struct *work)
+{
+	struct kc_session *session = container_of(to_delayed_work(work), struct kc_session, digest_check);
+
+	wake_up_interruptible(&session->digest_wait);
+}
+
+/**
+ * Binds the peripheral of a /dev/ketchup/coreN node to a fd being opened,
+ * for as long as the fd exists
+*/
+static int kc_session_pin(struct kc_session *session, int index, int should_block)
+{
+	struct ketchup_device *device;
+	int error;
+
+	if (index >= smp_load_acquire(&ketchup_drvr_data.devices.registered_devices_len)) {
+		return -ENODEV;
+	}
+
+	error = peripheral_pin(index, should_block);
+	if (error) {
+		return error;
+	}
+
+	device = kc_device(index);
+	device->hash_size = session->hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	session->peripheral_index = index;
+	session->persistent = true;
+	session->pinned = true;
+
+	atomic64_inc(&ketchup_drvr_data.devices.binds);
+	trace_ketchup_bind(index, 0, device->hash_size);
+
+	return 0;
+}
+
+/**
+ * This is the function that is called whenever a new open syscall is made to our
+ * driver device file (/dev/kechtup_driver).
+*/
+static int ketchup_open(struct inode *inod, struct file *fil)
+{
+	/**
+	 * Opening doesn't take a peripheral: the fd gets one on the first
+	 * write of a message, and gives it back after reading the digest.
+	 * This way a process keeping its fd open between messages doesn't
+	 * keep the others waiting.
+	*/
+	struct kc_session *session;
+	unsigned int minor = iminor(inod) - MINOR(ketchup_drvr_data.device_number);
+	int error;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session) {
+		return -ENOMEM;
+	}
+
+	session->peripheral_index = -1;
+	session->hash_size = HASH_512;
+	session->priority = KC_PRIO_AUTO;
+	init_waitqueue_head(&session->digest_wait);
+	INIT_DELAYED_WORK(&session->digest_check, kc_session_digest_check);
+
+	// Acquire handles (/dev/ketchup_handle) reserve a peripheral
+	// for the next message as soon as poll finds one free
+	session->handle = minor == KC_MINOR_HANDLE;
+
+	// /dev/ketchup/sha3-N come with their hash size, which saves the
+	// WR_PERIPH_HASH_SIZE ioctl, and they're in HashSize order
+	if (minor >= KC_MINOR_ALGORITHMS && minor < KC_MINOR_CORES) {
+		session->hash_size = minor - KC_MINOR_ALGORITHMS;
+	}
+
+	// Unlike the others, /dev/ketchup/coreN binds its peripheral right away
+	if (minor >= KC_MINOR_CORES) {
+		error = kc_session_pin(session, minor - KC_MINOR_CORES, (fil->f_flags & O_NONBLOCK) == 0);
+		if (error) {
+			kfree(session);
+			return error;
+		}
+	}
+
+	fil->private_data = session;
+
+	return 0;
+}
+
+/**
+ * #define "ioctl name" __IOX("magic number","command number","argument type")
+ * where IOX can be :
+ * - “IO“: an ioctl with no parameters
+ * - “IOW“: an ioctl with write parameters (copy_from_user)
+ * - “IOR“: an ioctl with read parameters (copy_to_user)
+ * - “IOWR“: an ioctl with both write and read parameters
+ * The Magic Number is a unique number or character that will differentiate our set of ioctl calls 
+ * from the other ioctl calls. some times the major number for the device is used here.
+ * Command Number is the number that is assigned to the ioctl. This is used to differentiate the 
+ * commands from one another in case of an ioctl to the wrong device.
+ * We chose 0xFC only because it's not used by anything else in the kernel by default.
+ * The last is the type of data.
+*/
+#define WR_PERIPH_HASH_SIZE _IOW(0xFC, 1, uint32_t*)
+#define RD_PERIPH_HASH_SIZE _IOR(0xFC, 2, uint32_t*)
+#define RW_PERIPH_NONCE_SEARCH _IOWR(0xFC, 3, struct kc_nonce_search*)
+#define RW_PERIPH_HASH_FILE _IOWR(0xFC, 4, struct kc_hash_file*)
+#define RW_PERIPH_RING_SETUP _IOWR(0xFC, 5, struct kc_ring_setup*)
+#define WR_PERIPH_RING_ENTER _IOW(0xFC, 6, uint32_t*)
+#define WR_PERIPH_PRIORITY _IOW(0xFC, 7, uint32_t*)
+
+static long ketchup_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct kc_session *session = filp->private_data;
+	uint32_t command;
+	struct ketchup_device *curr_device;
+	bool was_bound;
+	long error;
+
+	kc_info("[kekkac_ioctl] called!\n");
+	kc_info("[kekkac_ioctl] we are working on the peripheral with index %d\n", kc_get_index(filp));
+
+	switch (cmd) {
+		case WR_PERIPH_HASH_SIZE:
+			// The command is the hash size we want to write
 			if (copy_from_user(&command, (int32_t*) arg, sizeof(command))) {
 				kc_err("[kekkac_ioctl] error copying the command\n");
 				return -1;
@@ -338,18 +1143,92 @@ static long ketchup_ioctl(struct file *filp, unsigned int cmd, unsigned long arg
 				kc_err("[kekkac_ioctl] invalid hash size!\n");
 				return -EINVAL;
 			}
+
+			// Changing the hash size would break the hash a non-blocking read
+			// is finishing, or the one a message started in software
+			if (session->finalizing || session->soft) {
+				return -EBUSY;
+			}
+			session->hash_size = command;
+
+			// Between messages there's no peripheral yet, it gets this hash size on binding
+			if (kc_get_index(filp) < 0) {
+				break;
+			}
+
+			// Once there's a ring, the peripheral belongs to it
+			curr_device = kc_get_device(filp);
+			if (kc_peripheral_delegated(curr_device)) {
+				return -EBUSY;
+			}
 			curr_device->hash_size = command;
 			command = command << 4;
 			writel(command, curr_device->control);
 			break;
 		case RD_PERIPH_HASH_SIZE:
 			// We want to return the value of the hash size
-			command = curr_device->hash_size;
+			command = session->hash_size;
 			if (copy_to_user((uint32_t *)arg, &command, sizeof(command))) {
 				kc_err("[keccak_ioctl] error copying data to user space");
 				return -1;
 			}
 			break;
+		case WR_PERIPH_PRIORITY:
+			// Only matters the next time the fd waits for a peripheral
+			if (get_user(command, (uint32_t __user *)arg)) {
+				return -EFAULT;
+			}
+			if (command >= KC_PRIO_CLASSES && command != KC_PRIO_AUTO) {
+				kc_err("[kekkac_ioctl] invalid priority class!\n");
+				return -EINVAL;
+			}
+			WRITE_ONCE(session->priority, command);
+			break;
+		case RW_PERIPH_NONCE_SEARCH:
+			// The search resets the peripheral, which would silently drop
+			// the part of a message that was already written to it
+			if (session->in_message) {
+				return -EBUSY;
+			}
+			// A search is a message of its own, so unless the fd keeps its
+			// peripheral anyway, it only stays bound for its duration
+			was_bound = kc_get_index(filp) >= 0;
+			error = kc_session_prepare(filp, true);
+			if (error) {
+				return error;
+			}
+			error = peripheral_nonce_search(kc_get_device(filp), (struct kc_nonce_search __user *)arg);
+			if (!was_bound) {
+				kc_session_unbind(filp);
+			}
+			return error;
+		case RW_PERIPH_HASH_FILE:
+			// Like a write, the digest is then collected with read
+			error = kc_session_prepare_message(filp, true);
+			if (error) {
+				return error;
+			}
+			return peripheral_hash_file(filp, (struct kc_hash_file __user *)arg);
+		case RW_PERIPH_RING_SETUP:
+			// The process is driving the peripheral through its registers
+			if (atomic_read(&session->mmio_maps)) {
+				return -EBUSY;
+			}
+			error = kc_session_prepare(filp, true);
+			if (error) {
+				return error;
+			}
+			error = peripheral_ring_setup(filp, (struct kc_ring_setup __user *)arg);
+			if (error == 0) {
+				session->persistent = true;
+			}
+			return error;
+		case WR_PERIPH_RING_ENTER:
+			// Without a peripheral there can't be a ring
+			if (kc_get_index(filp) < 0) {
+				return -ENXIO;
+			}
+			return peripheral_ring_enter(filp, (uint32_t __user *)arg);
 		default:
 			kc_err("[keccak_ioctl] we shouldn't be here\n");
 			return -EINVAL;
@@ -364,288 +1243,2871 @@ static long ketchup_ioctl(struct file *filp, unsigned int cmd, unsigned long arg
 #define kc_min(x, y) ((x) < (y) ? (x) : (y))
 
 /**
- * Packs a byte array into a big endian uint32_t number.
- * NOTE: This expects the array to be at least 4 long.
+ * Packs a byte array into a big endian uint32_t number.
+ * NOTE: This expects the array to be at least 4 long.
+*/
+static inline uint32_t pack_to_u32_big_endian(uint8_t const data[4]) {
+	return ((uint32_t)data[0] << 24)
+		 | ((uint32_t)data[1] << 16)
+		 | ((uint32_t)data[2] <<  8)
+		 | ((uint32_t)data[3]);
+}
+
+/**
+ * Runs a nonce search on the peripheral. The header template is loaded
+ * into the peripheral, and then we sleep until the search is over.
+ * The search can run for a long time, so we check for signals while
+ * waiting and abort the search if one arrives.
+*/
+static long peripheral_nonce_search(struct ketchup_device *device, struct kc_nonce_search __user *arg)
+{
+	struct kc_nonce_search search;
+	uint32_t words, status;
+
+	if (copy_from_user(&search, arg, sizeof(search))) {
+		kc_err("[nonce_search] error copying the search parameters\n");
+		return -EFAULT;
+	}
+
+	// The nonce must be word aligned and fully inside the header. The offset
+	// is checked on its own first, so that adding the width can't wrap around
+	if (search.header_length == 0 || search.header_length > NONCE_MAX_HEADER
+		|| search.nonce_width < 1 || search.nonce_width > 4
+		|| search.nonce_offset % 4 != 0
+		|| search.nonce_offset > search.header_length
+		|| search.nonce_width > search.header_length - search.nonce_offset) {
+		kc_err("[nonce_search] invalid search parameters\n");
+		return -EINVAL;
+	}
+
+	kc_info(
+		"[nonce_search] task %d searching over %u bytes, nonce at %u (%u bytes)\n",
+		current->pid, search.header_length, search.nonce_offset, search.nonce_width
+	);
+
+	// Start from a clean peripheral, with the selected hash size
+	writel(1, device->command);
+	writel(device->hash_size << 4, device->control);
+
+	// Load the header template
+	writel(0, device->nonce_base + NONCE_REG_ADDRESS);
+	words = (search.header_length + 3) / 4;
+	for (int i = 0; i < words; i++) {
+		writel(pack_to_u32_big_endian(&search.header[i * 4]), device->nonce_base + NONCE_REG_DATA);
+	}
+
+	writel(search.header_length, device->nonce_base + NONCE_REG_LENGTH);
+	writel(((search.nonce_width - 1) << 16) | (search.nonce_offset / 4), device->nonce_base + NONCE_REG_POSITION);
+	writel(search.nonce_start, device->nonce_base + NONCE_REG_START);
+	writel(search.max_attempts, device->nonce_base + NONCE_REG_LIMIT);
+	writel(search.target_high, device->nonce_base + NONCE_REG_TARGET_HIGH);
+	writel(search.target_low, device->nonce_base + NONCE_REG_TARGET_LOW);
+	writel(NONCE_CMD_START, device->nonce_base + NONCE_REG_CONTROL);
+
+	// Wait for the search to be over
+	status = readl(device->nonce_base + NONCE_REG_CONTROL);
+	while (status & NONCE_STATUS_BUSY) {
+		if (signal_pending(current)) {
+			kc_info("[nonce_search] task %d interrupted, aborting search\n", current->pid);
+			writel(NONCE_CMD_ABORT, device->nonce_base + NONCE_REG_CONTROL);
+			writel(1, device->command);
+			writel(device->hash_size << 4, device->control);
+			return -EINTR;
+		}
+
+		usleep_range(NONCE_POLL_MIN_US, NONCE_POLL_MAX_US);
+		status = readl(device->nonce_base + NONCE_REG_CONTROL);
+	}
+
+	search.found = (status & NONCE_STATUS_FOUND) != 0;
+	search.nonce = readl(device->nonce_base + NONCE_REG_RESULT);
+	search.attempts = readl(device->nonce_base + NONCE_REG_ATTEMPTS);
+
+	kc_info(
+		"[nonce_search] task %d done. found = %u, nonce = %u, attempts = %u\n",
+		current->pid, search.found, search.nonce, search.attempts
+	);
+
+	// Leave the peripheral ready for a normal hash
+	writel(1, device->command);
+	device->data_to_send_length = 0;
+	writel(device->hash_size << 4, device->control);
+
+	if (copy_to_user(arg, &search, sizeof(search))) {
+		kc_err("[nonce_search] error copying the result to user space\n");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/**
+ * Sends a kernel buffer to the peripheral's input register.
+ * First we complete the word left over from the previous call, then we stream
+ * all the whole words, and finally we keep the unaligned tail in data_to_send,
+ * to be sent either by the next call or as the last packet in ketchup_read.
+*/
+static void peripheral_send_bytes(struct ketchup_device *device, const uint8_t *data, size_t length)
+{
+	size_t words;
+
+	atomic64_add(length, &device->stats.bytes);
+	trace_ketchup_write_chunk(device->index, length, device->hash_size);
+
+	// 1. Complete the pending word
+	while (device->data_to_send_length > 0 && length > 0) {
+		device->data_to_send[device->data_to_send_length] = *data;
+		device->data_to_send_length++;
+		data++;
+		length--;
+
+		if (device->data_to_send_length == 4) {
+			writel(pack_to_u32_big_endian(device->data_to_send), device->input);
+			device->data_to_send_length = 0;
+		}
+	}
+
+	// 2. Stream the whole words. The input register expects big endian words,
+	// so we can't hand the buffer to iowrite32_rep as is, but like it we use
+	// relaxed writes to avoid a memory barrier for every single word.
+	// The writel that follows (either in here or in ketchup_read) orders them.
+	for (words = length / 4; words > 0; words--) {
+		writel_relaxed(get_unaligned_be32(data), device->input);
+		data += 4;
+	}
+	length %= 4;
+
+	// 3. Keep the tail. If we get here with some data left,
+	// the pending word has been completed in step 1.
+	if (length > 0) {
+		memcpy(device->data_to_send, data, length);
+		device->data_to_send_length = length;
+	}
+}
+
+// ====================== Software Fallback =======================
+
+static const char *const kc_soft_algorithms[] = { "sha3-512", "sha3-384", "sha3-256", "sha3-224" };
+
+/**
+ * Whether a fd that can't get a peripheral right now is served in software instead
+*/
+static inline bool kc_soft_enabled(struct kc_session *session)
+{
+	return READ_ONCE(ketchup_drvr_data.devices.fallback_threshold) > 0
+		&& ketchup_drvr_data.soft_tfm[session->hash_size];
+}
+
+/**
+ * Drops the software hash of a fd, along with what it kept to replay
+*/
+static void kc_soft_stop(struct kc_session *session)
+{
+	kfree_sensitive(session->soft);
+	session->soft = NULL;
+	kvfree(session->replay);
+	session->replay = NULL;
+	session->replay_length = 0;
+}
+
+/**
+ * Starts the message of a fd in software. Returns 0 on success,
+ * or a negative error code if there's no memory for it.
+*/
+static int kc_soft_start(struct kc_session *session, size_t threshold)
+{
+	struct crypto_shash *tfm = ketchup_drvr_data.soft_tfm[session->hash_size];
+	struct shash_desc *desc;
+	int error;
+
+	desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
+	if (!desc) {
+		return -ENOMEM;
+	}
+	desc->tfm = tfm;
+
+	error = crypto_shash_init(desc);
+	if (error) {
+		kfree(desc);
+		return error;
+	}
+
+	session->replay = kvmalloc(threshold, GFP_KERNEL);
+	if (!session->replay) {
+		kfree_sensitive(desc);
+		return -ENOMEM;
+	}
+	session->replay_capacity = threshold;
+	session->replay_length = 0;
+	session->soft = desc;
+
+	atomic64_inc(&ketchup_drvr_data.devices.fallbacks);
+	kc_info("[soft_start] task %d hashing in software\n", current->pid);
+
+	return 0;
+}
+
+/**
+ * Software counterpart of peripheral_send_bytes. Once the message
+ * outgrows the replay buffer, it's bound to finish in software.
+*/
+static void kc_soft_update(struct kc_session *session, const uint8_t *data, size_t length)
+{
+	// The generic SHA3 only fails on bad arguments
+	crypto_shash_update(session->soft, data, length);
+
+	if (!session->replay) {
+		return;
+	}
+
+	if (length > session->replay_capacity - session->replay_length) {
+		kvfree(session->replay);
+		session->replay = NULL;
+		return;
+	}
+
+	memcpy(session->replay + session->replay_length, data, length);
+	session->replay_length += length;
+}
+
+/**
+ * Moves a message served in software to a peripheral, if one is free and
+ * the message is still short enough: what was absorbed so far is sent
+ * to the peripheral again, and the software hash is dropped.
+*/
+static void kc_soft_try_migrate(struct file *filep)
+{
+	struct kc_session *session = filep->private_data;
+
+	// Never block here, nor jump ahead of those waiting
+	if (!session->replay || kc_session_bind(filep, 0) != 0) {
+		return;
+	}
+
+	peripheral_send_bytes(kc_get_device(filep), session->replay, session->replay_length);
+	kc_info(
+		"[soft_try_migrate] task %d moved %zu bytes to peripheral %d\n",
+		current->pid, session->replay_length, kc_get_index(filep)
+	);
+	kc_soft_stop(session);
+
+	atomic64_inc(&ketchup_drvr_data.devices.migrations);
+}
+
+/**
+ * Software counterpart of steps 1 to 5 of ketchup_read
+*/
+static ssize_t kc_soft_read(struct kc_session *session, char __user *user_buffer, size_t user_len)
+{
+	uint8_t digest[512/8];
+	size_t digest_size = crypto_shash_digestsize(session->soft->tfm);
+	int error;
+
+	if (user_len < digest_size) {
+		return -EINVAL;
+	}
+
+	error = crypto_shash_final(session->soft, digest);
+	kc_soft_stop(session);
+	if (error) {
+		return error;
+	}
+
+	atomic64_inc(&ketchup_drvr_data.devices.digests);
+	atomic64_inc(&ketchup_drvr_data.devices.soft_digests);
+
+	if (copy_to_user(user_buffer, digest, digest_size)) {
+		return -EFAULT;
+	}
+
+	return digest_size;
+}
+
+/**
+ * Like kc_session_prepare, for the operations that can be served in software.
+ * With the fallback on, a fd that can't get a peripheral right away starts the
+ * message in software instead of waiting, and each later write tries to move
+ * it to a peripheral. Reads don't, finishing in software is cheaper than replaying.
+*/
+static int kc_session_prepare_message(struct file *filep, bool writing)
+{
+	struct kc_session *session = filep->private_data;
+	int error;
+
+	if (session->soft) {
+		if (writing) {
+			kc_soft_try_migrate(filep);
+		}
+		if (session->soft) {
+			return 0;
+		}
+	} else if (kc_get_index(filep) < 0 && kc_soft_enabled(session)) {
+		if (kc_session_bind(filep, 0) != 0
+			&& kc_soft_start(session, READ_ONCE(ketchup_drvr_data.devices.fallback_threshold)) == 0) {
+			return 0;
+		}
+		// Without memory for the software hash we wait for a peripheral as usual
+	}
+
+	error = kc_session_prepare(filep, writing);
+	if (error == 0 && writing) {
+		session->in_message = true;
+	}
+
+	return error;
+}
+
+/**
+ * Feeds data of the current message to wherever it's being hashed
+*/
+static void kc_session_absorb(struct file *filep, const uint8_t *data, size_t length)
+{
+	struct kc_session *session = filep->private_data;
+
+	if (session->soft) {
+		kc_soft_update(session, data, length);
+	} else {
+		peripheral_send_bytes(kc_get_device(filep), data, length);
+	}
+}
+
+/**
+ * Small writes are copied in the buffer of the session, since for
+ * them pinning the user pages would cost more than the copy itself.
+*/
+static ssize_t peripheral_write_copy(struct file *filep, const char __user *user_buffer, size_t user_length)
+{
+	struct kc_session *session = filep->private_data;
+	uint8_t *buffer = session->buffer;
+	int error;
+
+	// 1. Copy from user space to kernel space the data to write
+	error = copy_from_user(buffer, user_buffer, user_length);
+	if (error != 0) {
+		kc_err("[ketchup_write] coudln't copy data from user. retval = %d\n", error);
+		return -EFAULT;
+	}
+	kc_info("[ketcuhp_write] copied %d bytes from userspace", user_length);
+
+	// 2. Send to peripheral in chunks of 4
+	kc_session_absorb(filep, buffer, user_length);
+
+	return user_length;
+}
+
+/**
+ * Large writes are sent straight from the user pages: we pin them in batches of
+ * KC_PIN_BATCH, map them one at a time and feed the peripheral from there.
+ * Between batches we let the scheduler run and check for signals, so that
+ * even a write of several gigabytes stays preemptible. If a signal arrives
+ * we return how much we've sent so far, like a pipe would.
+*/
+static ssize_t peripheral_write_pinned(struct file *filep, const char __user *user_buffer, size_t user_length)
+{
+	struct page *pages[KC_PIN_BATCH];
+	unsigned long address = (unsigned long)user_buffer;
+	size_t written = 0, page_offset, page_length;
+	uint8_t *page_data;
+	int to_pin, pinned;
+
+	while (written < user_length) {
+		if (written > 0) {
+			cond_resched();
+			if (signal_pending(current)) {
+				kc_info("[ketchup_write] task %d interrupted after %zu bytes\n", current->pid, written);
+				break;
+			}
+		}
+
+		page_offset = offset_in_page(address);
+		to_pin = kc_min(KC_PIN_BATCH, DIV_ROUND_UP(page_offset + user_length - written, PAGE_SIZE));
+
+		// We only read from these pages, so no FOLL_WRITE
+		pinned = pin_user_pages_fast(address & PAGE_MASK, to_pin, 0, pages);
+		if (pinned <= 0) {
+			kc_err("[ketchup_write] couldn't pin user pages. retval = %d\n", pinned);
+			if (written > 0) {
+				break;
+			}
+			return pinned < 0 ? pinned : -EFAULT;
+		}
+
+		for (int i = 0; i < pinned; i++) {
+			page_length = kc_min(PAGE_SIZE - page_offset, user_length - written);
+
+			page_data = kmap_local_page(pages[i]);
+			kc_session_absorb(filep, page_data + page_offset, page_length);
+			kunmap_local(page_data);
+
+			written += page_length;
+			address += page_length;
+			page_offset = 0;
+		}
+
+		unpin_user_pages(pages, pinned);
+	}
+
+	return written;
+}
+
+static ssize_t ketchup_write(struct file *filep, const char *user_buffer, size_t user_length, loff_t *off)
+{
+	/**
+	 * The data the user wants to write is sent to the peripheral, alongside any residual
+	 * unaligned data from the previous write call if present. Depending on its size,
+	 * it's either copied into kernel space first or read directly from the user pages.
+	 * If the message is served by the software fallback, the data goes there instead.
+	*/
+	struct kc_session *session = filep->private_data;
+	uint64_t start;
+	ssize_t written;
+	int error;
+
+	error = kc_session_prepare_message(filep, true);
+	if (error) {
+		return error;
+	}
+	start = ktime_get_ns();
+
+	kc_info(
+		"[ketchup_write] beginning write for peripheral %d task %d. hash_size = %d\n",
+		kc_get_index(filep), current->pid, session->hash_size
+	);
+
+	if (user_length <= KC_BUF_SIZE) {
+		written = peripheral_write_copy(filep, user_buffer, user_length);
+	} else {
+		written = peripheral_write_pinned(filep, user_buffer, user_length);
+	}
+
+	if (!session->soft) {
+		kc_histogram_record(&kc_get_device(filep)->stats.write, ktime_get_ns() - start);
+	}
+	return written;
+}
+
+/**
+ * Vectored writes (writev, and anything else that hands us an iov_iter).
+ * Each segment is fed to the peripheral in turn, and since peripheral_send_bytes
+ * keeps the unaligned tail in data_to_send, segments don't need to be word aligned.
+ * Like in ketchup_write, small segments are copied and large ones are read from
+ * their pages directly.
+*/
+static ssize_t ketchup_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct page *pages[KC_PIN_BATCH];
+	struct file *filep = iocb->ki_filp;
+	struct kc_session *session = filep->private_data;
+	uint8_t *buffer = session->buffer;
+	size_t written = 0, segment_length, page_offset, page_length, copied;
+	ssize_t got;
+	uint8_t *page_data;
+	uint64_t start;
+	int error;
+
+	error = kc_session_prepare_message(filep, true);
+	if (error) {
+		return error;
+	}
+	start = ktime_get_ns();
+
+	kc_info(
+		"[ketchup_write_iter] task %d writing %zu bytes in %lu segments\n",
+		current->pid, iov_iter_count(from), from->nr_segs
+	);
+
+	while (iov_iter_count(from) > 0) {
+		if (written > 0) {
+			cond_resched();
+			if (signal_pending(current)) {
+				break;
+			}
+		}
+
+		segment_length = iov_iter_single_seg_count(from);
+
+		if (segment_length <= KC_BUF_SIZE) {
+			copied = copy_from_iter(buffer, segment_length, from);
+			if (copied == 0) {
+				kc_err("[ketchup_write_iter] couldn't copy data from user\n");
+				break;
+			}
+			kc_session_absorb(filep, buffer, copied);
+			written += copied;
+			continue;
+		}
+
+		// This takes a reference to the pages and advances the iterator
+		got = iov_iter_get_pages2(from, pages, KC_PIN_BATCH * PAGE_SIZE, KC_PIN_BATCH, &page_offset);
+		if (got <= 0) {
+			kc_err("[ketchup_write_iter] couldn't get user pages. retval = %zd\n", got);
+			break;
+		}
+
+		for (int i = 0; got > 0; i++) {
+			page_length = kc_min(PAGE_SIZE - page_offset, (size_t)got);
+
+			page_data = kmap_local_page(pages[i]);
+			kc_session_absorb(filep, page_data + page_offset, page_length);
+			kunmap_local(page_data);
+			put_page(pages[i]);
+
+			got -= page_length;
+			written += page_length;
+			page_offset = 0;
+		}
+	}
+
+	if (!session->soft) {
+		kc_histogram_record(&kc_get_device(filep)->stats.write, ktime_get_ns() - start);
+	}
+
+	if (written == 0 && iov_iter_count(from) > 0) {
+		return -EFAULT;
+	}
+
+	return written;
+}
+
+/**
+ * Feeds one pipe buffer to the peripheral. The pages of a pipe are already in
+ * the kernel, so we just map them and send their contents.
+*/
+static int pipe_to_peripheral(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	uint8_t *page_data;
+
+	page_data = kmap_local_page(buf->page);
+	kc_session_absorb(sd->u.file, page_data + buf->offset, sd->len);
+	kunmap_local(page_data);
+
+	return sd->len;
+}
+
+/**
+ * splice() from a pipe into the device. sendfile() goes through here as well,
+ * since the kernel implements it by splicing the input file into an internal pipe,
+ * so in both cases data goes from the page cache to the peripheral without any copies.
+*/
+static ssize_t ketchup_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos, size_t len, unsigned int flags)
+{
+	uint64_t start;
+	ssize_t written;
+	int error;
+
+	kc_info(
+		"[ketchup_splice_write] task %d splicing up to %zu bytes\n",
+		current->pid, len
+	);
+
+	error = kc_session_prepare_message(out, true);
+	if (error) {
+		return error;
+	}
+
+	start = ktime_get_ns();
+	written = splice_from_pipe(pipe, out, ppos, len, flags, pipe_to_peripheral);
+	if (!((struct kc_session *)out->private_data)->soft) {
+		kc_histogram_record(&kc_get_device(out)->stats.write, ktime_get_ns() - start);
+	}
+
+	return written;
+}
+
+/**
+ * Hashes a range of a file without its data ever going through user space.
+ * The file is read with kernel_read, so it goes through the page cache and
+ * gets the usual readahead, which we widen by telling the filesystem that
+ * the access is sequential. Like large writes, this stops early if a signal
+ * arrives: in that case hashed tells the caller where to resume from.
+*/
+static long peripheral_hash_file(struct file *filep, struct kc_hash_file __user *arg)
+{
+	struct kc_hash_file request;
+	struct file *file;
+	uint8_t *buffer;
+	loff_t position;
+	uint64_t remaining;
+	ssize_t got;
+	long retval = 0;
+
+	if (copy_from_user(&request, arg, sizeof(request))) {
+		kc_err("[hash_file] error copying the request\n");
+		return -EFAULT;
+	}
+
+	file = fget(request.fd);
+	if (!file) {
+		return -EBADF;
+	}
+
+	if (!(file->f_mode & FMODE_READ)) {
+		fput(file);
+		return -EBADF;
+	}
+
+	buffer = kvmalloc(KC_FILE_CHUNK, GFP_KERNEL);
+	if (!buffer) {
+		fput(file);
+		return -ENOMEM;
+	}
+
+	kc_info(
+		"[hash_file] task %d hashing fd %d from %llu, length %llu\n",
+		current->pid, request.fd, request.offset, request.length
+	);
+
+	// Just a hint, so it doesn't matter if the file doesn't support it
+	vfs_fadvise(file, request.offset, request.length, POSIX_FADV_SEQUENTIAL);
+
+	position = request.offset;
+	remaining = request.length ? request.length : U64_MAX;
+	request.hashed = 0;
+
+	while (remaining > 0) {
+		if (request.hashed > 0) {
+			cond_resched();
+			if (signal_pending(current)) {
+				retval = -EINTR;
+				break;
+			}
+		}
+
+		got = kernel_read(file, buffer, kc_min((uint64_t)KC_FILE_CHUNK, remaining), &position);
+		if (got < 0) {
+			kc_err("[hash_file] couldn't read the file. retval = %zd\n", got);
+			retval = got;
+			break;
+		}
+
+		// End of file
+		if (got == 0) {
+			break;
+		}
+
+		kc_session_absorb(filep, buffer, got);
+		request.hashed += got;
+		remaining -= got;
+	}
+
+	kvfree(buffer);
+	fput(file);
+
+	if (copy_to_user(arg, &request, sizeof(request))) {
+		kc_err("[hash_file] error copying the result to user space\n");
+		return -EFAULT;
+	}
+
+	return retval;
+}
+
+/**
+ * Steps 1 and 2 of ketchup_read: marks the data in data_to_send
+ * as the last packet and sends it, which starts the final permutation.
+*/
+static void peripheral_send_last(struct ketchup_device *device)
+{
+	uint32_t control_value = 0, packed_input;
+
+	// 1. Set control register to appropriate value
+
+	// Bytes left to send
+	control_value |= device->data_to_send_length;
+
+	// This is the last packet
+	control_value |= 1 << 2;
+
+	// Hash size
+	control_value |= device->hash_size << 4;
+	writel(control_value, device->control);
+	kc_info("[peripheral_send_last] writing %08x to control\n", control_value);
+	trace_ketchup_finalize(device->index, device->data_to_send_length, device->hash_size);
+
+	// 2. Send last packed of input data
+	packed_input = pack_to_u32_big_endian(device->data_to_send);
+	writel(packed_input, device->input);
+	kc_info("[peripheral_send_last] writing %08x to input\n", packed_input);
+
+	atomic64_inc(&device->stats.messages);
+}
+
+static inline bool peripheral_output_ready(struct ketchup_device *device)
+{
+	return (readl(device->status) & 1) != 0;
+}
+
+/**
+ * Step 3 of ketchup_read: polls the status register until the digest is ready.
+ * This is capped at 100 iterations, so a faulty peripheral can't lock us up.
+*/
+static void peripheral_poll_output(struct ketchup_device *device)
+{
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if (peripheral_output_ready(device)) {
+			break;
+		}
+	}
+
+	if (i == 100) {
+		kc_err("[peripheral_poll_output] something went wrong, stop after 100 iters");
+	}
+	atomic64_add(min(i + 1, 100), &device->stats.poll_iterations);
+	trace_ketchup_poll_done(device->index, min(i + 1, 100), i < 100);
+}
+
+/**
+ * Step 4 of ketchup_read: copies the digest into output, in big endian order.
+ * The output has to be ready, and the readl of the status register that
+ * found it ready orders these reads.
+*/
+static void peripheral_read_output(struct ketchup_device *device, uint32_t output[512/32], size_t hash_size_bytes)
+{
+	// The output registers are consecutive, so we copy the
+	// whole bank at once and then put it in big endian order.
+	__ioread32_copy(output, device->output_base, hash_size_bytes/4);
+	cpu_to_be32_array((__be32 *)output, output, hash_size_bytes/4);
+}
+
+/**
+ * Steps 1 to 4 of ketchup_read, shared with the ring and io_uring workers:
+ * sends the last packet, waits for the peripheral and gets the digest.
+*/
+static void peripheral_finish(struct ketchup_device *device, uint32_t output[512/32], size_t hash_size_bytes)
+{
+	uint64_t start = ktime_get_ns();
+
+	peripheral_send_last(device);
+
+	// 3. Wait for polling
+	peripheral_poll_output(device);
+	kc_histogram_record(&device->stats.digest, ktime_get_ns() - start);
+
+	peripheral_read_output(device, output, hash_size_bytes);
+}
+
+/**
+ * This function is the one responsible for handling all the read operations performed
+ * on the /dev/ketchup_driver file.
+ * When the user reads we need to:
+ * 1. Set this write as the last one;
+ * 2. Send the last packet of input data to the peripheral;
+ * 3. Start polling the peripheral on the status register;
+ * 4. Once the output is ready, we save the output into a buffer;
+ * 5. We copy the output buffer to user space;
+ * 6. Reset the peripheral;
+ * 7. Set the same hash size as before in control;
+ * 8. Give the peripheral back until the next message.
+ * In non-blocking mode, if the digest isn't ready at step 3 we return -EAGAIN
+ * and remember that the last packet was sent, so that the next read starts
+ * from step 3. poll reports the fd as readable once the digest is ready.
+*/
+static ssize_t ketchup_read(struct file *filep, char *user_buffer, size_t user_len, loff_t *off)
+{
+	struct kc_session *session = filep->private_data;
+	struct ketchup_device *curr_device;
+	uint32_t control_value;
+	size_t hash_size_bytes, data_to_copy;
+	uint32_t output_buffer[512/32];
+	int error;
+
+	error = kc_session_prepare_message(filep, false);
+	if (error) {
+		return error;
+	}
+
+	if (session->soft) {
+		return kc_soft_read(session, user_buffer, user_len);
+	}
+	curr_device = kc_get_device(filep);
+
+	// First of all, check that user requested the correct amount of bytes
+	switch (curr_device->hash_size)
+	{
+		case HASH_512:
+			hash_size_bytes = 512/8;
+			break;
+		case HASH_384:
+			hash_size_bytes = 384/8;
+			break;
+		case HASH_256:
+			hash_size_bytes = 256/8;
+			break;
+		case HASH_224:
+			hash_size_bytes = 224/8;
+			break;
+		default:
+			kc_err(
+				"[ketchup_read] the peripheral %d owned by task %d has an impossible hash size (%d)!\n", 
+				session->peripheral_index, current->pid, curr_device->hash_size
+			);
+			return -EINVAL;
+	}
+
+	// Make sure that the user requested at least as many 
+	// bytes as the output, otherwise we might copy more
+	// than the user asked, which is potentially dangerous
+	if (user_len < hash_size_bytes) {
+		return -EINVAL;
+	}
+	
+	// 1-2. Send the last packet, unless a previous non-blocking read already did
+	if (!session->finalizing) {
+		session->finalize_start = ktime_get_ns();
+		peripheral_send_last(curr_device);
+	}
+
+	// 3. Wait for the digest
+	if (filep->f_flags & O_NONBLOCK) {
+		if (!peripheral_output_ready(curr_device)) {
+			session->finalizing = true;
+			// There's no interrupt, so we check again in a bit to wake up pollers
+			schedule_delayed_work(&session->digest_check, 1);
+			return -EAGAIN;
+		}
+		trace_ketchup_poll_done(curr_device->index, 1, true);
+	} else {
+		peripheral_poll_output(curr_device);
+	}
+	session->finalizing = false;
+	kc_histogram_record(&curr_device->stats.digest, ktime_get_ns() - session->finalize_start);
+
+	// 4. Get the digest
+	peripheral_read_output(curr_device, output_buffer, hash_size_bytes);
+
+	// 5. Send output to user
+	data_to_copy = min(hash_size_bytes, user_len);
+	error = copy_to_user(user_buffer, output_buffer, data_to_copy);
+
+	if (error < 0) {
+		kc_err("[ketchup_read] copy_to_user failed. retval = %d\n", error);
+		return error;
+	}
+
+	// 6. Reset the peripheral, for good measure
+	writel(1, curr_device->command);
+	curr_device->data_to_send_length = 0;
+	session->in_message = false;
+
+	// 7. Reset previous hash size into control
+	control_value = curr_device->hash_size << 4;
+	writel(control_value, curr_device->control);
+	kc_info("[ketchup_read] writing %08x to control\n", control_value);
+
+	// 8. The message is over, let someone else use the peripheral
+	kc_session_unbind(filep);
+	atomic64_inc(&ketchup_drvr_data.devices.digests);
+
+	return data_to_copy;
+}
+
+/**
+ * This function is called when a file descriptor opened of our character device file 
+ * (i.e /dev/ketchup_driver) is closed.
+ * What we do is we reset the peripheral and than we release the acquired peripheral
+*/
+static int ketchup_release(struct inode *inod, struct file *fil)
+{
+	struct kc_session *session = fil->private_data;
+	struct ketchup_device *curr_device;
+
+	cancel_delayed_work_sync(&session->digest_check);
+
+	// Between messages the fd doesn't have a peripheral
+	if (session->peripheral_index >= 0) {
+		curr_device = kc_get_device(fil);
+
+		if (curr_device->ring) {
+			kc_ring_destroy(curr_device->ring);
+			curr_device->ring = NULL;
+		}
+
+		// Wait for the io_uring request using the peripheral, if any.
+		// peripheral_clear then takes it out of io_uring mode.
+		if (READ_ONCE(curr_device->uring_mode)) {
+			wait_on_bit_lock(&curr_device->uring_busy, 0, TASK_UNINTERRUPTIBLE);
+			clear_bit_unlock(0, &curr_device->uring_busy);
+		}
+
+		// Back in the pool, before the release can hand it to someone
+		if (session->pinned) {
+			clear_bit(session->peripheral_index, ketchup_drvr_data.devices.pinned_map);
+		}
+
+		peripheral_release(session->peripheral_index);
+		atomic64_inc(&ketchup_drvr_data.devices.unbinds);
+	}
+
+	kc_soft_stop(session);
+	kfree(session);
+
+	return 0;
+}
+
+// ======================= Register Mapping ========================
+
+/**
+ * A process can map the registers of its peripheral and drive it straight
+ * from user space, without a system call per message. Mapping the registers
+ * binds a peripheral to the fd, which keeps it for as long as the mapping
+ * exists. When the last mapping goes away the peripheral is reset, so that
+ * nothing of the last message is left in it, and handed back to the pool.
+ * The driver still decides who gets which peripheral, the mapping just skips
+ * it for the data. Mappings aren't inherited by child processes.
+*/
+
+static void kc_mmio_vm_open(struct vm_area_struct *vma)
+{
+	struct kc_session *session = vma->vm_file->private_data;
+
+	atomic_inc(&session->mmio_maps);
+}
+
+static void kc_mmio_vm_close(struct vm_area_struct *vma)
+{
+	struct kc_session *session = vma->vm_file->private_data;
+
+	if (!atomic_dec_and_test(&session->mmio_maps)) {
+		return;
+	}
+
+	// The process can't reach the registers anymore. A pinned fd
+	// still keeps its peripheral, the others give it back
+	session->persistent = session->pinned;
+	kc_session_unbind(vma->vm_file);
+}
+
+static const struct vm_operations_struct kc_mmio_vm_ops = {
+	.open = kc_mmio_vm_open,
+	.close = kc_mmio_vm_close,
+};
+
+/**
+ * Maps the register page of the peripheral bound to the fd, binding one first
+ * if needed. Unlike a write, this never waits for a peripheral, see below.
+*/
+static int kc_mmio_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct kc_session *session = filp->private_data;
+	struct ketchup_device *device;
+	int error;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE || !(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+
+	// ->mmap runs with mmap_lock held, so waiting here would stall every page fault
+	// and mmap of the other threads, and deadlock if the one holding the only
+	// peripheral faults. Like a non-blocking write, it fails with -EAGAIN instead.
+	error = kc_session_bind(filp, 0);
+	if (error) {
+		return error;
+	}
+
+	error = kc_session_prepare(filp, true);
+	if (error) {
+		return error;
+	}
+	device = kc_get_device(filp);
+
+	// Only the first page is mapped, so it mustn't have anything else in it
+	if (offset_in_page(device->mem_start)) {
+		kc_err("[mmio_mmap] the registers of peripheral %d aren't page aligned\n", device->index);
+		if (atomic_read(&session->mmio_maps) == 0) {
+			kc_session_unbind(filp);
+		}
+		return -ENODEV;
+	}
+
+	vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vma->vm_ops = &kc_mmio_vm_ops;
+
+	error = io_remap_pfn_range(vma, vma->vm_start, device->mem_start >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+	if (error) {
+		if (atomic_read(&session->mmio_maps) == 0) {
+			kc_session_unbind(filp);
+		}
+		return error;
+	}
+
+	// From now on it's the mapping that holds the peripheral, see kc_mmio_vm_close
+	session->persistent = true;
+	atomic_inc(&session->mmio_maps);
+	kc_info("[mmio_mmap] task %d mapped peripheral %d\n", current->pid, device->index);
+
+	return 0;
+}
+
+// ======================= Submission Ring ========================
+
+/**
+ * A worker draining a ring on one peripheral. Worker 0 uses the peripheral
+ * of the fd that owns the ring, the others borrow free ones while there's
+ * a backlog, and give them back once they run out of submissions.
+*/
+struct kc_ring_worker {
+	struct work_struct work;
+	struct kc_ring *ring;
+	int peripheral_index;
+
+	// Bit 0 is set while a helper holds a borrowed peripheral
+	unsigned long busy;
+};
+
+/**
+ * A shared submission/completion ring. Everything lives in one vmalloc'd
+ * region that user space maps: the header, the submission entries, the
+ * completion entries and finally the arena holding the messages.
+ * The indexes in here are the driver's own copies: the ones in the
+ * shared header are only ever written, never trusted.
+*/
+struct kc_ring {
+	void *region;
+	size_t region_size;
+
+	struct kc_ring_header *header;
+	struct kc_ring_sqe *sqes;
+	struct kc_ring_cqe *cqes;
+	uint8_t *arena;
+	uint32_t entries;
+	uint32_t arena_size;
+
+	// Protects the three indexes below
+	spinlock_t lock;
+	uint32_t sq_head;
+	uint32_t cq_tail;
+	// Submissions taken but not completed yet, they have a completion slot reserved
+	uint32_t in_flight;
+
+	// Woken up on every completion
+	wait_queue_head_t cq_wait;
+
+	struct kc_ring_worker workers[KC_RING_WORKERS];
+};
+
+static const size_t kc_digest_bytes[] = {
+	[HASH_512] = 512/8,
+	[HASH_384] = 384/8,
+	[HASH_256] = 256/8,
+	[HASH_224] = 224/8,
+};
+
+static inline uint32_t kc_ring_pending(struct kc_ring *ring)
+{
+	return smp_load_acquire(&ring->header->sq_tail) - READ_ONCE(ring->sq_head);
+}
+
+static inline uint32_t kc_ring_completed(struct kc_ring *ring)
+{
+	return READ_ONCE(ring->cq_tail) - READ_ONCE(ring->header->cq_head);
+}
+
+/**
+ * Takes the next submission, if there's one and there's also
+ * room in the completion ring for its result.
+*/
+static bool kc_ring_claim(struct kc_ring *ring, struct kc_ring_sqe *sqe)
+{
+	bool claimed = false;
+
+	spin_lock(&ring->lock);
+	if (kc_ring_pending(ring) > 0 && kc_ring_completed(ring) + ring->in_flight < ring->entries) {
+		// Copy it out, so that user space can't change it under us
+		memcpy(sqe, &ring->sqes[ring->sq_head & (ring->entries - 1)], sizeof(*sqe));
+		ring->sq_head++;
+		ring->in_flight++;
+
+		smp_store_release(&ring->header->sq_head, ring->sq_head);
+		claimed = true;
+	}
+	spin_unlock(&ring->lock);
+
+	return claimed;
+}
+
+static void kc_ring_complete(struct kc_ring *ring, const struct kc_ring_sqe *sqe, int result, const uint32_t *digest)
+{
+	struct kc_ring_cqe *cqe;
+
+	spin_lock(&ring->lock);
+	cqe = &ring->cqes[ring->cq_tail & (ring->entries - 1)];
+	cqe->user_data = sqe->user_data;
+	cqe->result = result;
+	cqe->digest_length = result == 0 ? kc_digest_bytes[sqe->hash_size] : 0;
+	if (result == 0) {
+		memcpy(cqe->digest, digest, cqe->digest_length);
+	}
+
+	ring->cq_tail++;
+	ring->in_flight--;
+	smp_store_release(&ring->header->cq_tail, ring->cq_tail);
+	spin_unlock(&ring->lock);
+
+	wake_up_interruptible(&ring->cq_wait);
+}
+
+/**
+ * Hashes one message of the arena from start to finish
+*/
+static int kc_ring_hash(struct ketchup_device *device, struct kc_ring *ring, const struct kc_ring_sqe *sqe, uint32_t digest[512/32])
+{
+	if (sqe->hash_size > HASH_224 || (uint64_t)sqe->offset + sqe->length > ring->arena_size) {
+		return -EINVAL;
+	}
+
+	writel(1, device->command);
+	device->data_to_send_length = 0;
+	device->hash_size = sqe->hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	peripheral_send_bytes(device, ring->arena + sqe->offset, sqe->length);
+	peripheral_finish(device, digest, kc_digest_bytes[sqe->hash_size]);
+
+	return 0;
+}
+
+static void kc_ring_work(struct work_struct *work)
+{
+	struct kc_ring_worker *worker = container_of(work, struct kc_ring_worker, work);
+	struct kc_ring *ring = worker->ring;
+	struct ketchup_device *device = kc_device(worker->peripheral_index);
+	HashSize previous_hash_size = device->hash_size;
+	struct kc_ring_sqe sqe;
+	uint32_t digest[512/32];
+	int result;
+
+	while (kc_ring_claim(ring, &sqe)) {
+		result = kc_ring_hash(device, ring, &sqe, digest);
+		kc_ring_complete(ring, &sqe, result, digest);
+		cond_resched();
+	}
+
+	// Leave the peripheral as we found it
+	writel(1, device->command);
+	device->data_to_send_length = 0;
+	device->hash_size = previous_hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	if (worker != &ring->workers[0]) {
+		peripheral_release(worker->peripheral_index);
+		clear_bit(0, &worker->busy);
+	}
+}
+
+/**
+ * Starts draining a ring. Worker 0 is always queued, and if there's
+ * a backlog we also try to borrow some free peripherals to help it.
+ * Borrowing never blocks: if they're all taken, worker 0 does the work alone.
+*/
+static void kc_ring_kick(struct kc_ring *ring)
+{
+	struct kc_ring_worker *helper;
+	uint32_t pending = kc_ring_pending(ring);
+	int index;
+
+	queue_work(ketchup_drvr_data.ring_wq, &ring->workers[0].work);
+
+	for (int i = 1; i < KC_RING_WORKERS && pending > i * KC_RING_HELPER_BATCH; i++) {
+		helper = &ring->workers[i];
+		if (test_and_set_bit(0, &helper->busy)) {
+			continue;
+		}
+
+		index = peripheral_acquire(0);
+		if (index < 0) {
+			clear_bit(0, &helper->busy);
+			break;
+		}
+
+		helper->peripheral_index = index;
+		queue_work(ketchup_drvr_data.ring_wq, &helper->work);
+	}
+}
+
+/**
+ * Allocates a ring for the fd. The region is only allocated here,
+ * user space then maps it with mmap using the layout we return.
+*/
+static long peripheral_ring_setup(struct file *filp, struct kc_ring_setup __user *arg)
+{
+	struct ketchup_device *device = kc_get_device(filp);
+	struct kc_ring_setup setup;
+	struct kc_ring *ring;
+
+	if (copy_from_user(&setup, arg, sizeof(setup))) {
+		kc_err("[ring_setup] error copying the ring parameters\n");
+		return -EFAULT;
+	}
+
+	if (setup.entries == 0 || setup.entries > KC_RING_MAX_ENTRIES || !is_power_of_2(setup.entries)
+		|| setup.arena_size == 0 || setup.arena_size > KC_RING_MAX_ARENA) {
+		kc_err("[ring_setup] invalid ring parameters\n");
+		return -EINVAL;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring) {
+		return -ENOMEM;
+	}
+
+	// Header, then the two rings, then the arena on its own pages
+	setup.sq_offset = ALIGN(sizeof(struct kc_ring_header), 64);
+	setup.cq_offset = setup.sq_offset + setup.entries * sizeof(struct kc_ring_sqe);
+	setup.arena_offset = PAGE_ALIGN(setup.cq_offset + setup.entries * sizeof(struct kc_ring_cqe));
+	setup.mmap_size = PAGE_ALIGN(setup.arena_offset + setup.arena_size);
+
+	// This is zeroed, so all the indexes start from 0
+	ring->region_size = setup.mmap_size;
+	ring->region = vmalloc_user(ring->region_size);
+	if (!ring->region) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->header = ring->region;
+	ring->sqes = ring->region + setup.sq_offset;
+	ring->cqes = ring->region + setup.cq_offset;
+	ring->arena = ring->region + setup.arena_offset;
+	ring->entries = setup.entries;
+	ring->arena_size = setup.arena_size;
+	ring->header->entries = setup.entries;
+	ring->header->arena_size = setup.arena_size;
+
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->cq_wait);
+	for (int i = 0; i < KC_RING_WORKERS; i++) {
+		INIT_WORK(&ring->workers[i].work, kc_ring_work);
+		ring->workers[i].ring = ring;
+		ring->workers[i].peripheral_index = -1;
+	}
+	ring->workers[0].peripheral_index = kc_get_index(filp);
+
+	if (copy_to_user(arg, &setup, sizeof(setup))) {
+		kc_err("[ring_setup] error copying the ring layout to user space\n");
+		vfree(ring->region);
+		kfree(ring);
+		return -EFAULT;
+	}
+
+	// Two threads could be setting up a ring on the same fd
+	if (cmpxchg(&device->ring, NULL, ring) != NULL) {
+		vfree(ring->region);
+		kfree(ring);
+		return -EBUSY;
+	}
+
+	kc_info(
+		"[ring_setup] task %d set up a ring with %u entries and a %u bytes arena\n",
+		current->pid, setup.entries, setup.arena_size
+	);
+
+	return 0;
+}
+
+/**
+ * The doorbell: starts draining the new submissions and, if min_complete
+ * isn't 0, waits until there are at least that many completions to reap.
+*/
+static long peripheral_ring_enter(struct file *filp, uint32_t __user *arg)
+{
+	struct kc_ring *ring = READ_ONCE(kc_get_device(filp)->ring);
+	uint32_t min_complete;
+
+	if (!ring) {
+		return -ENXIO;
+	}
+
+	if (get_user(min_complete, arg)) {
+		return -EFAULT;
+	}
+
+	if (min_complete > ring->entries) {
+		return -EINVAL;
+	}
+
+	kc_ring_kick(ring);
+
+	if (min_complete == 0) {
+		return 0;
+	}
+
+	return wait_event_interruptible(ring->cq_wait, kc_ring_completed(ring) >= min_complete);
+}
+
+/**
+ * Maps the ring region. It has to be mapped whole, from offset 0.
+ * At KC_MMAP_REGISTERS_OFFSET there are the registers instead.
+*/
+static int ketchup_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct kc_ring *ring;
+
+	if (vma->vm_pgoff == KC_MMAP_REGISTERS_OFFSET >> PAGE_SHIFT) {
+		return kc_mmio_mmap(filp, vma);
+	}
+
+	if (kc_get_index(filp) < 0) {
+		return -ENXIO;
+	}
+
+	ring = READ_ONCE(kc_get_device(filp)->ring);
+	if (!ring) {
+		return -ENXIO;
+	}
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->region_size) {
+		return -EINVAL;
+	}
+
+	return remap_vmalloc_range(vma, ring->region, 0);
+}
+
+/**
+ * Called when the fd is closed, so nobody can kick the ring anymore.
+ * We just wait for the workers, which also gives back the borrowed peripherals.
+*/
+static void kc_ring_destroy(struct kc_ring *ring)
+{
+	for (int i = 0; i < KC_RING_WORKERS; i++) {
+		flush_work(&ring->workers[i].work);
+	}
+
+	vfree(ring->region);
+	kfree(ring);
+}
+
+// ============================ Polling ============================
+
+/**
+ * An fd is writable when a message can be written without blocking: either it's
+ * already in the middle of one, or there's a free peripheral. Acquire handles
+ * go further and reserve that peripheral for their next message. It's readable
+ * when a non-blocking read has started the final permutation and the digest is ready.
+ * If the fd has a ring, instead, it's readable when there are completions to reap.
+*/
+static __poll_t ketchup_poll(struct file *filep, poll_table *wait)
+{
+	struct kc_session *session = filep->private_data;
+	struct ketchup_device *curr_device;
+	struct kc_ring *ring;
+	__poll_t mask = 0;
+
+	poll_wait(filep, &session->digest_wait, wait);
+
+	// Software never makes anyone wait
+	if (session->soft) {
+		return EPOLLOUT | EPOLLWRNORM;
+	}
+
+	if (kc_get_index(filep) < 0) {
+		poll_wait(filep, &ketchup_drvr_data.devices.dev_free_wait, wait);
+
+		// If there are none free we're woken up on the next release
+		if (!session->handle) {
+			return peripheral_any_available() || kc_soft_enabled(session) ? EPOLLOUT | EPOLLWRNORM : 0;
+		}
+
+		// Never block here
+		if (kc_session_bind(filep, 0) != 0) {
+			return 0;
+		}
+	}
+	curr_device = kc_get_device(filep);
+
+	ring = READ_ONCE(curr_device->ring);
+	if (ring) {
+		poll_wait(filep, &ring->cq_wait, wait);
+		if (kc_ring_completed(ring) > 0) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+		return mask;
+	}
+
+	if (READ_ONCE(curr_device->uring_mode)) {
+		return 0;
+	}
+
+	if (!session->finalizing) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	} else if (peripheral_output_ready(curr_device)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	} else {
+		schedule_delayed_work(&session->digest_check, 1);
+	}
+
+	return mask;
+}
+
+// ===================== io_uring Commands =======================
+
+/**
+ * An asynchronous hash. The message is pinned when the command is issued,
+ * hashed by a worker on whatever peripheral is free, and the digest is
+ * copied back to user space from the task that submitted the command.
+*/
+struct kc_uring_request {
+	struct work_struct work;
+	struct io_uring_cmd *ioucmd;
+	struct ketchup_device *owner;
+
+	struct page **pages;
+	int pages_count;
+	size_t first_offset;
+	uint32_t length;
+	HashSize hash_size;
+	uint64_t digest_address;
+
+	uint32_t digest[512/32];
+	int result;
+};
+
+static inline struct kc_uring_request *kc_uring_get_request(struct io_uring_cmd *ioucmd)
+{
+	return *(struct kc_uring_request **)ioucmd->pdu;
+}
+
+/**
+ * Runs in the task that submitted the command, so we can write the digest to its memory
+*/
+static void kc_uring_done(struct io_uring_cmd *ioucmd)
+{
+	struct kc_uring_request *request = kc_uring_get_request(ioucmd);
+	int result = request->result;
+
+	if (result == 0 && copy_to_user(u64_to_user_ptr(request->digest_address), request->digest, kc_digest_bytes[request->hash_size])) {
+		result = -EFAULT;
+	}
+
+	kvfree(request->pages);
+	kfree(request);
+
+	io_uring_cmd_done(ioucmd, result, 0);
+}
+
+/**
+ * Picks a peripheral for a request. The one of the fd comes first, then any free one,
+ * and if there are none we wait for the one of the fd. Waiting on the fd's own
+ * peripheral, rather than on the free ones, makes sure that requests can't get stuck
+ * behind other processes holding all the peripherals.
+ * Returns the index of the borrowed peripheral, or -1 if it's the one of the fd.
+*/
+static int kc_uring_take_peripheral(struct kc_uring_request *request, struct ketchup_device **device)
+{
+	int index;
+
+	if (!test_and_set_bit_lock(0, &request->owner->uring_busy)) {
+		*device = request->owner;
+		return -1;
+	}
+
+	index = peripheral_acquire(0);
+	if (index >= 0) {
+		*device = kc_device(index);
+		return index;
+	}
+
+	wait_on_bit_lock(&request->owner->uring_busy, 0, TASK_UNINTERRUPTIBLE);
+	*device = request->owner;
+	return -1;
+}
+
+static void kc_uring_work(struct work_struct *work)
+{
+	struct kc_uring_request *request = container_of(work, struct kc_uring_request, work);
+	struct ketchup_device *device;
+	size_t page_offset = request->first_offset, page_length, remaining = request->length;
+	uint8_t *page_data;
+	int index;
+
+	index = kc_uring_take_peripheral(request, &device);
+
+	writel(1, device->command);
+	device->data_to_send_length = 0;
+	device->hash_size = request->hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	for (int i = 0; i < request->pages_count; i++) {
+		page_length = kc_min(PAGE_SIZE - page_offset, remaining);
+
+		page_data = kmap_local_page(request->pages[i]);
+		peripheral_send_bytes(device, page_data + page_offset, page_length);
+		kunmap_local(page_data);
+
+		remaining -= page_length;
+		page_offset = 0;
+	}
+
+	peripheral_finish(device, request->digest, kc_digest_bytes[request->hash_size]);
+	request->result = 0;
+
+	if (index >= 0) {
+		peripheral_release(index);
+	} else {
+		writel(1, device->command);
+		device->data_to_send_length = 0;
+		clear_and_wake_up_bit(0, &device->uring_busy);
+	}
+
+	unpin_user_pages(request->pages, request->pages_count);
+	io_uring_cmd_complete_in_task(request->ioucmd, kc_uring_done);
+}
+
+/**
+ * Entry point for IORING_OP_URING_CMD. The only command is KC_URING_CMD_HASH,
+ * and since its payload doesn't fit in a normal SQE, the ring has to be set up
+ * with IORING_SETUP_SQE128.
+*/
+static int ketchup_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct ketchup_device *owner;
+	const struct kc_uring_hash *cmd = ioucmd->cmd;
+	struct kc_uring_request *request;
+	unsigned long start;
+	int pinned;
+
+	// A message started in software has to be finished with read first,
+	// and a peripheral driven through its registers can't be shared
+	if (((struct kc_session *)ioucmd->file->private_data)->soft
+		|| atomic_read(&((struct kc_session *)ioucmd->file->private_data)->mmio_maps)) {
+		return -EBUSY;
+	}
+
+	// Malformed commands mustn't take a peripheral, nor put the fd in io_uring mode
+	if (ioucmd->cmd_op != KC_URING_CMD_HASH) {
+		return -ENOTTY;
+	}
+
+	if (!(issue_flags & IO_URING_F_SQE128)) {
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(cmd->hash_size) > HASH_224 || READ_ONCE(cmd->length) > KC_URING_MAX_LENGTH) {
+		return -EINVAL;
+	}
+
+	// Never sleep inline in io_uring_enter: with -EAGAIN io_uring
+	// issues the command again from io-wq, where we can wait
+	pinned = kc_session_bind(
+		ioucmd->file,
+		!(issue_flags & IO_URING_F_NONBLOCK) && !(ioucmd->file->f_flags & O_NONBLOCK)
+	);
+	if (pinned) {
+		return pinned;
+	}
+	owner = kc_get_device(ioucmd->file);
+
+	// An fd with a ring already gave its peripheral away
+	if (READ_ONCE(owner->ring)) {
+		return -EBUSY;
+	}
+	WRITE_ONCE(owner->uring_mode, true);
+	((struct kc_session *)ioucmd->file->private_data)->persistent = true;
+
+	request = kzalloc(sizeof(*request), GFP_KERNEL);
+	if (!request) {
+		return -ENOMEM;
+	}
+
+	// The SQE can be reused as soon as we return, so we keep our own copy
+	request->ioucmd = ioucmd;
+	request->owner = owner;
+	request->length = READ_ONCE(cmd->length);
+	request->hash_size = READ_ONCE(cmd->hash_size);
+	request->digest_address = READ_ONCE(cmd->digest);
+	start = READ_ONCE(cmd->data);
+
+	request->first_offset = offset_in_page(start);
+	request->pages_count = DIV_ROUND_UP(request->first_offset + request->length, PAGE_SIZE);
+	request->pages = kvmalloc_array(max(request->pages_count, 1), sizeof(struct page *), GFP_KERNEL);
+	if (!request->pages) {
+		kfree(request);
+		return -ENOMEM;
+	}
+
+	pinned = pin_user_pages_fast(start & PAGE_MASK, request->pages_count, 0, request->pages);
+	if (pinned != request->pages_count) {
+		if (pinned > 0) {
+			unpin_user_pages(request->pages, pinned);
+		}
+		kvfree(request->pages);
+		kfree(request);
+		return pinned < 0 ? pinned : -EFAULT;
+	}
+
+	*(struct kc_uring_request **)ioucmd->pdu = request;
+
+	INIT_WORK(&request->work, kc_uring_work);
+	queue_work(ketchup_drvr_data.ring_wq, &request->work);
+
+	return -EIOCBQUEUED;
+}
+
+// ========================= Crypto API ===========================
+
+/**
+ * The peripherals are also registered as the sha3-* ahash algorithms, so that
+ * the kernel's own users (dm-verity, IMA, fs-verity) and AF_ALG sockets can use
+ * them too. Requests are queued on crypto_engine: every peripheral has an engine,
+ * and requests are spread over them in turn. An engine doesn't own its peripheral
+ * though, its worker takes whichever is free like anyone else, so crypto API
+ * users and the device file share the peripherals. If none is free the request
+ * is hashed in the software SHA3, rather than waiting for one.
+ *
+ * The peripheral can only hash a message from start to finish, and its state
+ * can't be read out or loaded. So digest() and finup() send the whole message
+ * to a peripheral at once, while update() only buffers the data: a message up
+ * to KC_AHASH_BUFFER bytes long still goes to a peripheral when it's finished,
+ * a longer one goes on in the software SHA3. Exporting feeds the buffer to the
+ * software SHA3 and exports its state, and an imported state stays in software.
+*/
+#if IS_REACHABLE(CONFIG_CRYPTO_ENGINE)
+
+// Above sha3-generic (100) and the ARM CE one (200)
+#define KC_CRYPTO_PRIORITY 300
+
+// Enough for a 4 KiB block and its salt, like dm-verity hashes them
+#define KC_AHASH_BUFFER (4096 + 256)
+
+struct kc_ahash_ctx {
+	// Must come first, that's where crypto_engine looks for the callbacks
+	struct crypto_engine_ctx enginectx;
+	HashSize hash_size;
+};
+
+struct kc_ahash_reqctx {
+	// Set by finup and digest, which leave their data in the scatterlist of the request
+	bool with_src;
+	// The message outgrew the buffer, or was imported, and is hashed in software
+	bool soft;
+	size_t length;
+	uint8_t buffer[KC_AHASH_BUFFER];
+	// Followed by the context of the software SHA3, so it must be last
+	struct shash_desc desc;
+};
+
+/**
+ * Hashes a whole request in the software SHA3, when no peripheral is free or
+ * the peripherals are going away. This can be called from softirqs.
+*/
+static int kc_ahash_soft_digest(struct ahash_request *req)
+{
+	struct kc_ahash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	struct crypto_shash *tfm = ketchup_drvr_data.soft_tfm[ctx->hash_size];
+	struct sg_mapping_iter miter;
+	size_t remaining, length;
+	int error;
+
+	SHASH_DESC_ON_STACK(desc, tfm);
+
+	desc->tfm = tfm;
+	error = crypto_shash_init(desc);
+	if (!error) {
+		error = crypto_shash_update(desc, rctx->buffer, rctx->length);
+	}
+
+	if (!error && rctx->with_src) {
+		remaining = req->nbytes;
+		sg_miter_start(&miter, req->src, sg_nents(req->src), SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+		while (remaining > 0 && sg_miter_next(&miter)) {
+			length = kc_min(miter.length, remaining);
+			error = crypto_shash_update(desc, miter.addr, length);
+			if (error) {
+				break;
+			}
+			remaining -= length;
+		}
+		sg_miter_stop(&miter);
+	}
+
+	if (!error) {
+		error = crypto_shash_final(desc, req->result);
+	}
+	shash_desc_zero(desc);
+
+	return error;
+}
+
+/**
+ * A request left its engine, kc_crypto_unregister may be waiting for the last one
+*/
+static void kc_crypto_dequeued(void)
+{
+	if (atomic_dec_and_test(&ketchup_drvr_data.crypto_queued)) {
+		wake_up(&ketchup_drvr_data.crypto_idle);
+	}
+}
+
+/**
+ * Hashes a request on a peripheral: the buffered data, then
+ * the scatterlist if the request still has some data there.
+*/
+static int kc_ahash_do_one_request(struct crypto_engine *engine, void *areq)
+{
+	struct ahash_request *req = container_of(areq, struct ahash_request, base);
+	struct kc_ahash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	struct ketchup_device *device;
+	struct sg_mapping_iter miter;
+	uint32_t digest[512/32];
+	size_t remaining, length;
+	int index;
+
+	// Never wait for a peripheral: any process can hold them all for as long
+	// as it likes, and the kernel's own users of sha3-* mustn't stall on it.
+	// Like a fd past its threshold, the request goes to software instead.
+	index = peripheral_acquire(0);
+	if (index < 0) {
+		crypto_finalize_hash_request(engine, req, kc_ahash_soft_digest(req));
+		kc_crypto_dequeued();
+		return 0;
+	}
+
+	device = kc_device(index);
+	device->hash_size = ctx->hash_size;
+	writel(device->hash_size << 4, device->control);
+
+	if (rctx->length > 0) {
+		peripheral_send_bytes(device, rctx->buffer, rctx->length);
+	}
+
+	if (rctx->with_src) {
+		remaining = req->nbytes;
+		sg_miter_start(&miter, req->src, sg_nents(req->src), SG_MITER_FROM_SG);
+		while (remaining > 0 && sg_miter_next(&miter)) {
+			length = kc_min(miter.length, remaining);
+			peripheral_send_bytes(device, miter.addr, length);
+			remaining -= length;
+		}
+		sg_miter_stop(&miter);
+	}
+
+	peripheral_finish(device, digest, kc_digest_bytes[ctx->hash_size]);
+	memcpy(req->result, digest, kc_digest_bytes[ctx->hash_size]);
+
+	peripheral_release(index);
+	crypto_finalize_hash_request(engine, req, 0);
+	kc_crypto_dequeued();
+
+	return 0;
+}
+
+/**
+ * Queues a request on the engine of the next peripheral. Once the peripherals
+ * are being removed, the tfms that are still around hash in software instead.
+ * The RCU read side lets kc_crypto_unregister wait for anyone picking an engine.
+*/
+static int kc_ahash_enqueue(struct ahash_request *req)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	size_t len;
+	unsigned int next;
+	int error;
+
+	rcu_read_lock();
+
+	len = smp_load_acquire(&container->registered_devices_len);
+	if (READ_ONCE(ketchup_drvr_data.crypto_stopping) || len == 0) {
+		rcu_read_unlock();
+		return kc_ahash_soft_digest(req);
+	}
+
+	next = (unsigned int)atomic_inc_return(&ketchup_drvr_data.crypto_next) % len;
+	atomic_inc(&ketchup_drvr_data.crypto_queued);
+	error = crypto_transfer_hash_request_to_engine(kc_device(next)->engine, req);
+	// -EBUSY means it went to the backlog, anything else but -EINPROGRESS wasn't queued
+	if (error != -EINPROGRESS && error != -EBUSY) {
+		kc_crypto_dequeued();
+	}
+
+	rcu_read_unlock();
+	return error;
+}
+
+/**
+ * Moves the message to the software SHA3, along with what was buffered so far
+*/
+static int kc_ahash_soft_start(struct ahash_request *req)
+{
+	struct kc_ahash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	int error;
+
+	rctx->desc.tfm = ketchup_drvr_data.soft_tfm[ctx->hash_size];
+	error = crypto_shash_init(&rctx->desc);
+	if (error) {
+		return error;
+	}
+
+	error = crypto_shash_update(&rctx->desc, rctx->buffer, rctx->length);
+	if (error) {
+		return error;
+	}
+
+	rctx->soft = true;
+	rctx->length = 0;
+
+	return 0;
+}
+
+static int kc_ahash_init(struct ahash_request *req)
+{
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+
+	rctx->with_src = false;
+	rctx->soft = false;
+	rctx->length = 0;
+
+	return 0;
+}
+
+/**
+ * Buffers the data while the message is short, or hashes it in software.
+ * This can be called from softirqs, so the pages are mapped atomically.
+*/
+static int kc_ahash_update(struct ahash_request *req)
+{
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	struct sg_mapping_iter miter;
+	size_t remaining = req->nbytes, length;
+	int error = 0;
+
+	if (!rctx->soft && req->nbytes <= KC_AHASH_BUFFER - rctx->length) {
+		rctx->length += sg_copy_to_buffer(req->src, sg_nents(req->src), rctx->buffer + rctx->length, req->nbytes);
+		return 0;
+	}
+
+	if (!rctx->soft) {
+		error = kc_ahash_soft_start(req);
+		if (error) {
+			return error;
+		}
+	}
+
+	sg_miter_start(&miter, req->src, sg_nents(req->src), SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+	while (remaining > 0 && sg_miter_next(&miter)) {
+		length = kc_min(miter.length, remaining);
+		error = crypto_shash_update(&rctx->desc, miter.addr, length);
+		if (error) {
+			break;
+		}
+		remaining -= length;
+	}
+	sg_miter_stop(&miter);
+
+	return error;
+}
+
+static int kc_ahash_final(struct ahash_request *req)
+{
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+
+	if (rctx->soft) {
+		return crypto_shash_final(&rctx->desc, req->result);
+	}
+
+	rctx->with_src = false;
+	return kc_ahash_enqueue(req);
+}
+
+static int kc_ahash_finup(struct ahash_request *req)
+{
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	int error;
+
+	if (rctx->soft) {
+		error = kc_ahash_update(req);
+		if (error) {
+			return error;
+		}
+		return crypto_shash_final(&rctx->desc, req->result);
+	}
+
+	// However long the data is, the peripheral reads it straight from the scatterlist
+	rctx->with_src = true;
+	return kc_ahash_enqueue(req);
+}
+
+static int kc_ahash_digest(struct ahash_request *req)
+{
+	kc_ahash_init(req);
+	return kc_ahash_finup(req);
+}
+
+/**
+ * Exports the state of the software SHA3, so it can be imported by sha3-generic as well.
+ * While the message is still buffered, a copy of it goes through a software
+ * SHA3 just for this, and the request itself can still finish on a peripheral.
+*/
+static int kc_ahash_export(struct ahash_request *req, void *out)
+{
+	struct kc_ahash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+	struct crypto_shash *tfm = ketchup_drvr_data.soft_tfm[ctx->hash_size];
+	int error;
+
+	if (rctx->soft) {
+		return crypto_shash_export(&rctx->desc, out);
+	}
+
+	{
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+		error = crypto_shash_init(desc);
+		if (!error) {
+			error = crypto_shash_update(desc, rctx->buffer, rctx->length);
+		}
+		if (!error) {
+			error = crypto_shash_export(desc, out);
+		}
+		shash_desc_zero(desc);
+	}
+
+	return error;
+}
+
+/**
+ * A peripheral can't be loaded with a state, so the message finishes in software
+*/
+static int kc_ahash_import(struct ahash_request *req, const void *in)
+{
+	struct kc_ahash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+	struct kc_ahash_reqctx *rctx = ahash_request_ctx(req);
+
+	kc_ahash_init(req);
+	rctx->desc.tfm = ketchup_drvr_data.soft_tfm[ctx->hash_size];
+	rctx->soft = true;
+
+	return crypto_shash_import(&rctx->desc, in);
+}
+
+static int kc_ahash_cra_init(struct crypto_tfm *tfm)
+{
+	struct crypto_ahash *ahash = __crypto_ahash_cast(tfm);
+	struct kc_ahash_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		if (kc_digest_bytes[size] == crypto_ahash_digestsize(ahash)) {
+			ctx->hash_size = size;
+		}
+	}
+
+	ctx->enginectx.op.do_one_request = kc_ahash_do_one_request;
+	crypto_ahash_set_reqsize(
+		ahash, sizeof(struct kc_ahash_reqctx) + crypto_shash_descsize(ketchup_drvr_data.soft_tfm[ctx->hash_size])
+	);
+
+	return 0;
+}
+
+#define KC_AHASH_ALG(bits) {							\
+	.init = kc_ahash_init,							\
+	.update = kc_ahash_update,						\
+	.final = kc_ahash_final,						\
+	.finup = kc_ahash_finup,						\
+	.digest = kc_ahash_digest,						\
+	.export = kc_ahash_export,						\
+	.import = kc_ahash_import,						\
+	.halg = {								\
+		.digestsize = SHA3_##bits##_DIGEST_SIZE,			\
+		.statesize = sizeof(struct sha3_state),				\
+		.base = {							\
+			.cra_name = "sha3-" #bits,				\
+			.cra_driver_name = "sha3-" #bits "-ketchup",		\
+			.cra_priority = KC_CRYPTO_PRIORITY,			\
+			.cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_KERN_DRIVER_ONLY, \
+			.cra_blocksize = SHA3_##bits##_BLOCK_SIZE,		\
+			.cra_ctxsize = sizeof(struct kc_ahash_ctx),		\
+			.cra_module = THIS_MODULE,				\
+			.cra_init = kc_ahash_cra_init,				\
+		},								\
+	},									\
+}
+
+static struct ahash_alg kc_ahash_algs[] = {
+	KC_AHASH_ALG(512),
+	KC_AHASH_ALG(384),
+	KC_AHASH_ALG(256),
+	KC_AHASH_ALG(224),
+};
+
+/**
+ * Gives a peripheral its request queue. Returns 0 or a negative error code.
+*/
+static int kc_crypto_engine_start(struct ketchup_device *device, struct device *dev)
+{
+	int error;
+
+	// Real time, since the kernel users are often in the I/O path
+	device->engine = crypto_engine_alloc_init(dev, true);
+	if (!device->engine) {
+		return -ENOMEM;
+	}
+
+	error = crypto_engine_start(device->engine);
+	if (error) {
+		crypto_engine_exit(device->engine);
+		device->engine = NULL;
+	}
+
+	return error;
+}
+
+static void kc_crypto_engine_stop(struct ketchup_device *device)
+{
+	if (device->engine) {
+		crypto_engine_exit(device->engine);
+		device->engine = NULL;
+	}
+}
+
+/**
+ * Registers the algorithms once the first peripheral is there. Since the driver
+ * works fine without them, errors are only logged. The crypto manager tests
+ * the algorithms against its own test vectors while registering them.
+*/
+static void kc_crypto_register(void)
+{
+	int error;
+
+	if (ketchup_drvr_data.crypto_registered) {
+		return;
+	}
+
+	// The peripherals are back, the engines can take requests again
+	WRITE_ONCE(ketchup_drvr_data.crypto_stopping, false);
+
+	// It's needed for the long messages and for export and import
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		if (!ketchup_drvr_data.soft_tfm[size]) {
+			kc_err("[crypto_register] no software %s, not registering with the crypto API\n", kc_soft_algorithms[size]);
+			return;
+		}
+	}
+
+	error = crypto_register_ahashes(kc_ahash_algs, ARRAY_SIZE(kc_ahash_algs));
+	if (error) {
+		kc_err("[crypto_register] couldn't register the algorithms. retval = %d\n", error);
+		return;
+	}
+
+	ketchup_drvr_data.crypto_registered = true;
+}
+
+/**
+ * Unregisters the algorithms, and waits for the requests on the engines, so that
+ * the engines and the peripherals can go. tfms allocated before that can be kept
+ * as long as the module is loaded, and hash in software from now on. The engines
+ * never wait for a peripheral, so the requests they still have finish quickly.
+*/
+static void kc_crypto_unregister(void)
+{
+	WRITE_ONCE(ketchup_drvr_data.crypto_stopping, true);
+	// Whoever saw the flag clear has queued their request by now
+	synchronize_rcu();
+	wait_event(ketchup_drvr_data.crypto_idle, atomic_read(&ketchup_drvr_data.crypto_queued) == 0);
+
+	if (ketchup_drvr_data.crypto_registered) {
+		crypto_unregister_ahashes(kc_ahash_algs, ARRAY_SIZE(kc_ahash_algs));
+		ketchup_drvr_data.crypto_registered = false;
+	}
+}
+
+#else
+
+// CRYPTO_ENGINE has no prompt, only the drivers that use it select it, so make it
+// obvious that the provider is missing rather than leave it out without a word
+#warning "CONFIG_CRYPTO_ENGINE is off, building without the sha3-* crypto API provider (see the Crypto API section of Petalinux/README.md)"
+
+// Without crypto_engine in the kernel there's no crypto API provider
+static int kc_crypto_engine_start(struct ketchup_device *device, struct device *dev) { return 0; }
+static void kc_crypto_engine_stop(struct ketchup_device *device) { }
+static void kc_crypto_unregister(void) { }
+
+static void kc_crypto_register(void)
+{
+	kc_info("[crypto_register] built without CONFIG_CRYPTO_ENGINE, not registering with the crypto API\n");
+}
+
+#endif
+
+// ========================== sysfs =============================
+
+/**
+ * The various attributes that will pop up in /sys/class/CLASS_NAME/DRIVER_NAME/
+ * The DEVICE_ATTR macro arguments are attribute_name, r/w, read_callback, write_callback
+ * Remember that each attribute will expand in dev_attr_(attribute-name) so add the
+ * correct code in the init and exit functions.
+*/
+
+static const int kc_hash_bits[4] = { 512, 384, 256, 224 };
+
+/**
+ * This declares the attribute as read only. This will expand 
+ * into dev_attr_hash_size, and will call the function hash_size_show.
+ * It also declares the permissions as r-- r-- r-- (0444)
+*/
+static DEVICE_ATTR_RO(hash_size);
+static ssize_t hash_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_devices_container *container;
+	struct ketchup_device * curr_device;
+	unsigned long index;
+	int len = 0;
+
+	container = &ketchup_drvr_data.devices;
+
+	mutex_lock(&container->array_write_lock);
+
+	// sysfs_emit_at stops at the end of the page, which is
+	// enough for about 200 peripherals
+	xa_for_each(&container->registered_devices, index, curr_device) {
+		if (curr_device->hash_size < HASH_512 || curr_device->hash_size > HASH_224) {
+			kc_err(
+				"[sysfs_hash_size] invalid hash size for peripheral %lu: %d\n", 
+				index, 
+				curr_device->hash_size
+			);
+			len += sysfs_emit_at(buf, len, "HashSize[%lu] = invalid\n", index);
+			continue;
+		}
+		len += sysfs_emit_at(buf, len, "HashSize[%lu] = %d\n", index, kc_hash_bits[curr_device->hash_size]);
+	}
+
+	mutex_unlock(&container->array_write_lock);
+
+	return len;
+}
+
+
+static DEVICE_ATTR_RO(current_usage);
+/**
+ * This attributes reveals the current usage of all the peripherals
+ * When called you will be able to see all the peripherals and the 
+ * pid of the process currently using it
+*/
+static ssize_t current_usage_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_device *curr_device;
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	unsigned long i;
+	int len = 0;
+
+	mutex_lock(&container->array_write_lock);
+
+	xa_for_each(&container->registered_devices, i, curr_device) {
+		// If the peripheral is available, it means 
+		// that no process is currently holding it
+		if(!test_bit(i, container->busy_map)){
+			len += sysfs_emit_at(buf, len, "%lu:\n", i);
+		} else {
+			len += sysfs_emit_at(buf, len, "%lu:%d\n", i, curr_device->current_process);
+		}
+	}
+
+	mutex_unlock(&container->array_write_lock);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(binding_stats);
+/**
+ * How many times fds got a peripheral for a message and gave it back.
+ * Sampling it twice gives the binding rate, while the difference
+ * between the two is the number of peripherals bound right now.
+*/
+static ssize_t binding_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+
+	return sysfs_emit(
+		buf, "binds: %lld\nunbinds: %lld\n",
+		atomic64_read(&container->binds), atomic64_read(&container->unbinds)
+	);
+}
+
+static const char *const kc_prio_names[KC_PRIO_CLASSES] = { "latency", "normal", "bulk" };
+
+static DEVICE_ATTR_RO(wait_times);
+/**
+ * How long fds waited for a peripheral, for each priority class:
+ * the number of waits, their average and maximum, and a histogram
+ * with power of two buckets.
+*/
+static ssize_t wait_times_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct kc_histogram *stats;
+	uint64_t count, buckets;
+	int len = 0;
+
+	for (int class = 0; class < KC_PRIO_CLASSES; class++) {
+		stats = &ketchup_drvr_data.devices.wait_stats[class];
+		count = atomic64_read(&stats->count);
+
+		len += sysfs_emit_at(
+			buf, len, "%s: waits %llu, avg %llu us, max %llu us\n", kc_prio_names[class], count,
+			count ? div64_u64(atomic64_read(&stats->total_ns), count * NSEC_PER_USEC) : 0,
+			div_u64(atomic64_read(&stats->max_ns), NSEC_PER_USEC)
+		);
+
+		for (int bucket = 0; bucket < KC_HISTOGRAM_BUCKETS; bucket++) {
+			buckets = atomic64_read(&stats->buckets[bucket]);
+			if (buckets == 0) {
+				continue;
+			}
+
+			if (bucket == KC_HISTOGRAM_BUCKETS - 1) {
+				len += sysfs_emit_at(buf, len, "  >= %lu us: %llu\n", 1UL << (bucket - 1), buckets);
+			} else {
+				len += sysfs_emit_at(buf, len, "  < %lu us: %llu\n", 1UL << bucket, buckets);
+			}
+		}
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(fair_share);
+/**
+ * Turns the per user fair sharing of the peripherals on (1) or off (0)
+*/
+static ssize_t fair_share_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ketchup_drvr_data.devices.fair_share));
+}
+
+static ssize_t fair_share_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	bool enable;
+
+	if (kstrtobool(buf, &enable)) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(ketchup_drvr_data.devices.fair_share, enable);
+	return count;
+}
+
+static DEVICE_ATTR_RW(uid_weights);
+/**
+ * The users that used the peripherals while fair sharing was on, with their
+ * weight and how much peripheral time they used, scaled by it.
+ * Writing "uid weight" sets the weight of a user: one with twice the weight
+ * of another gets the peripherals for twice the time when both are waiting.
+*/
+static ssize_t uid_weights_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct kc_uid_share *share;
+	int len = 0;
+
+	spin_lock(&container->wait_lock);
+	list_for_each_entry(share, &container->shares, node) {
+		len += sysfs_emit_at(
+			buf, len, "%u %u %llu\n",
+			from_kuid_munged(&init_user_ns, share->uid), share->weight, div_u64(share->vtime, NSEC_PER_USEC)
+		);
+	}
+	spin_unlock(&container->wait_lock);
+
+	return len;
+}
+
+static ssize_t uid_weights_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct kc_uid_share *share;
+	unsigned int uid, weight;
+	kuid_t kuid;
+
+	if (sscanf(buf, "%u %u", &uid, &weight) != 2 || weight == 0 || weight > 1024 * KC_SHARE_DEFAULT_WEIGHT) {
+		return -EINVAL;
+	}
+
+	kuid = make_kuid(&init_user_ns, uid);
+	if (!uid_valid(kuid)) {
+		return -EINVAL;
+	}
+
+	share = kc_uid_share_get(kuid);
+	if (!share) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&container->wait_lock);
+	share->weight = weight;
+	spin_unlock(&container->wait_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fallback_threshold);
+/**
+ * Turns the software fallback on, with a value in bytes, or off with 0.
+ * When it's on, a message that can't get a peripheral right away is hashed
+ * in software, and moved to a peripheral if one frees up before the message
+ * gets longer than this.
+*/
+static ssize_t fallback_threshold_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%zu\n", READ_ONCE(ketchup_drvr_data.devices.fallback_threshold));
+}
+
+static ssize_t fallback_threshold_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long threshold;
+
+	if (kstrtoul(buf, 0, &threshold) || threshold > KC_FALLBACK_MAX_THRESHOLD) {
+		return -EINVAL;
+	}
+
+	// Without the software SHA3 in the kernel there's nothing to fall back to
+	if (threshold > 0 && !ketchup_drvr_data.soft_tfm[HASH_512]) {
+		return -ENODEV;
+	}
+
+	WRITE_ONCE(ketchup_drvr_data.devices.fallback_threshold, threshold);
+	return count;
+}
+
+static DEVICE_ATTR_RO(fallback_stats);
+/**
+ * How often the software fallback kicked in: messages started in software
+ * and moved to a peripheral later, and how many of the digests read were
+ * computed in software, also as a percentage.
+*/
+static ssize_t fallback_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	uint64_t digests = atomic64_read(&container->digests);
+	uint64_t soft_digests = atomic64_read(&container->soft_digests);
+
+	return sysfs_emit(
+		buf, "fallbacks: %lld\nmigrations: %lld\ndigests: %llu\nsoft_digests: %llu\nfallback_rate: %llu%%\n",
+		atomic64_read(&container->fallbacks), atomic64_read(&container->migrations),
+		digests, soft_digests, digests ? div64_u64(soft_digests * 100, digests) : 0
+	);
+}
+
+// ====================== Per-Peripheral sysfs ========================
+
+/**
+ * Every peripheral has a directory of its own, the one of its core node:
+ * /sys/class/CLASS_NAME/ketchup!coreN/. The attributes are the same for
+ * all of them, and find their peripheral through the drvdata of the device.
+*/
+
+static struct device_attribute dev_attr_core_hash_size = __ATTR(hash_size, 0444, core_hash_size_show, NULL);
+/**
+ * Hash size the peripheral is set to, in bits
+*/
+static ssize_t core_hash_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_device *device = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", kc_hash_bits[device->hash_size & 3]);
+}
+
+static struct device_attribute dev_attr_core_owner = __ATTR(owner, 0444, core_owner_show, NULL);
+/**
+ * pid of the process using the peripheral, or an empty line if it's free
+*/
+static ssize_t core_owner_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_device *device = dev_get_drvdata(dev);
+
+	if (!test_bit(device->index, ketchup_drvr_data.devices.busy_map)) {
+		return sysfs_emit(buf, "\n");
+	}
+	return sysfs_emit(buf, "%d\n", device->current_process);
+}
+
+static struct device_attribute dev_attr_core_pinned = __ATTR(pinned, 0444, core_pinned_show, NULL);
+/**
+ * 1 while a fd has the peripheral pinned through /dev/ketchup/coreN, or is waiting to
+*/
+static ssize_t core_pinned_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_device *device = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", test_bit(device->index, ketchup_drvr_data.devices.pinned_map));
+}
+
+static struct device_attribute dev_attr_core_stats = __ATTR(stats, 0444, core_stats_show, NULL);
+/**
+ * The counters of the peripheral, the histograms are only in debugfs
+*/
+static ssize_t core_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ketchup_device *device = dev_get_drvdata(dev);
+
+	return sysfs_emit(
+		buf, "acquires: %lld\nbytes: %lld\nmessages: %lld\nbusy: %llu us\n",
+		atomic64_read(&device->stats.acquires), atomic64_read(&device->stats.bytes),
+		atomic64_read(&device->stats.messages), div_u64(atomic64_read(&device->stats.busy_ns), NSEC_PER_USEC)
+	);
+}
+
+static struct attribute *kc_core_attrs[] = {
+	&dev_attr_core_hash_size.attr,
+	&dev_attr_core_owner.attr,
+	&dev_attr_core_pinned.attr,
+	&dev_attr_core_stats.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(kc_core);
+
+// ========================== debugfs =============================
+
+static void kc_debugfs_histogram(struct seq_file *file, const char *name, struct kc_histogram *histogram)
+{
+	uint64_t count = atomic64_read(&histogram->count), buckets;
+
+	seq_printf(
+		file, "  %s: count %llu, avg %llu us, max %llu us\n", name, count,
+		count ? div64_u64(atomic64_read(&histogram->total_ns), count * NSEC_PER_USEC) : 0,
+		div_u64(atomic64_read(&histogram->max_ns), NSEC_PER_USEC)
+	);
+
+	for (int bucket = 0; bucket < KC_HISTOGRAM_BUCKETS; bucket++) {
+		buckets = atomic64_read(&histogram->buckets[bucket]);
+		if (buckets == 0) {
+			continue;
+		}
+
+		if (bucket == KC_HISTOGRAM_BUCKETS - 1) {
+			seq_printf(file, "    >= %lu us: %llu\n", 1UL << (bucket - 1), buckets);
+		} else {
+			seq_printf(file, "    < %lu us: %llu\n", 1UL << bucket, buckets);
+		}
+	}
+}
+
+/**
+ * /sys/kernel/debug/ketchup/stats: the counters and histograms of every
+ * peripheral since the last reset. The busy percentage is how much of that
+ * time the peripheral spent acquired by someone.
+*/
+static int kc_stats_show(struct seq_file *file, void *unused)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct ketchup_device *curr_device;
+	struct kc_peripheral_stats *stats;
+	unsigned long i;
+	uint64_t elapsed = ktime_get_ns() - READ_ONCE(ketchup_drvr_data.stats_since), busy;
+
+	seq_printf(file, "elapsed: %llu ms\n", div_u64(elapsed, NSEC_PER_MSEC));
+
+	// Keeps the peripherals from going away
+	mutex_lock(&container->array_write_lock);
+
+	xa_for_each(&container->registered_devices, i, curr_device) {
+		stats = &curr_device->stats;
+		busy = atomic64_read(&stats->busy_ns);
+
+		seq_printf(file, "peripheral %lu:\n", i);
+		seq_printf(file, "  acquires: %lld\n", atomic64_read(&stats->acquires));
+		seq_printf(file, "  bytes: %lld\n", atomic64_read(&stats->bytes));
+		seq_printf(file, "  messages: %lld\n", atomic64_read(&stats->messages));
+		seq_printf(
+			file, "  busy: %llu us (%llu%%)\n",
+			div_u64(busy, NSEC_PER_USEC), elapsed ? div64_u64(busy * 100, elapsed) : 0
+		);
+		seq_printf(file, "  acquire wait: %llu us\n", div_u64(atomic64_read(&stats->acquire_wait_ns), NSEC_PER_USEC));
+		seq_printf(file, "  poll iterations: %lld\n", atomic64_read(&stats->poll_iterations));
+
+		kc_debugfs_histogram(file, "acquire wait", &stats->acquire_wait);
+		kc_debugfs_histogram(file, "write", &stats->write);
+		kc_debugfs_histogram(file, "digest", &stats->digest);
+	}
+
+	mutex_unlock(&container->array_write_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kc_stats);
+
+/**
+ * /sys/kernel/debug/ketchup/reset: writing anything to it zeroes the statistics
+*/
+static int kc_stats_reset(void *data, u64 value)
+{
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	struct ketchup_device *curr_device;
+	struct kc_peripheral_stats *stats;
+	unsigned long i;
+
+	mutex_lock(&container->array_write_lock);
+
+	xa_for_each(&container->registered_devices, i, curr_device) {
+		stats = &curr_device->stats;
+
+		atomic64_set(&stats->acquires, 0);
+		atomic64_set(&stats->bytes, 0);
+		atomic64_set(&stats->messages, 0);
+		atomic64_set(&stats->busy_ns, 0);
+		atomic64_set(&stats->acquire_wait_ns, 0);
+		atomic64_set(&stats->poll_iterations, 0);
+		kc_histogram_reset(&stats->acquire_wait);
+		kc_histogram_reset(&stats->write);
+		kc_histogram_reset(&stats->digest);
+	}
+
+	WRITE_ONCE(ketchup_drvr_data.stats_since, ktime_get_ns());
+	mutex_unlock(&container->array_write_lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(kc_stats_reset_fops, NULL, kc_stats_reset, "%llu\n");
+
+// ========================== Benchmark ===========================
+
+/**
+ * /sys/kernel/debug/ketchup/bench hashes synthetic buffers on the peripherals
+ * from inside the kernel, like tcrypt does for the crypto API, to tell how fast
+ * they are without system calls and copies from user space in the way.
+ * Writing a list of message sizes to it runs the benchmark, which takes
+ * bench_threads peripherals (0 for all the free ones) and has a kthread hash
+ * bench_messages messages of each size on every one of them, at the same time.
+ * Reading it shows the results of the last run. The benchmark never waits for
+ * a peripheral, so a busy or pinned one can't hang the write, nor rmmod.
+*/
+
+// Up to how many sizes a run can have, and how big they can be
+#define KC_BENCH_MAX_SIZES 8
+#define KC_BENCH_MAX_SIZE (1024 * 1024)
+#define KC_BENCH_MAX_MESSAGES 1000000
+
+// The sizes of tcrypt's generic_hash_speed_template, when none are given
+static const unsigned int kc_bench_default_sizes[] = { 16, 64, 256, 1024, 2048, 4096, 8192 };
+
+struct kc_bench_result {
+	unsigned int size;
+	int threads;
+	// From the first kthread starting to the last one finishing
+	uint64_t window_ns;
+	// Summed over all the kthreads
+	uint64_t busy_ns;
+	uint64_t messages;
+	// Register writes, and Keccak blocks absorbed
+	uint64_t mmio_writes;
+	uint64_t blocks;
+	int error;
+};
+
+static struct {
+	struct mutex lock;
+
+	// Set through debugfs
+	u32 messages;
+	u32 threads;
+	u32 hash_size;
+
+	struct kc_bench_result results[KC_BENCH_MAX_SIZES];
+	int results_len;
+
+	// Tell the kthreads to stop after their current message: abort when the
+	// writer is killed, exiting once the module is going away
+	bool abort;
+	bool exiting;
+} kc_bench = {
+	.lock = __MUTEX_INITIALIZER(kc_bench.lock),
+	.messages = 1000,
+	.threads = 1,
+	.hash_size = HASH_256,
+};
+
+/**
+ * What a kthread does, and what it measured
 */
-static inline uint32_t pack_to_u32_big_endian(uint8_t const data[4]) {
-	return ((uint32_t)data[0] << 24)
-		 | ((uint32_t)data[1] << 16)
-		 | ((uint32_t)data[2] <<  8)
-		 | ((uint32_t)data[3]);
-}
+struct kc_bench_job {
+	const uint8_t *buffer;
+	unsigned int size;
+	u32 messages;
+	HashSize hash_size;
 
-static ssize_t ketchup_write(struct file *filep, const char *user_buffer, size_t user_length, loff_t *off)
-{
-	/**
-	 * The plan is the following:
-	 * 1. we copy inside kernel space the data the user wants to write, keeping in mind that the
-	 * internal buffer is limited to KC_BUF_SIZE
-	 * 2. we send all the data we got from the user to the peripheral, alongside any residual
-	 * unaligned data from the previous write call if present.
-	*/
-	uint8_t buffer[KC_BUF_SIZE];
-	size_t buffer_length, buffer_position;
+	uint64_t start_ns;
+	uint64_t end_ns;
 	int error;
-	int peripheral_index = (int)(uintptr_t)filep->private_data;
+	struct completion done;
+};
 
-	// We need to retrieve from the file descriptor the peripheral index assigned
-	struct ketchup_device *curr_device = kc_get_device(filep);
+static int kc_bench_thread(void *data)
+{
+	struct kc_bench_job *job = data;
+	struct ketchup_device *device;
+	uint32_t digest[512/32];
+	int index;
+
+	// The peripheral is taken like any other user would, but without
+	// waiting: kthreads can't be signalled, so a busy one would hang the run
+	index = peripheral_acquire(0);
+	if (index < 0) {
+		job->error = -EBUSY;
+		complete(&job->done);
+		return 0;
+	}
+	device = kc_device(index);
 
-	kc_info(
-		"[ketchup_write] beginning write for peripheral %d task %d. hash_size = %d\n",
-		peripheral_index, current->pid, curr_device->hash_size
-	);
+	// Same steps as kc_ring_hash, for every message
+	job->start_ns = ktime_get_ns();
+	for (u32 message = 0; message < job->messages; message++) {
+		if (READ_ONCE(kc_bench.abort) || READ_ONCE(kc_bench.exiting)) {
+			job->error = -EINTR;
+			break;
+		}
 
-	// 1. Copy from user space to kernel space the data to write
-	buffer_length = kc_min(KC_BUF_SIZE, user_length);
-	error = copy_from_user(buffer, user_buffer, buffer_length);
-	if (error != 0) {
-		kc_err("[ketchup_write] coudln't copy data from user. retval = %d\n", error);
-		return -1;
-	}
-	kc_info("[ketcuhp_write] copied %d bytes from userspace", buffer_length);
+		writel(1, device->command);
+		device->data_to_send_length = 0;
+		device->hash_size = job->hash_size;
+		writel(device->hash_size << 4, device->control);
 
-	// 2. Send to peripheral in chunks of 4
-	buffer_position = 0;
-	while (buffer_position < buffer_length) {
-		curr_device->data_to_send[curr_device->data_to_send_length] = buffer[buffer_position];
-		curr_device->data_to_send_length++;
-		buffer_position++;
+		peripheral_send_bytes(device, job->buffer, job->size);
+		peripheral_finish(device, digest, kc_digest_bytes[job->hash_size]);
 
-		if (curr_device->data_to_send_length == 4) {
-			uint32_t packed = pack_to_u32_big_endian(curr_device->data_to_send);
-			kc_info("[ketchup_write] writing %08x to input\n", packed);
-			writel(packed, curr_device->input);
-			curr_device->data_to_send_length = 0;
-		}
+		// Polling the peripheral never sleeps
+		cond_resched();
 	}
+	job->end_ns = ktime_get_ns();
 
-	// All done
-	return buffer_length;
+	peripheral_release(index);
+	complete(&job->done);
+	return 0;
 }
 
 /**
- * This function is the one responsible for handling all the read operations performed
- * on the /dev/ketchup_driver file.
- * When the user reads we need to:
- * 1. Set this write as the last one;
- * 2. Send the last packet of input data to the peripheral;
- * 3. Start polling the peripheral on the status register;
- * 4. Once the output is ready, we save the output into a buffer;
- * 5. We copy the output buffer to user space;
- * 6. Reset the peripheral;
- * 7. Set the same hash size as before in control.
+ * Hashes messages of one size on threads peripherals at once.
+ * Returns -EINTR if the writer was killed meanwhile, 0 otherwise.
 */
-static ssize_t ketchup_read(struct file *filep, char *user_buffer, size_t user_len, loff_t *off)
+static int kc_bench_run(struct kc_bench_result *result, const uint8_t *buffer, int threads)
 {
-	int assigned_periph_index = (int)(uintptr_t)filep->private_data;
-	struct ketchup_device *curr_device = kc_get_device(filep);
-	uint32_t control_value = 0, packed_input, output;
-	size_t hash_size_bytes, data_to_copy;
-	uint8_t output_buffer[512/8];
-	int error;
-
-	// First of all, check that user requested the correct amount of bytes
-	switch (curr_device->hash_size)
-	{
-		case HASH_512:
-			hash_size_bytes = 512/8;
-			break;
-		case HASH_384:
-			hash_size_bytes = 384/8;
-			break;
-		case HASH_256:
-			hash_size_bytes = 256/8;
-			break;
-		case HASH_224:
-			hash_size_bytes = 224/8;
-			break;
-		default:
-			kc_err(
-				"[ketchup_read] the peripheral %d owned by task %d has an impossible hash size (%d)!\n", 
-				assigned_periph_index, current->pid, curr_device->hash_size
-			);
-			return -EINVAL;
+	struct kc_bench_job *jobs;
+	struct task_struct *task;
+	uint64_t first = U64_MAX, last = 0;
+	bool killed = false;
+	// Bytes absorbed per permutation, 200 minus twice the digest
+	size_t rate = 200 - 2 * kc_digest_bytes[kc_bench.hash_size];
+
+	result->threads = threads;
+
+	jobs = kcalloc(threads, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs) {
+		result->error = -ENOMEM;
+		return 0;
 	}
 
-	// Make sure that the user requested at least as many 
-	// bytes as the output, otherwise we might copy more
-	// than the user asked, which is potentially dangerous
-	if (user_len < hash_size_bytes) {
-		return -EINVAL;
+	for (int i = 0; i < threads; i++) {
+		jobs[i].buffer = buffer;
+		jobs[i].size = result->size;
+		jobs[i].messages = kc_bench.messages;
+		jobs[i].hash_size = kc_bench.hash_size;
+		init_completion(&jobs[i].done);
+
+		task = kthread_run(kc_bench_thread, &jobs[i], "ketchup_bench/%d", i);
+		if (IS_ERR(task)) {
+			jobs[i].error = PTR_ERR(task);
+			complete(&jobs[i].done);
+		}
 	}
-	
-	// 1. Set control register to appropriate value
-
-	// Bytes left to send
-	control_value |= curr_device->data_to_send_length;
-
-	// This is the last packet
-	control_value |= 1 << 2;
-
-	// Hash size
-	control_value |= curr_device->hash_size << 4;
-	writel(control_value, curr_device->control);
-	kc_info("[ketchup_read] writing %08x to control\n", control_value);
 
-	// 2. Send last packed of input data
-	packed_input = pack_to_u32_big_endian(curr_device->data_to_send);
-	writel(packed_input, curr_device->input);
-	kc_info("[ketchup_read] writing %08x to input\n", packed_input);
-	
-	// 3. Wait for polling
-	for (int i = 0; i < 100; i++) {
-		kc_info("[ketchup_read] polling iter %d\n", i);
-		if ((readl(curr_device->status) & 1) != 0) {
-			break;
+	// The kthreads use the jobs and the buffer until they're done, so once the
+	// writer is killed they're told to stop, and waited for anyway. That's short,
+	// they never wait for a peripheral and stop after the message they're on.
+	for (int i = 0; i < threads; i++) {
+		if (!killed && wait_for_completion_killable(&jobs[i].done)) {
+			WRITE_ONCE(kc_bench.abort, true);
+			killed = true;
 		}
-		if (i == 99) {
-			kc_err("[ketchup_read] something went wrong, stop after 100 iters");
+		if (killed) {
+			wait_for_completion(&jobs[i].done);
 		}
 	}
 
-	// 4. Get output from peripheral
-	for (int i = 0; i < hash_size_bytes/4; i++) {
-		output = readl(curr_device->output_base + i * 4);
-		output_buffer[i * 4 + 0] = (output >> 24) & 0xFF;
-		output_buffer[i * 4 + 1] = (output >> 16) & 0xFF;
-		output_buffer[i * 4 + 2] = (output >> 8)  & 0xFF;
-		output_buffer[i * 4 + 3] = output         & 0xFF;
-	}
-
-	// 5. Send output to user
-	data_to_copy = min(hash_size_bytes, user_len);
-	error = copy_to_user(user_buffer, output_buffer, data_to_copy);
-
-	if (error < 0) {
-		kc_err("[ketchup_read] copy_to_user failed. retval = %d\n", error);
-		return error;
+	for (int i = 0; i < threads; i++) {
+		if (jobs[i].error) {
+			result->error = jobs[i].error;
+			continue;
+		}
+		first = min(first, jobs[i].start_ns);
+		last = max(last, jobs[i].end_ns);
+		result->busy_ns += jobs[i].end_ns - jobs[i].start_ns;
+		result->messages += jobs[i].messages;
 	}
+	result->window_ns = last > first ? last - first : 0;
 
-	// 6. Reset the peripheral, for good measure
-	writel(1, curr_device->command);
-	curr_device->data_to_send_length = 0;
-
-	// 7. Reset previous hash size into control
-	control_value = curr_device->hash_size << 4;
-	writel(control_value, curr_device->control);
-	kc_info("[ketchup_read] writing %08x to control\n", control_value);
+	// Reset, control and one input write per word, then control and the last
+	// input word. Padding can add a block of its own at the end of the message
+	result->mmio_writes = result->messages * (4 + result->size / 4);
+	result->blocks = result->messages * (result->size / rate + 1);
 
-	return data_to_copy;
+	kfree(jobs);
+	return killed ? -EINTR : 0;
 }
 
 /**
- * This function is called when a file descriptor opened of our character device file 
- * (i.e /dev/ketchup_driver) is closed.
- * What we do is we reset the peripheral and than we release the acquired peripheral
+ * How many peripherals the benchmark could take right now: the ones
+ * that nobody is using and that aren't kept for a pinning fd
 */
-static int ketchup_release(struct inode *inod, struct file *fil)
+static int kc_bench_free_peripherals(void)
 {
-	int assigned_periph_index = (int)(uintptr_t)fil->private_data;
+	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	size_t len = smp_load_acquire(&container->registered_devices_len);
+	int free = 0;
 
-	peripheral_release(assigned_periph_index);
+	for (size_t index = 0; index < len; index++) {
+		if (!test_bit(index, container->busy_map) && !test_bit(index, container->pinned_map)) {
+			free++;
+		}
+	}
 
-	return 0;
+	return free;
 }
 
-// ========================== sysfs =============================
-
-/**
- * The various attributes that will pop up in /sys/class/CLASS_NAME/DRIVER_NAME/
- * The DEVICE_ATTR macro arguments are attribute_name, r/w, read_callback, write_callback
- * Remember that each attribute will expand in dev_attr_(attribute-name) so add the
- * correct code in the init and exit functions.
-*/
-
-/**
- * This declares the attribute as read only. This will expand 
- * into dev_attr_hash_size, and will call the function hash_size_show.
- * It also declares the permissions as r-- r-- r-- (0444)
-*/
-static DEVICE_ATTR_RO(hash_size);
-static ssize_t hash_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+static int kc_bench_show(struct seq_file *file, void *unused)
 {
-	struct ketchup_devices_container *container;
-	struct ketchup_device * curr_device;
-	// ~ 20 char for device
-	char buffer[MAX_DEVICES * 24];
-	int len = 0;
+	struct kc_bench_result *result;
+	uint64_t bytes, writes_per_block;
 
-	container = &ketchup_drvr_data.devices;
+	// A run holds the lock until it's over
+	if (mutex_lock_killable(&kc_bench.lock)) {
+		return -EINTR;
+	}
 
-	mutex_lock(&container->array_write_lock);
+	if (kc_bench.results_len == 0) {
+		seq_puts(file, "no benchmark yet, write the message sizes to this file to run one\n");
+	}
 
-	for (int index = 0; index < container->registered_devices_len; index++){
-		curr_device = container->registered_devices[index];
-		switch (curr_device->hash_size)
-		{
-			case HASH_512:
-				/* code */
-				len += snprintf(buffer + len, sizeof(buffer) - len, "HashSize[%d] = 512\n", index);
-				break;
-			case HASH_384:
-				len += snprintf(buffer + len, sizeof(buffer) - len, "HashSize[%d] = 384\n", index);
-				break;
-			case HASH_256:
-				len += snprintf(buffer + len, sizeof(buffer) - len, "HashSize[%d] = 256\n", index);
-				break;
-			case HASH_224:
-				len += snprintf(buffer + len, sizeof(buffer) - len, "HashSize[%d] = 224\n", index);
-				break; 
-			default:
-				kc_err(
-					"[sysfs_hash_size] invalid hash size for peripheral %d: %d\n", 
-					index, 
-					curr_device->hash_size
-				);
-				len += snprintf(buffer + len, sizeof(buffer) - len, "HashSize[%d] = invalid\n", index);
-				break;
+	for (int i = 0; i < kc_bench.results_len; i++) {
+		result = &kc_bench.results[i];
+		if (result->error) {
+			seq_printf(file, "%u bytes: failed (%d)\n", result->size, result->error);
+			continue;
 		}
+
+		bytes = result->messages * result->size;
+		writes_per_block = result->blocks ? div64_u64(result->mmio_writes * 100, result->blocks) : 0;
+		seq_printf(
+			file, "%d threads, %7u bytes: %llu messages, %llu MB/s, %llu ns/message, %llu.%02llu MMIO writes/block\n",
+			result->threads, result->size, result->messages,
+			result->window_ns ? div64_u64(bytes * NSEC_PER_USEC, result->window_ns) : 0,
+			result->messages ? div64_u64(result->busy_ns, result->messages) : 0,
+			div_u64(writes_per_block, 100), writes_per_block % 100
+		);
 	}
 
-	mutex_unlock(&container->array_write_lock);
+	mutex_unlock(&kc_bench.lock);
 
-	strcpy(buf, buffer);
-	return len;
+	return 0;
 }
 
-
-static DEVICE_ATTR_RO(current_usage);
-/**
- * This attributes reveals the current usage of all the peripherals
- * When called you will be able to see all the peripherals and the 
- * pid of the process currently using it
-*/
-static ssize_t current_usage_show(struct device *dev, struct device_attribute *attr, char *buf)
+static ssize_t kc_bench_write(struct file *filep, const char __user *user_buffer, size_t count, loff_t *ppos)
 {
-	struct ketchup_device *curr_device;
-	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
-	// ~ 15 char per device, conservative estimate
-	char buffer[MAX_DEVICES * 15];
-	int len = 0;
+	unsigned int sizes[KC_BENCH_MAX_SIZES], max_size = 0;
+	char *text, *cursor, *token;
+	uint8_t *buffer;
+	int sizes_len = 0, threads;
+	ssize_t error = 0;
+
+	text = memdup_user_nul(user_buffer, count);
+	if (IS_ERR(text)) {
+		return PTR_ERR(text);
+	}
 
-	mutex_lock(&container->array_write_lock);
+	cursor = text;
+	while ((token = strsep(&cursor, " ,\n")) != NULL) {
+		if (*token == '\0') {
+			continue;
+		}
+		if (sizes_len == KC_BENCH_MAX_SIZES || kstrtouint(token, 0, &sizes[sizes_len]) ||
+		    sizes[sizes_len] == 0 || sizes[sizes_len] > KC_BENCH_MAX_SIZE) {
+			kfree(text);
+			return -EINVAL;
+		}
+		sizes_len++;
+	}
+	kfree(text);
 
-	for (int i = 0; i < container->registered_devices_len; i++){
-		curr_device = container->registered_devices[i];
+	if (sizes_len == 0) {
+		sizes_len = ARRAY_SIZE(kc_bench_default_sizes);
+		memcpy(sizes, kc_bench_default_sizes, sizeof(kc_bench_default_sizes));
+	}
+	for (int i = 0; i < sizes_len; i++) {
+		max_size = max(max_size, sizes[i]);
+	}
 
-		// If the peripheral is available, it means 
-		// that no process is currently holding it
-		if(curr_device->peripheral_available == AVAILABLE){
-			len += snprintf(buffer + len, sizeof(buffer) - len, "%d:\n", i);
-		} else {
-			len += snprintf(buffer + len, sizeof(buffer) - len, "%d:%d\n", i, curr_device->current_process);
+	if (mutex_lock_interruptible(&kc_bench.lock)) {
+		return -EINTR;
+	}
+
+	if (kc_bench.hash_size > HASH_224 || kc_bench.messages == 0 || kc_bench.messages > KC_BENCH_MAX_MESSAGES) {
+		error = -EINVAL;
+		goto out;
+	}
+
+	if (READ_ONCE(kc_bench.exiting)) {
+		error = -ENODEV;
+		goto out;
+	}
+	kc_bench.abort = false;
+
+	// One kthread per free peripheral at most, the others wouldn't get one
+	if (smp_load_acquire(&ketchup_drvr_data.devices.registered_devices_len) == 0) {
+		error = -ENODEV;
+		goto out;
+	}
+	threads = kc_bench_free_peripherals();
+	if (threads == 0) {
+		error = -EBUSY;
+		goto out;
+	}
+	if (kc_bench.threads) {
+		threads = min_t(int, threads, kc_bench.threads);
+	}
+
+	buffer = kvmalloc(max_size, GFP_KERNEL);
+	if (!buffer) {
+		error = -ENOMEM;
+		goto out;
+	}
+	for (unsigned int i = 0; i < max_size; i++) {
+		buffer[i] = i * 31 + 7;
+	}
+
+	memset(kc_bench.results, 0, sizeof(kc_bench.results));
+	kc_bench.results_len = sizes_len;
+	for (int i = 0; i < sizes_len; i++) {
+		kc_bench.results[i].size = sizes[i];
+		error = kc_bench_run(&kc_bench.results[i], buffer, threads);
+		if (error) {
+			kc_bench.results_len = i + 1;
+			break;
 		}
 	}
 
-	mutex_unlock(&container->array_write_lock);
+	kvfree(buffer);
+out:
+	mutex_unlock(&kc_bench.lock);
 
-	// Now we need to copy data to the user space.
-	// No need for copy_to_user here. 
-	strcpy(buf, buffer);
-	return len;
+	return error ? error : count;
+}
+
+static int kc_bench_open(struct inode *inode, struct file *filep)
+{
+	return single_open(filep, kc_bench_show, NULL);
 }
 
+static const struct file_operations kc_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = kc_bench_open,
+	.read = seq_read,
+	.write = kc_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 // ====================== Device Probing ==============================
 
 /**
@@ -669,7 +4131,7 @@ static int ketchup_driver_probe(struct platform_device *pdev)
 	}
 
 	// Allocate space to accomodate one peripheral description 
-	lp = (struct ketchup_device *) kmalloc(sizeof(struct ketchup_device), GFP_KERNEL);
+	lp = (struct ketchup_device *) kzalloc(sizeof(struct ketchup_device), GFP_KERNEL);
 	if (!lp) {
 		dev_err(dev, "Cound not allocate ketchup-driver device\n");
 		return -ENOMEM;
@@ -705,12 +4167,20 @@ static int ketchup_driver_probe(struct platform_device *pdev)
 	lp->input = lp->base_addr + 8;
 	lp->command = lp->base_addr + 12;
 	lp->output_base = lp->base_addr + 16;
+	lp->nonce_base = lp->base_addr + 0x50;
 
 	// Initialize device state
-	lp->peripheral_available = AVAILABLE;
 	lp->current_process = 0;
 	lp->data_to_send_length = 0;
-	
+	lp->ring = NULL;
+	lp->uring_mode = false;
+	lp->uring_busy = 0;
+
+	rc = kc_crypto_engine_start(lp, dev);
+	if (rc) {
+		dev_err(dev, "ketchup-driver: Could not start the crypto engine\n");
+		goto error3;
+	}
 
 	// Save device into container
 	container = &ketchup_drvr_data.devices;
@@ -720,18 +4190,50 @@ static int ketchup_driver_probe(struct platform_device *pdev)
 		mutex_unlock(&container->array_write_lock);
 
 		// FIXME: Probably not the correct return value here
-		return -EINVAL;
+		rc = -EINVAL;
+		goto error4;
+	}
+
+	lp->index = container->registered_devices_len;
+	rc = xa_err(xa_store(&container->registered_devices, lp->index, lp, GFP_KERNEL));
+	if (rc) {
+		kc_err("[ketchup_driver_probe] could not register device number %d\n", lp->index);
+		mutex_unlock(&container->array_write_lock);
+		goto error4;
 	}
 
-	container->registered_devices[container->registered_devices_len] = lp;
-	container->registered_devices_len++;
+	// Its bit is already clear, so the device can be acquired as soon as it's counted
+	smp_store_release(&container->registered_devices_len, container->registered_devices_len + 1);
 
 	kc_info("[ketchup_driver_probe] registered device number %d\n", container->registered_devices_len);
 	mutex_unlock(&container->array_write_lock);
 
-	up(&container->dev_free_sema);
+	wake_up_interruptible(&container->dev_free_wait);
+
+	// /dev/ketchup/coreN and its sysfs directory. Like the other sysfs
+	// attributes, the peripheral works fine without them
+	lp->core_device = device_create_with_groups(
+		ketchup_drvr_data.driver_class,
+		dev,
+		MKDEV(MAJOR(ketchup_drvr_data.device_number), MINOR(ketchup_drvr_data.device_number) + KC_MINOR_CORES + lp->index),
+		lp,
+		kc_core_groups,
+		"ketchup!core%d", lp->index
+	);
+	if (IS_ERR(lp->core_device)) {
+		kc_err("[ketchup_driver_probe] could not create the node of device number %d\n", lp->index);
+		lp->core_device = NULL;
+	}
+
+	if (lp->index == 0) {
+		kc_crypto_register();
+	}
 
 	return 0;
+error4:
+	kc_crypto_engine_stop(lp);
+error3:
+	iounmap(lp->base_addr);
 error2:
 	release_mem_region(lp->mem_start, lp->mem_end - lp->mem_start + 1);
 error1:
@@ -750,11 +4252,15 @@ static int ketchup_driver_remove(struct platform_device *pdev)
 	struct device *dev = &pdev->dev;
 	struct ketchup_device *curr_device;
 	struct ketchup_devices_container *container = &ketchup_drvr_data.devices;
+	unsigned long i;
 
 	// This is not exactly correct, but we're going to remove all peripherals
 	// even when just one is removed. We somehow need a better way to do this
 	kc_info("[ketchup_driver_remove] removing all peripherals\n");
 
+	// Nobody can send crypto requests to the peripherals from now on
+	kc_crypto_unregister();
+
 	mutex_lock(&container->array_write_lock);
 
 	if (container->registered_devices_len <= 0) {
@@ -762,12 +4268,16 @@ static int ketchup_driver_remove(struct platform_device *pdev)
 		return 0;
 	}
 
-	for (int i = 0; i < container->registered_devices_len; i++) {
-		curr_device = container->registered_devices[i];
+	xa_for_each(&container->registered_devices, i, curr_device) {
+		if (curr_device->core_device) {
+			device_destroy(ketchup_drvr_data.driver_class, curr_device->core_device->devt);
+		}
+		kc_crypto_engine_stop(curr_device);
 		iounmap(curr_device->base_addr);
 		release_mem_region(curr_device->mem_start, curr_device->mem_end - curr_device->mem_start + 1);
 		kfree(curr_device);
 	}
+	xa_destroy(&container->registered_devices);
 	container->registered_devices_len = 0;
 	mutex_unlock(&container->array_write_lock);
 
@@ -788,6 +4298,16 @@ static char *ketchup_devnode(struct device *dev, umode_t *mode)
 
 // ===================== Module Functions ==========================
 
+static void kc_destroy_algorithm_nodes(void)
+{
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		if (ketchup_drvr_data.algorithm_devices[size]) {
+			device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.algorithm_devices[size]->devt);
+			ketchup_drvr_data.algorithm_devices[size] = NULL;
+		}
+	}
+}
+
 /**
  * init function, it's the first function that is called when the driver is loaded
 */
@@ -802,7 +4322,7 @@ static int __init ketchup_driver_init(void)
 	 * - the number of minor numbers required
 	 * - the name of the associated device or driver
 	*/
-	if (alloc_chrdev_region(&ketchup_drvr_data.device_number, 0, 1, DRIVER_NAME) < 0)
+	if (alloc_chrdev_region(&ketchup_drvr_data.device_number, 0, KC_MINORS, DRIVER_NAME) < 0)
 	{
 		kc_err("[ketchup_driver_init] could not allocate device number\n");
 		return -1;
@@ -822,7 +4342,7 @@ static int __init ketchup_driver_init(void)
 	if (IS_ERR(ketchup_drvr_data.driver_class))
 	{
 		kc_err("[ketchup_driver_init] could not create class\n");
-		unregister_chrdev_region(ketchup_drvr_data.device_number, 1);
+		unregister_chrdev_region(ketchup_drvr_data.device_number, KC_MINORS);
 		return -1;
 	}
 
@@ -845,23 +4365,64 @@ static int __init ketchup_driver_init(void)
 	{
 		kc_err("[ketchup_driver_init] device initialization failed\n");
 		class_destroy(ketchup_drvr_data.driver_class);
-		unregister_chrdev_region(ketchup_drvr_data.device_number, 1);
+		unregister_chrdev_region(ketchup_drvr_data.device_number, KC_MINORS);
+		return -1;
+	}
+
+	/**
+	 * The second minor is /dev/ketchup_handle, which gives acquire handles:
+	 * fds that are opened without a peripheral and can be polled for one
+	*/
+	ketchup_drvr_data.handle_device = device_create(
+		ketchup_drvr_data.driver_class,
+		NULL,
+		MKDEV(MAJOR(ketchup_drvr_data.device_number), MINOR(ketchup_drvr_data.device_number) + 1),
+		NULL,
+		HANDLE_NAME
+	);
+	if (IS_ERR(ketchup_drvr_data.handle_device))
+	{
+		kc_err("[ketchup_driver_init] handle device initialization failed\n");
+		device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number);
+		class_destroy(ketchup_drvr_data.driver_class);
+		unregister_chrdev_region(ketchup_drvr_data.device_number, KC_MINORS);
 		return -1;
 	}
 
+	/**
+	 * Then /dev/ketchup/sha3-512 to /dev/ketchup/sha3-224, which preset the hash size.
+	 * They're only a shortcut, so the driver goes on without them
+	*/
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		ketchup_drvr_data.algorithm_devices[size] = device_create(
+			ketchup_drvr_data.driver_class,
+			NULL,
+			MKDEV(MAJOR(ketchup_drvr_data.device_number), MINOR(ketchup_drvr_data.device_number) + KC_MINOR_ALGORITHMS + size),
+			NULL,
+			"ketchup!%s", kc_soft_algorithms[size]
+		);
+		if (IS_ERR(ketchup_drvr_data.algorithm_devices[size])) {
+			kc_err("[ketchup_driver_init] could not create the %s node\n", kc_soft_algorithms[size]);
+			ketchup_drvr_data.algorithm_devices[size] = NULL;
+		}
+	}
+
 	// Initialize the character device
 	cdev_init(&ketchup_drvr_data.c_dev, &fops);
 
-	if (cdev_add(&ketchup_drvr_data.c_dev, ketchup_drvr_data.device_number, 1) == -1)
+	if (cdev_add(&ketchup_drvr_data.c_dev, ketchup_drvr_data.device_number, KC_MINORS) == -1)
 	{
         kc_err("[ketchup_driver_init] cdev initialization failed\n");
+		kc_destroy_algorithm_nodes();
+		device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number + 1);
 		device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number);
 		class_destroy(ketchup_drvr_data.driver_class);
-		unregister_chrdev_region(ketchup_drvr_data.device_number, 1);
+		unregister_chrdev_region(ketchup_drvr_data.device_number, KC_MINORS);
 		return -1;
 	}
 
-	// control, command, current_usage
+	// control, command, current_usage, binding_stats, wait_times, fair_share, uid_weights,
+	// fallback_threshold, fallback_stats
 	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_hash_size) < 0)
 	{
         kc_err("[ketchup_driver_init] control sysfs initialization failed\n");
@@ -872,9 +4433,95 @@ static int __init ketchup_driver_init(void)
         kc_err("[ketchup_driver_initb current_usage initialization failed\n");
 	}
 
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_binding_stats) < 0)
+	{
+        kc_err("[ketchup_driver_init] binding_stats initialization failed\n");
+	}
+
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_wait_times) < 0)
+	{
+        kc_err("[ketchup_driver_init] wait_times initialization failed\n");
+	}
+
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_fair_share) < 0)
+	{
+        kc_err("[ketchup_driver_init] fair_share initialization failed\n");
+	}
+
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_uid_weights) < 0)
+	{
+        kc_err("[ketchup_driver_init] uid_weights initialization failed\n");
+	}
+
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_threshold) < 0)
+	{
+        kc_err("[ketchup_driver_init] fallback_threshold initialization failed\n");
+	}
+
+	if (device_create_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_stats) < 0)
+	{
+        kc_err("[ketchup_driver_init] fallback_stats initialization failed\n");
+	}
+
 	// Initialize devices container
 	mutex_init(&ketchup_drvr_data.devices.array_write_lock);
-	sema_init(&ketchup_drvr_data.devices.dev_free_sema, 0);
+	xa_init(&ketchup_drvr_data.devices.registered_devices);
+	bitmap_zero(ketchup_drvr_data.devices.busy_map, MAX_DEVICES);
+	bitmap_zero(ketchup_drvr_data.devices.pinned_map, MAX_DEVICES);
+	spin_lock_init(&ketchup_drvr_data.devices.wait_lock);
+	for (int class = 0; class < KC_PRIO_CLASSES; class++) {
+		INIT_LIST_HEAD(&ketchup_drvr_data.devices.waiters[class]);
+	}
+	INIT_LIST_HEAD(&ketchup_drvr_data.devices.shares);
+	init_waitqueue_head(&ketchup_drvr_data.devices.dev_free_wait);
+	init_waitqueue_head(&ketchup_drvr_data.crypto_idle);
+
+	// Statistics for sizing the number of peripherals. Like with sysfs,
+	// the driver works fine without them, so errors are ignored
+	ketchup_drvr_data.stats_since = ktime_get_ns();
+	ketchup_drvr_data.debugfs_dir = debugfs_create_dir("ketchup", NULL);
+	debugfs_create_file("stats", 0444, ketchup_drvr_data.debugfs_dir, NULL, &kc_stats_fops);
+	debugfs_create_file_unsafe("reset", 0200, ketchup_drvr_data.debugfs_dir, NULL, &kc_stats_reset_fops);
+	debugfs_create_file("bench", 0600, ketchup_drvr_data.debugfs_dir, NULL, &kc_bench_fops);
+	debugfs_create_u32("bench_messages", 0600, ketchup_drvr_data.debugfs_dir, &kc_bench.messages);
+	debugfs_create_u32("bench_threads", 0600, ketchup_drvr_data.debugfs_dir, &kc_bench.threads);
+	debugfs_create_u32("bench_hash_size", 0600, ketchup_drvr_data.debugfs_dir, &kc_bench.hash_size);
+
+	// The software fallback is off until someone sets fallback_threshold,
+	// and can't be turned on if the kernel was built without SHA3
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		ketchup_drvr_data.soft_tfm[size] = crypto_alloc_shash(kc_soft_algorithms[size], 0, 0);
+		if (IS_ERR(ketchup_drvr_data.soft_tfm[size])) {
+			kc_info("[ketchup_driver_init] no %s for the software fallback\n", kc_soft_algorithms[size]);
+			ketchup_drvr_data.soft_tfm[size] = NULL;
+		}
+	}
+
+	// Ring workers spend most of their time polling the peripheral,
+	// so they shouldn't be tied to the CPU that rang the doorbell
+	ketchup_drvr_data.ring_wq = alloc_workqueue("ketchup_ring", WQ_UNBOUND, 0);
+	if (!ketchup_drvr_data.ring_wq) {
+		kc_err("[ketchup_driver_init] could not create the ring workqueue\n");
+		for (int size = HASH_512; size <= HASH_224; size++) {
+			crypto_free_shash(ketchup_drvr_data.soft_tfm[size]);
+		}
+		debugfs_remove_recursive(ketchup_drvr_data.debugfs_dir);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_hash_size);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_current_usage);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_binding_stats);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_wait_times);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fair_share);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_uid_weights);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_threshold);
+		device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_stats);
+		cdev_del(&ketchup_drvr_data.c_dev);
+		kc_destroy_algorithm_nodes();
+		device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number + 1);
+		device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number);
+		class_destroy(ketchup_drvr_data.driver_class);
+		unregister_chrdev_region(ketchup_drvr_data.device_number, KC_MINORS);
+		return -ENOMEM;
+	}
 
 
 	return platform_driver_register(&ketchup_driver_driver);
@@ -885,12 +4532,38 @@ static int __init ketchup_driver_init(void)
 */
 static void __exit ketchup_driver_exit(void)
 {
+	struct kc_uid_share *share, *next_share;
+
+	// Waits for a running benchmark, which uses the peripherals,
+	// after telling it to stop after the messages it's on
+	WRITE_ONCE(kc_bench.exiting, true);
+	debugfs_remove_recursive(ketchup_drvr_data.debugfs_dir);
+
+	// The core nodes go away with their peripherals, while the class is still there
+	platform_driver_unregister(&ketchup_driver_driver);
 	cdev_del(&ketchup_drvr_data.c_dev);
 	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_hash_size);
 	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_current_usage);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_binding_stats);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_wait_times);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fair_share);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_uid_weights);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_threshold);
+	device_remove_file(ketchup_drvr_data.registered_device, &dev_attr_fallback_stats);
+	kc_destroy_algorithm_nodes();
+	device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number + 1);
 	device_destroy(ketchup_drvr_data.driver_class, ketchup_drvr_data.device_number);
 	class_destroy(ketchup_drvr_data.driver_class);
-	platform_driver_unregister(&ketchup_driver_driver);
+	destroy_workqueue(ketchup_drvr_data.ring_wq);
+
+	list_for_each_entry_safe(share, next_share, &ketchup_drvr_data.devices.shares, node) {
+		list_del(&share->node);
+		kfree(share);
+	}
+
+	for (int size = HASH_512; size <= HASH_224; size++) {
+		crypto_free_shash(ketchup_drvr_data.soft_tfm[size]);
+	}
 
 	kc_info("[ketchup_driver_exit] Module unloaded\n");
 }
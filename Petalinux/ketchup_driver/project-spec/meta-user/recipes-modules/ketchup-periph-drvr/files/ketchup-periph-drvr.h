@@ -8,11 +8,64 @@
 */
 #define DRIVER_NAME "ketchup-driver"
 #define DEVICE_NAME "ketchup_driver"
+#define HANDLE_NAME "ketchup_handle"
 #define CLASS_NAME "keccak_accelerators"
 
+/**
+ * Minors of the character device: /dev/ketchup_driver, /dev/ketchup_handle,
+ * /dev/ketchup/sha3-512 to /dev/ketchup/sha3-224 in HashSize order, and
+ * then /dev/ketchup/coreN for every peripheral
+*/
+#define KC_MINOR_DRIVER     0
+#define KC_MINOR_HANDLE     1
+#define KC_MINOR_ALGORITHMS 2
+#define KC_MINOR_CORES      6
+
 // Enable this for debugging
 // #define KECCAK_DEBUG
 
+/**
+ * Nonce search registers, relative to the first of them (0x50)
+*/
+#define NONCE_REG_CONTROL     0x00
+#define NONCE_REG_ADDRESS     0x04
+#define NONCE_REG_DATA        0x08
+#define NONCE_REG_LENGTH      0x0C
+#define NONCE_REG_POSITION    0x10
+#define NONCE_REG_START       0x14
+#define NONCE_REG_LIMIT       0x18
+#define NONCE_REG_TARGET_HIGH 0x1C
+#define NONCE_REG_TARGET_LOW  0x20
+#define NONCE_REG_RESULT      0x24
+#define NONCE_REG_ATTEMPTS    0x28
+
+#define NONCE_CMD_START  (1 << 0)
+#define NONCE_CMD_ABORT  (1 << 1)
+
+#define NONCE_STATUS_BUSY      (1 << 0)
+#define NONCE_STATUS_FOUND     (1 << 1)
+#define NONCE_STATUS_EXHAUSTED (1 << 2)
+
+// The template memory of the peripheral holds 64 words,
+// and the length register is 8 bits wide
+#define NONCE_MAX_HEADER 255
+
+/**
+ * Limits of the submission ring set up with RW_PERIPH_RING_SETUP
+*/
+#define KC_RING_MAX_ENTRIES 4096
+#define KC_RING_MAX_ARENA   (16 * 1024 * 1024)
+
+/**
+ * mmap offset of the register page of the bound peripheral
+*/
+#define KC_MMAP_REGISTERS_OFFSET 0x10000000
+
+/**
+ * cmd_op of the io_uring commands
+*/
+#define KC_URING_CMD_HASH 1
+
 
 /******************* FUNCTIONS *******************/
 
@@ -24,27 +77,157 @@ static void __exit ketchup_driver_exit(void);
 static int ketchup_open(struct inode *, struct file *);
 static ssize_t ketchup_read(struct file *, char *, size_t, loff_t *);
 static ssize_t ketchup_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t ketchup_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t ketchup_splice_write(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
 static int ketchup_release(struct inode *, struct file *);
 static long ketchup_ioctl(struct file *, unsigned int, unsigned long);
+static int ketchup_mmap(struct file *, struct vm_area_struct *);
+static int ketchup_uring_cmd(struct io_uring_cmd *, unsigned int);
+static __poll_t ketchup_poll(struct file *, struct poll_table_struct *);
 
 // Platform device
 static int ketchup_driver_probe(struct platform_device *);
 static int ketchup_driver_remove(struct platform_device *);
 
+// Peripheral helpers
+struct ketchup_device;
+struct kc_nonce_search;
+struct kc_hash_file;
+static long peripheral_nonce_search(struct ketchup_device *, struct kc_nonce_search __user *);
+static long peripheral_hash_file(struct file *, struct kc_hash_file __user *);
+
+// Software fallback
+static int kc_session_prepare_message(struct file *, bool);
+
+// Submission ring
+struct kc_ring;
+struct kc_ring_setup;
+static long peripheral_ring_setup(struct file *, struct kc_ring_setup __user *);
+static long peripheral_ring_enter(struct file *, uint32_t __user *);
+static void kc_ring_destroy(struct kc_ring *);
+
 // sysfs
 static ssize_t current_usage_show(struct device *, struct device_attribute *, char *);
 static ssize_t hash_size_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t core_hash_size_show(struct device *, struct device_attribute *, char *);
+static ssize_t core_owner_show(struct device *, struct device_attribute *, char *);
+static ssize_t core_pinned_show(struct device *, struct device_attribute *, char *);
+static ssize_t core_stats_show(struct device *, struct device_attribute *, char *);
 
 
-typedef enum {
-    NOT_AVAILABLE,
-    AVAILABLE
-} Availability;
-
 typedef enum {
     HASH_512 = 0,
     HASH_384 = 1,
     HASH_256 = 2,
     HASH_224 = 3
 } HashSize;
+
+/**
+ * Priority classes of the processes waiting for a peripheral, set with the
+ * WR_PERIPH_PRIORITY ioctl. Waiters of a class are only served once there
+ * are none left in the classes before it, and in arrival order within it.
+ * KC_PRIO_AUTO picks the class from the nice value of the task: latency
+ * when it's negative, bulk when it's positive, normal otherwise.
+*/
+typedef enum {
+    KC_PRIO_LATENCY = 0,
+    KC_PRIO_NORMAL = 1,
+    KC_PRIO_BULK = 2,
+    KC_PRIO_CLASSES = 3,
+    KC_PRIO_AUTO = 0xFF
+} PriorityClass;
+
+/**
+ * Argument of the RW_PERIPH_NONCE_SEARCH ioctl. The last three
+ * fields are filled in by the driver.
+*/
+struct kc_nonce_search {
+    uint8_t  header[NONCE_MAX_HEADER + 1];
+    uint32_t header_length;
+    // In bytes, must be a multiple of 4
+    uint32_t nonce_offset;
+    // In bytes, from 1 to 4
+    uint32_t nonce_width;
+    uint32_t nonce_start;
+    // 0 means search until a nonce is found
+    uint32_t max_attempts;
+    uint32_t target_high;
+    uint32_t target_low;
+
+    uint32_t found;
+    uint32_t nonce;
+    uint32_t attempts;
+};
+/**
+ * Argument of the RW_PERIPH_HASH_FILE ioctl. The driver reads
+ * the file itself and sets hashed to how many bytes it absorbed.
+*/
+struct kc_hash_file {
+    int32_t  fd;
+    uint32_t reserved;
+    uint64_t offset;
+    // 0 means up to the end of the file
+    uint64_t length;
+
+    uint64_t hashed;
+};
+
+/**
+ * Argument of the RW_PERIPH_RING_SETUP ioctl. The caller picks the
+ * sizes, the driver fills in the layout of the region to mmap.
+*/
+struct kc_ring_setup {
+    // Must be a power of two
+    uint32_t entries;
+    uint32_t arena_size;
+
+    uint32_t sq_offset;
+    uint32_t cq_offset;
+    uint32_t arena_offset;
+    uint32_t mmap_size;
+};
+
+/**
+ * Start of the shared ring region. User space produces submissions
+ * at sq_tail and consumes completions at cq_head, the driver moves
+ * sq_head and cq_tail.
+*/
+struct kc_ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;
+    uint32_t arena_size;
+};
+
+struct kc_ring_sqe {
+    uint64_t user_data;
+    // Position of the message inside the arena
+    uint32_t offset;
+    uint32_t length;
+    // One of HashSize
+    uint32_t hash_size;
+    uint32_t reserved;
+};
+
+struct kc_ring_cqe {
+    uint64_t user_data;
+    // 0 or a negative error code
+    int32_t  result;
+    uint32_t digest_length;
+    uint8_t  digest[64];
+};
+
+/**
+ * Payload of the KC_URING_CMD_HASH io_uring command, which
+ * hashes length bytes at data and writes the digest at digest
+*/
+struct kc_uring_hash {
+    uint64_t data;
+    uint64_t digest;
+    uint32_t length;
+    // One of HashSize
+    uint32_t hash_size;
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,168 @@
+/**
+ * Tracepoints of the driver, under /sys/kernel/tracing/events/ketchup/.
+ * They're static keys, so they cost nothing until someone enables them
+ * with perf, bpftrace or the tracefs files.
+ *
+ * The pid is the one of the task doing the work: for the submission
+ * ring and io_uring commands that's the kernel worker, not the submitter.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ketchup
+
+#if !defined(_KETCHUP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KETCHUP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * Someone needs a peripheral. class is the priority class it would wait in.
+*/
+TRACE_EVENT(ketchup_acquire_start,
+	TP_PROTO(int blocking, int class),
+	TP_ARGS(blocking, class),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(int, blocking)
+		__field(int, class)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->blocking = blocking;
+		__entry->class = class;
+	),
+
+	TP_printk("pid=%d blocking=%d class=%d", __entry->pid, __entry->blocking, __entry->class)
+);
+
+/**
+ * The acquire is over: index is the peripheral it got, or a negative error.
+*/
+TRACE_EVENT(ketchup_acquire_finish,
+	TP_PROTO(int index, u64 waited_ns),
+	TP_ARGS(index, waited_ns),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(pid_t, pid)
+		__field(u64, waited_ns)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pid = current->pid;
+		__entry->waited_ns = waited_ns;
+	),
+
+	TP_printk("index=%d pid=%d waited_ns=%llu", __entry->index, __entry->pid, __entry->waited_ns)
+);
+
+DECLARE_EVENT_CLASS(ketchup_peripheral,
+	TP_PROTO(int index, u64 bytes, int hash_size),
+	TP_ARGS(index, bytes, hash_size),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(pid_t, pid)
+		__field(u64, bytes)
+		__field(int, hash_size)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pid = current->pid;
+		__entry->bytes = bytes;
+		__entry->hash_size = hash_size;
+	),
+
+	TP_printk(
+		"index=%d pid=%d bytes=%llu hash_size=%s", __entry->index, __entry->pid, __entry->bytes,
+		__print_symbolic(__entry->hash_size, { 0, "512" }, { 1, "384" }, { 2, "256" }, { 3, "224" })
+	)
+);
+
+/**
+ * A fd got a peripheral for its next message. bytes is always 0.
+*/
+DEFINE_EVENT(ketchup_peripheral, ketchup_bind,
+	TP_PROTO(int index, u64 bytes, int hash_size),
+	TP_ARGS(index, bytes, hash_size)
+);
+
+/**
+ * bytes of message data were sent to the peripheral, from a
+ * write, a splice, a file, a ring entry or an io_uring command.
+*/
+DEFINE_EVENT(ketchup_peripheral, ketchup_write_chunk,
+	TP_PROTO(int index, u64 bytes, int hash_size),
+	TP_ARGS(index, bytes, hash_size)
+);
+
+/**
+ * The last packet was sent and the final permutation started.
+ * bytes is the length of the last packet, from 0 to 3.
+*/
+DEFINE_EVENT(ketchup_peripheral, ketchup_finalize,
+	TP_PROTO(int index, u64 bytes, int hash_size),
+	TP_ARGS(index, bytes, hash_size)
+);
+
+/**
+ * Waiting for the digest is over, after reading the status register
+ * iterations times. ready is 0 if the peripheral never got there.
+*/
+TRACE_EVENT(ketchup_poll_done,
+	TP_PROTO(int index, int iterations, bool ready),
+	TP_ARGS(index, iterations, ready),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(pid_t, pid)
+		__field(int, iterations)
+		__field(bool, ready)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pid = current->pid;
+		__entry->iterations = iterations;
+		__entry->ready = ready;
+	),
+
+	TP_printk(
+		"index=%d pid=%d iterations=%d ready=%d",
+		__entry->index, __entry->pid, __entry->iterations, __entry->ready
+	)
+);
+
+/**
+ * The peripheral was given back after being held for held_ns.
+*/
+TRACE_EVENT(ketchup_release,
+	TP_PROTO(int index, u64 held_ns),
+	TP_ARGS(index, held_ns),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(pid_t, pid)
+		__field(u64, held_ns)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pid = current->pid;
+		__entry->held_ns = held_ns;
+	),
+
+	TP_printk("index=%d pid=%d held_ns=%llu", __entry->index, __entry->pid, __entry->held_ns)
+);
+
+#endif /* _KETCHUP_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ketchup_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+// Speed test of the SHA3 implementations of the kernel crypto API, through
+// AF_ALG. It runs the same tests as "modprobe tcrypt mode=..." and prints
+// the results the same way, but lets you pick the driver, so that the
+// peripherals (sha3-256-ketchup) and the software (sha3-256-generic)
+// can be compared on the same kernel.
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+#define MAX_BLOCK 8192
+
+// Same as generic_hash_speed_template in crypto/tcrypt.c
+static const struct {
+    size_t block;
+    size_t update;
+} tests[] = {
+    {16, 16},
+    {64, 16}, {64, 64},
+    {256, 16}, {256, 64}, {256, 256},
+    {1024, 16}, {1024, 256}, {1024, 1024},
+    {2048, 16}, {2048, 256}, {2048, 1024}, {2048, 2048},
+    {4096, 16}, {4096, 256}, {4096, 1024}, {4096, 4096},
+    {8192, 16}, {8192, 256}, {8192, 1024}, {8192, 4096}, {8192, 8192},
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [-a ALGORITHM] [-d DRIVER] [-s SECONDS]\n", name);
+    printf("  -a  algorithm, sha3-224/256/384/512 (default sha3-256)\n");
+    printf("  -d  driver implementing it, e.g. sha3-256-ketchup or sha3-256-generic\n");
+    printf("      (default: the one with the highest priority)\n");
+    printf("  -s  seconds per test (default 1)\n");
+}
+
+// Hashes one block in updates of the given size. Returns 0 or -1.
+static int hash_block(int op, const uint8_t *buffer, size_t block, size_t update, uint8_t *digest, size_t digest_length) {
+    for (size_t sent = 0; sent < block; sent += update) {
+        int more = sent + update < block ? MSG_MORE : 0;
+        if (send(op, buffer + sent, update, more) != (ssize_t)update) {
+            return -1;
+        }
+    }
+
+    return read(op, digest, digest_length) == (ssize_t)digest_length ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t buffer[MAX_BLOCK];
+    uint8_t digest[64];
+    const char *algorithm = "sha3-256", *driver = NULL;
+    unsigned seconds = 1;
+    size_t digest_length;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:d:s:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                algorithm = optarg;
+                break;
+            case 'd':
+                driver = optarg;
+                break;
+            case 's':
+                seconds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (seconds == 0 || sscanf(algorithm, "sha3-%zu", &digest_length) != 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    digest_length /= 8;
+
+    struct sockaddr_alg address = {
+        .salg_family = AF_ALG,
+        .salg_type = "hash",
+    };
+    // AF_ALG takes both algorithm names and driver names
+    strncpy((char *)address.salg_name, driver ? driver : algorithm, sizeof(address.salg_name) - 1);
+
+    int tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (tfm < 0) {
+        printf("Error: could not create the AF_ALG socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(tfm, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("Error: %s is not available: %s\n", address.salg_name, strerror(errno));
+        close(tfm);
+        return -1;
+    }
+    int op = accept(tfm, NULL, 0);
+    if (op < 0) {
+        printf("Error: accept failed: %s\n", strerror(errno));
+        close(tfm);
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_BLOCK; i++) {
+        buffer[i] = i;
+    }
+
+    printf("testing speed of %s (%s)\n", algorithm, driver ? driver : "highest priority");
+    for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        uint64_t start, end, operations = 0;
+
+        start = now_ns();
+        end = start + seconds * 1000000000ull;
+        do {
+            if (hash_block(op, buffer, tests[i].block, tests[i].update, digest, digest_length) < 0) {
+                printf("Error: hashing failed: %s\n", strerror(errno));
+                close(op);
+                close(tfm);
+                return -1;
+            }
+            operations++;
+        } while (now_ns() < end);
+
+        double elapsed = (now_ns() - start) / 1e9;
+        printf(
+            "test %2zu (%5zu byte blocks,%5zu bytes per update,%4zu updates): %8.0f opers/sec, %10.0f bytes/sec\n",
+            i, tests[i].block, tests[i].update, tests[i].block / tests[i].update,
+            operations / elapsed, operations * tests[i].block / elapsed
+        );
+    }
+
+    close(op);
+    close(tfm);
+    return 0;
+}
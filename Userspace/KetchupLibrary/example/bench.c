@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/ketchup_lib.h"
+
+// This compares the throughput of the backends, for messages of several sizes.
+// It has to be built in the dynamic mode, and takes the names of the backends
+// to compare (software and openssl by default). Then it hashes batches of
+// messages through a ring of the default backend (KETCHUP_BACKEND), which the
+// software backend spreads over the SIMD lanes of its multi-buffer Keccak.
+
+// Bytes hashed in a run, so that every measurement takes about as long
+#define BYTES_PER_RUN (16 * 1024 * 1024)
+// Runs of each size and backend, the fastest one counts
+#define RUNS 5
+// Messages submitted to the ring at once
+#define RING_ENTRIES 256
+
+static const uint32_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536, 1024 * 1024};
+
+static double now(void) {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    static char const *default_backends[] = {"software", "openssl"};
+    char const **backends = default_backends;
+    int backend_count = 2;
+    uint8_t digest[KC_MAX_MD_SIZE];
+    uint32_t digest_length;
+    kc_sha3_context context;
+    uint8_t *message;
+
+    if (argc > 1) {
+        backends = (char const **)argv + 1;
+        backend_count = argc - 1;
+    }
+
+    message = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    if (message == NULL) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; i++) {
+        message[i] = i * 131;
+    }
+
+    printf("SHA3-256, MB/s\n%10s", "size");
+    for (int b = 0; b < backend_count; b++) {
+        printf("%12s", backends[b]);
+    }
+    printf("\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t messages = BYTES_PER_RUN / sizes[s];
+
+        printf("%10u", sizes[s]);
+        for (int b = 0; b < backend_count; b++) {
+            if (kc_sha3_init(&context, backends[b], 256) != KC_ERR_NONE) {
+                printf("%12s", "-");
+                continue;
+            }
+
+            double best = 0;
+            for (int run = 0; run < RUNS; run++) {
+                double start = now();
+                for (uint32_t m = 0; m < messages; m++) {
+                    kc_sha3_update(&context, message, sizes[s]);
+                    kc_sha3_final(&context, digest, &digest_length);
+                }
+                double elapsed = now() - start;
+
+                if (best == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+
+            printf("%12.1f", (double)messages * sizes[s] / best / 1e6);
+            kc_sha3_close(&context);
+        }
+        printf("\n");
+    }
+
+    kc_ring ring;
+    kc_ring_completion completions[RING_ENTRIES];
+
+    printf("\nRing of %u messages, SHA3-256, MB/s\n%10s%12s\n", RING_ENTRIES, "size", "ring");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t batches = BYTES_PER_RUN / sizes[s] / RING_ENTRIES;
+
+        // The whole batch has to fit in the arena
+        if (batches == 0 || kc_ring_init(&ring, RING_ENTRIES, RING_ENTRIES * sizes[s]) != KC_ERR_NONE) {
+            continue;
+        }
+        for (uint32_t m = 0; m < RING_ENTRIES; m++) {
+            memcpy(kc_ring_arena(&ring) + m * sizes[s], message, sizes[s]);
+        }
+
+        double best = 0;
+        for (int run = 0; run < RUNS; run++) {
+            double start = now();
+            for (uint32_t batch = 0; batch < batches; batch++) {
+                uint32_t reaped = 0;
+
+                for (uint32_t m = 0; m < RING_ENTRIES; m++) {
+                    kc_ring_submit(&ring, m * sizes[s], sizes[s], 256, m);
+                }
+                while (reaped < RING_ENTRIES) {
+                    kc_ring_wait(&ring, RING_ENTRIES - reaped);
+                    reaped += kc_ring_reap(&ring, completions, RING_ENTRIES);
+                }
+            }
+            double elapsed = now() - start;
+
+            if (best == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%10u%12.1f\n", sizes[s], (double)batches * RING_ENTRIES * sizes[s] / best / 1e6);
+        kc_ring_close(&ring);
+    }
+
+    free(message);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/ketchup_lib.h"
+
+// This is an example of hashing many small messages through the ring
+
+#define MESSAGES 64
+
+int main() {
+    kc_ring ring;
+    kc_ring_completion completions[MESSAGES];
+    uint32_t arena_used = 0, completed = 0, reaped;
+    kc_error error;
+
+    // The ring can hold up to 64 submissions, and the messages are in a 64 KB arena
+    error = kc_ring_init(&ring, 64, 64 * 1024);
+    if (error != KC_ERR_NONE) {
+        printf("Couldn't set up the ring (error %d)\n", error);
+        return 1;
+    }
+
+    // Write the messages in the arena, and submit one hash for each of them
+    uint8_t *arena = kc_ring_arena(&ring);
+    for (int i = 0; i < MESSAGES; i++) {
+        int length = sprintf((char *)arena + arena_used, "Message number %d", i);
+
+        kc_ring_submit(&ring, arena_used, length, 256, i);
+        arena_used += length;
+    }
+
+    // A single system call hashes all of them
+    kc_ring_wait(&ring, MESSAGES);
+
+    while (completed < MESSAGES) {
+        reaped = kc_ring_reap(&ring, completions, MESSAGES);
+        if (reaped == 0) {
+            kc_ring_wait(&ring, 1);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < reaped; i++) {
+            // user_data tells which submission this is the result of
+            uint64_t message = completions[i].user_data;
+
+            printf("Sha3-256(\"Message number %lu\") = ", (unsigned long)message);
+            for (uint32_t j = 0; j < completions[i].digest_length; j++) {
+                printf("%02x", completions[i].digest[j]);
+            }
+            printf("\n");
+        }
+        completed += reaped;
+    }
+
+    // Always remember to clean up!
+    kc_ring_close(&ring);
+
+    return 0;
+}
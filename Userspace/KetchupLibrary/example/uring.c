@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/ketchup_uring.h"
+
+// This is an example of hashing with io_uring. Every message is a separate
+// command, and all of them are in flight at the same time.
+
+#define MESSAGES 32
+
+int main() {
+    struct io_uring ring;
+    struct io_uring_params params = {0};
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    char messages[MESSAGES][32];
+    uint8_t digests[MESSAGES][KC_MAX_MD_SIZE];
+    int fd;
+
+    // The commands need 128 bytes SQEs
+    params.flags = IORING_SETUP_SQE128;
+    if (io_uring_queue_init_params(MESSAGES, &ring, &params) < 0) {
+        printf("Couldn't create the io_uring instance\n");
+        return 1;
+    }
+
+    if (kc_uring_open(&fd) != KC_ERR_NONE) {
+        printf("Couldn't open the device\n");
+        io_uring_queue_exit(&ring);
+        return 1;
+    }
+
+    // Queue all the hashes, using the index of the message as user data
+    for (int i = 0; i < MESSAGES; i++) {
+        snprintf(messages[i], sizeof(messages[i]), "Message number %d", i);
+
+        sqe = io_uring_get_sqe(&ring);
+        kc_uring_prep_hash(sqe, fd, messages[i], strlen(messages[i]), 256, digests[i]);
+        io_uring_sqe_set_data64(sqe, i);
+    }
+
+    // One system call submits all of them. In an event loop you would
+    // just submit them along with everything else.
+    io_uring_submit(&ring);
+
+    for (int completed = 0; completed < MESSAGES; completed++) {
+        io_uring_wait_cqe(&ring, &cqe);
+
+        int i = io_uring_cqe_get_data64(cqe);
+        kc_error error = kc_uring_result(cqe);
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (error != KC_ERR_NONE) {
+            printf("Hashing \"%s\" failed (error %d)\n", messages[i], error);
+            continue;
+        }
+
+        printf("Sha3-256(\"%s\") = ", messages[i]);
+        for (int j = 0; j < 256/8; j++) {
+            printf("%02x", digests[i][j]);
+        }
+        printf("\n");
+    }
+
+    // Always remember to clean up!
+    kc_uring_close(fd);
+    io_uring_queue_exit(&ring);
+
+    return 0;
+}
@@ -2,18 +2,117 @@
 #define _KETCHTUP_LIB_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #define KETCHUP_LIB_MODE_HARDWARE 0
 #define KETCHUP_LIB_MODE_OPENSSL  1
+#define KETCHUP_LIB_MODE_MMIO     2
+#define KETCHUP_LIB_MODE_HYBRID   3
+#define KETCHUP_LIB_MODE_DYNAMIC  4
+#define KETCHUP_LIB_MODE_SOFTWARE 5
 
 #ifndef KETCHUP_LIB_MODE
 #define KETCHUP_LIB_MODE KETCHUP_LIB_MODE_OPENSSL
 #endif
 
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HARDWARE || KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HYBRID
+// Short updates are gathered here and written to the device together. Multiple of
+// the rate of SHA3-224, a context uses the biggest multiple of its own rate that fits.
+#define KC_STAGING_SIZE (30 * 144)
+#endif
+
 #if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HARDWARE
 struct kc_sha3_context_s {
     int fd;
     uint32_t digest_length;
+
+    uint8_t staging[KC_STAGING_SIZE];
+    uint32_t staged_length;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_MMIO
+// The registers of the peripheral are mapped in the process, which
+// drives it directly. They're mapped on the first update.
+struct kc_sha3_context_s {
+    int fd;
+    volatile uint32_t *registers;
+    uint32_t digest_length;
+    uint32_t hash_size;
+
+    // Unaligned tail of the data, sent with the next word or as the last packet
+    uint8_t pending[4];
+    uint32_t pending_length;
+    // Why the current message can't be hashed, reported by kc_sha3_final
+    int error;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HYBRID
+#include <openssl/evp.h>
+// Short messages are hashed with OpenSSL, the others by the device. The
+// message is kept in buffer until it gets longer than threshold, and then
+// goes to the device, which is opened the first time it's needed.
+struct kc_sha3_context_s {
+    // Same as in the hardware backend, fd is -1 until the device is opened
+    int fd;
+    uint32_t digest_length;
+
+    EVP_MD const *algorithm;
+    // Only used if the device can't be opened
+    EVP_MD_CTX *openssl_context;
+    // Set with kc_sha3_set_priority before the device was opened
+    int32_t priority;
+
+    // Where the current message is going, one of kc_route
+    int route;
+    uint8_t *buffer;
+    uint32_t buffer_length;
+    uint32_t threshold;
+
+    // Same as in the hardware backend
+    uint8_t staging[KC_STAGING_SIZE];
+    uint32_t staged_length;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HARDWARE || KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_MMIO
+// Points inside the region shared with the driver
+struct kc_ring_s {
+    int fd;
+    void *region;
+    uint32_t region_size;
+
+    void *header;
+    void *sqes;
+    void *cqes;
+    uint8_t *arena;
+    uint32_t entries;
+    uint32_t arena_size;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HYBRID
+// The ring of the driver, or if the device can't be opened, one that
+// hashes with OpenSSL in kc_ring_wait, like the OpenSSL backend's
+struct kc_ring_s {
+    // Same as in the hardware backend, fd is -1 for the OpenSSL ring
+    int fd;
+    void *region;
+    uint32_t region_size;
+
+    void *header;
+    void *sqes;
+    void *cqes;
+    uint8_t *arena;
+    uint32_t entries;
+    uint32_t arena_size;
+
+    // Only used by the OpenSSL ring
+    struct kc_ring_request_s *requests;
+    struct kc_ring_completion_s *completions;
+    uint32_t sq_head, sq_tail;
+    uint32_t cq_head, cq_tail;
 };
 #endif
 
@@ -26,12 +125,64 @@ struct kc_sha3_context_s {
 };
 #endif
 
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_SOFTWARE
+// Hashed by the library itself, without OpenSSL
+struct kc_sha3_context_s {
+    // Keccak-f[1600] state, in the layout of the permutation in use
+    uint64_t state[25];
+    uint32_t digest_length;
+    uint32_t rate;
+
+    // Start of the next block, absorbed once it's full
+    uint8_t block[144];
+    uint32_t block_length;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_OPENSSL || KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_SOFTWARE
+// Same interface as the driver's ring, but everything
+// is hashed in kc_ring_wait by the calling thread
+struct kc_ring_s {
+    uint8_t *arena;
+    uint32_t entries;
+    uint32_t arena_size;
+
+    struct kc_ring_request_s *requests;
+    struct kc_ring_completion_s *completions;
+    uint32_t sq_head, sq_tail;
+    uint32_t cq_head, cq_tail;
+};
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_DYNAMIC
+// The backend is picked at run time, and its state is opaque,
+// so one program can use any of them (see kc_sha3_init)
+struct kc_sha3_context_s {
+    struct kc_backend_s const *backend;
+    void *state;
+};
+
+struct kc_ring_s {
+    struct kc_backend_s const *backend;
+    void *state;
+};
+#endif
+
 #define KC_MAX_MD_SIZE 64
 
+// Longest header accepted by kc_sha3_nonce_search
+#define KC_NONCE_MAX_HEADER_SIZE 255
+
+// Limits of kc_ring_init
+#define KC_RING_MAX_ENTRIES 4096
+#define KC_RING_MAX_ARENA   (16 * 1024 * 1024)
+
 typedef enum kc_sha3_error_e {
     KC_ERR_NONE,
     KC_ERR_BUSY,
     KC_ERR_UNSUPPORTED_SIZE,
+    KC_ERR_INVALID_ARGUMENT,
+    KC_ERR_NOT_FOUND,
     // NOTE: This is not ideal, remove this after
     //       the driver is fully defined and 
     //       all possible errors have been enumerated
@@ -46,16 +197,107 @@ kc_error kc_sha3_256_init(kc_sha3_context *context);
 kc_error kc_sha3_224_init(kc_sha3_context *context);
 
 void kc_sha3_update(kc_sha3_context *context, void const *new_data, uint32_t new_data_length);
+// Same as calling kc_sha3_update on every buffer in order
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt);
+// Hashes length bytes of fd starting from offset, or everything up to the end
+// of the file if length is 0. The file position of fd is left untouched.
+// fd can also be a pipe, in which case offset must be 0 and the data is consumed.
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length);
 void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length);
 
 kc_error kc_sha3_close(kc_sha3_context *context);
 
+// When all the peripherals are busy, contexts wait for one by priority class:
+// a class is only served when no context of the classes before it is waiting,
+// and in arrival order within it. KC_PRIORITY_AUTO, the default, picks the
+// class from the nice value of the process: latency if it's negative, bulk if
+// it's positive. Only the hardware backend has anything to wait for.
+typedef enum kc_priority_e {
+    KC_PRIORITY_LATENCY = 0,
+    KC_PRIORITY_NORMAL = 1,
+    KC_PRIORITY_BULK = 2,
+    KC_PRIORITY_AUTO = 0xFF
+} kc_priority;
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority);
+
+// Proof-of-work style search: hashes header with an incrementing nonce written
+// big endian at nonce_offset (a multiple of 4, nonce_width bytes from 1 to 4),
+// until the first 8 bytes of the digest, read as a big endian number, are less
+// than target. A max_attempts of 0 means searching until a nonce is found.
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+);
+
+// Ring interface, to hash many independent messages with almost no system calls.
+// The messages are written in the arena of the ring (kc_ring_arena), and each
+// submission says where one is and which hash it wants. kc_ring_wait rings the
+// doorbell and optionally waits for completions, which are then read with kc_ring_reap.
+// entries must be a power of two, and is the most submissions that can be pending.
+typedef struct kc_ring_s kc_ring;
+
+typedef struct kc_ring_completion_s {
+    uint64_t user_data;
+    kc_error error;
+    uint32_t digest_length;
+    uint8_t digest[KC_MAX_MD_SIZE];
+} kc_ring_completion;
+
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size);
+uint8_t *kc_ring_arena(kc_ring *ring);
+// hash_size is in bits. Returns KC_ERR_BUSY if the ring is full.
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data);
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete);
+// Returns how many completions were written in completions
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions);
+kc_error kc_ring_close(kc_ring *ring);
+
 // Utilities for quickly hashing inputs
 kc_error kc_sha3_512(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length);
 kc_error kc_sha3_384(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length);
 kc_error kc_sha3_256(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length);
 kc_error kc_sha3_224(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length);
 
+// The utilities above borrow their contexts from a pool shared by the whole
+// process, so that a message doesn't cost opening and configuring a context.
+// At most max_contexts of them are open at once, over all hash sizes, and a
+// thread finding them all in use waits for one. 0 turns the pool off. Without
+// kc_pool_init, the pool keeps up to 4. It returns KC_ERR_BUSY if the pool is
+// already set up: call kc_pool_shutdown first, which closes the idle contexts,
+// and the busy ones as they come back. After a shutdown the pool stays off
+// until the next kc_pool_init. MMIO contexts are closed after every message,
+// since an idle one would keep its peripheral. The utilities return an error,
+// and close the context, if the message couldn't be hashed.
+kc_error kc_pool_init(uint32_t max_contexts);
+kc_error kc_pool_shutdown(void);
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_DYNAMIC
+// Opens a context on the backend called name ("hardware", "mmio", "software", "openssl"
+// or "mock"), for a hash of hash_size bits. With a NULL name it's the default backend: the
+// one named by the KETCHUP_BACKEND environment variable, or else the first one of hardware
+// and software that works on this machine. The kc_sha3_*_init functions and the rings
+// use the default backend. Returns KC_ERR_INVALID_ARGUMENT for an unknown backend.
+kc_error kc_sha3_init(kc_sha3_context *context, char const *backend, uint32_t hash_size);
+// Name of the backend of an open context
+char const *kc_sha3_backend(kc_sha3_context const *context);
+// Same as kc_ring_init, on the backend called name, or the default one if it's NULL.
+// A named backend without rings ("mock") is an invalid argument, while a default
+// one without them leaves the ring to the software backend.
+kc_error kc_ring_init_backend(kc_ring *ring, char const *backend, uint32_t entries, uint32_t arena_size);
+// Name of the backend of an open ring
+char const *kc_ring_backend(kc_ring const *ring);
+#endif
+
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_HYBRID
+// Messages of up to this many bytes are hashed in software. It's measured
+// the first time a context is created, and cached, see the README.
+uint32_t kc_hybrid_threshold(void);
+#endif
+
 
 
 #endif // _KETCHTUP_LIB_H
@@ -0,0 +1,29 @@
+#ifndef _KETCHUP_URING_H
+#define _KETCHUP_URING_H
+
+// io_uring interface to the peripherals, on top of liburing.
+// It's only available with the hardware backend, and the io_uring
+// instance has to be created with IORING_SETUP_SQE128.
+
+#include <liburing.h>
+
+#include "ketchup_lib.h"
+
+// Opens a handle to send hash commands to. It takes a peripheral like a context does,
+// but it's only used for commands, together with any other peripheral that happens to be free.
+kc_error kc_uring_open(int *fd);
+kc_error kc_uring_close(int fd);
+
+// Prepares sqe to hash length bytes of data (hash_size is in bits) and write the digest
+// in digest. Both buffers have to stay valid until the completion arrives. Like with
+// the io_uring_prep_* functions, you can set the user data of sqe afterwards.
+kc_error kc_uring_prep_hash(
+    struct io_uring_sqe *sqe, int fd,
+    void const *data, uint32_t length,
+    uint32_t hash_size, uint8_t *digest
+);
+
+// Outcome of a hash command, from its completion
+kc_error kc_uring_result(struct io_uring_cqe const *cqe);
+
+#endif // _KETCHUP_URING_H
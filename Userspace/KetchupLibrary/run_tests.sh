@@ -18,7 +18,8 @@ test_file() {
 
 mkdir -p $OUTFILES_DIR
 
-./nist_tests.out $INFILES_DIR $OUTFILES_DIR
+# "./run_tests.sh ring" hashes the messages of each file together, through a ring
+./nist_tests.out $INFILES_DIR $OUTFILES_DIR "$@"
 
 
 for file in $(ls $OUTFILES_DIR) ; do
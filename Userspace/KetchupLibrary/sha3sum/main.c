@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "../include/ketchup_lib.h"
 
@@ -12,6 +14,8 @@ int main(int argc, char *argv[]) {
     uint8_t buffer[BUFFER_SIZE];
     uint32_t digest_length;
     size_t bytes_read;
+    struct stat input_stat;
+    kc_error error;
 
 
     if (argc < 2) {
@@ -20,20 +24,35 @@ int main(int argc, char *argv[]) {
     }
 
     if (strcmp(argv[1], "224") == 0) {
-        kc_sha3_224_init(&context);
+        error = kc_sha3_224_init(&context);
     } else if (strcmp(argv[1], "256") == 0) {
-        kc_sha3_256_init(&context);
+        error = kc_sha3_256_init(&context);
     } else if (strcmp(argv[1], "384") == 0) {
-        kc_sha3_384_init(&context);
+        error = kc_sha3_384_init(&context);
     } else if (strcmp(argv[1], "512") == 0) {
-        kc_sha3_512_init(&context);
+        error = kc_sha3_512_init(&context);
     } else {
         printf("Invalid hash size.\n");
         return -EINVAL;
     }
 
+    if (error != KC_ERR_NONE) {
+        printf("Couldn't open a context.\n");
+        return -EIO;
+    }
+
     if (argc >= 3) {
         kc_sha3_update(&context, argv[2], strlen(argv[2]));
+    } else if (fstat(STDIN_FILENO, &input_stat) == 0
+               && (S_ISREG(input_stat.st_mode) || S_ISFIFO(input_stat.st_mode))) {
+        // Redirected from a file or a pipe, let the library move the data
+        // straight into the device (with splice for pipes)
+        off_t start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (kc_sha3_file(&context, STDIN_FILENO, start < 0 ? 0 : start, 0) != KC_ERR_NONE) {
+            printf("Couldn't read the input file.\n");
+            kc_sha3_close(&context);
+            return -EIO;
+        }
     } else {
         bytes_read = 0;
     
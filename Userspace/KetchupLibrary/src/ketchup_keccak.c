@@ -0,0 +1,421 @@
+#include "ketchup_keccak.h"
+
+#include <string.h>
+
+// Lanes are named after their plane (b, g, k, m, s for y = 0 to 4) and their
+// column (a, e, i, o, u for x = 0 to 4), as in the reference code of the Keccak
+// team. The rounds go from the A lanes to the E lanes and back, two at a time.
+
+const uint64_t kc_keccak_round_constants[24] = {
+    0x0000000000000001, 0x0000000000008082, 0x800000000000808A, 0x8000000080008000,
+    0x000000000000808B, 0x0000000080000001, 0x8000000080008081, 0x8000000000008009,
+    0x000000000000008A, 0x0000000000000088, 0x0000000080008009, 0x000000008000000A,
+    0x000000008000808B, 0x800000000000008B, 0x8000000000008089, 0x8000000000008003,
+    0x8000000000008002, 0x8000000000000080, 0x000000000000800A, 0x800000008000000A,
+    0x8000000080008081, 0x8000000000008080, 0x0000000080000001, 0x8000000080008008,
+};
+
+#define KC_LANES(X) \
+    X##ba, X##be, X##bi, X##bo, X##bu, \
+    X##ga, X##ge, X##gi, X##go, X##gu, \
+    X##ka, X##ke, X##ki, X##ko, X##ku, \
+    X##ma, X##me, X##mi, X##mo, X##mu, \
+    X##sa, X##se, X##si, X##so, X##su
+
+#if !KC_KECCAK_INTERLEAVED
+
+// be, bi, go, ki, mi and sa are kept complemented, by lane index x + 5y
+#define KC_COMPLEMENTED(lane) ((0x00121106 >> (lane)) & 1)
+
+#define KC_ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define KC_LOAD(X, state) \
+    X##ba = state[ 0]; X##be = state[ 1]; X##bi = state[ 2]; X##bo = state[ 3]; X##bu = state[ 4]; \
+    X##ga = state[ 5]; X##ge = state[ 6]; X##gi = state[ 7]; X##go = state[ 8]; X##gu = state[ 9]; \
+    X##ka = state[10]; X##ke = state[11]; X##ki = state[12]; X##ko = state[13]; X##ku = state[14]; \
+    X##ma = state[15]; X##me = state[16]; X##mi = state[17]; X##mo = state[18]; X##mu = state[19]; \
+    X##sa = state[20]; X##se = state[21]; X##si = state[22]; X##so = state[23]; X##su = state[24];
+
+#define KC_STORE(X, state) \
+    state[ 0] = X##ba; state[ 1] = X##be; state[ 2] = X##bi; state[ 3] = X##bo; state[ 4] = X##bu; \
+    state[ 5] = X##ga; state[ 6] = X##ge; state[ 7] = X##gi; state[ 8] = X##go; state[ 9] = X##gu; \
+    state[10] = X##ka; state[11] = X##ke; state[12] = X##ki; state[13] = X##ko; state[14] = X##ku; \
+    state[15] = X##ma; state[16] = X##me; state[17] = X##mi; state[18] = X##mo; state[19] = X##mu; \
+    state[20] = X##sa; state[21] = X##se; state[22] = X##si; state[23] = X##so; state[24] = X##su;
+
+// One round from the X lanes to the Y lanes. chi is Y = B0 ^ (~B1 & B2), but
+// with some lanes complemented it becomes an AND or an OR of lanes that are
+// already complemented, and only one NOT is left per plane. The column
+// parities of theta (C) are summed up as the Y lanes come out of chi.
+#define KC_ROUND(X, Y, round) \
+    Da = Cu ^ KC_ROL64(Ce, 1); \
+    De = Ca ^ KC_ROL64(Ci, 1); \
+    Di = Ce ^ KC_ROL64(Co, 1); \
+    Do = Ci ^ KC_ROL64(Cu, 1); \
+    Du = Co ^ KC_ROL64(Ca, 1); \
+    \
+    Ba = X##ba ^ Da; \
+    Be = KC_ROL64(X##ge ^ De, 44); \
+    Bi = KC_ROL64(X##ki ^ Di, 43); \
+    Bo = KC_ROL64(X##mo ^ Do, 21); \
+    Bu = KC_ROL64(X##su ^ Du, 14); \
+    Y##ba = Ba ^ (Be | Bi) ^ kc_keccak_round_constants[round]; \
+    Ca = Y##ba; \
+    Y##be = Be ^ (~Bi | Bo); \
+    Ce = Y##be; \
+    Y##bi = Bi ^ (Bo & Bu); \
+    Ci = Y##bi; \
+    Y##bo = Bo ^ (Bu | Ba); \
+    Co = Y##bo; \
+    Y##bu = Bu ^ (Ba & Be); \
+    Cu = Y##bu; \
+    \
+    Ba = KC_ROL64(X##bo ^ Do, 28); \
+    Be = KC_ROL64(X##gu ^ Du, 20); \
+    Bi = KC_ROL64(X##ka ^ Da, 3); \
+    Bo = KC_ROL64(X##me ^ De, 45); \
+    Bu = KC_ROL64(X##si ^ Di, 61); \
+    Y##ga = Ba ^ (Be | Bi); \
+    Ca ^= Y##ga; \
+    Y##ge = Be ^ (Bi & Bo); \
+    Ce ^= Y##ge; \
+    Y##gi = Bi ^ (Bo | ~Bu); \
+    Ci ^= Y##gi; \
+    Y##go = Bo ^ (Bu | Ba); \
+    Co ^= Y##go; \
+    Y##gu = Bu ^ (Ba & Be); \
+    Cu ^= Y##gu; \
+    \
+    Ba = KC_ROL64(X##be ^ De, 1); \
+    Be = KC_ROL64(X##gi ^ Di, 6); \
+    Bi = KC_ROL64(X##ko ^ Do, 25); \
+    Bo = KC_ROL64(X##mu ^ Du, 8); \
+    Bu = KC_ROL64(X##sa ^ Da, 18); \
+    Y##ka = Ba ^ (Be | Bi); \
+    Ca ^= Y##ka; \
+    Y##ke = Be ^ (Bi & Bo); \
+    Ce ^= Y##ke; \
+    Y##ki = Bi ^ (~Bo & Bu); \
+    Ci ^= Y##ki; \
+    Y##ko = ~Bo ^ (Bu | Ba); \
+    Co ^= Y##ko; \
+    Y##ku = Bu ^ (Ba & Be); \
+    Cu ^= Y##ku; \
+    \
+    Ba = KC_ROL64(X##bu ^ Du, 27); \
+    Be = KC_ROL64(X##ga ^ Da, 36); \
+    Bi = KC_ROL64(X##ke ^ De, 10); \
+    Bo = KC_ROL64(X##mi ^ Di, 15); \
+    Bu = KC_ROL64(X##so ^ Do, 56); \
+    Y##ma = Ba ^ (Be & Bi); \
+    Ca ^= Y##ma; \
+    Y##me = Be ^ (Bi | Bo); \
+    Ce ^= Y##me; \
+    Y##mi = Bi ^ (~Bo | Bu); \
+    Ci ^= Y##mi; \
+    Y##mo = ~Bo ^ (Bu & Ba); \
+    Co ^= Y##mo; \
+    Y##mu = Bu ^ (Ba | Be); \
+    Cu ^= Y##mu; \
+    \
+    Ba = KC_ROL64(X##bi ^ Di, 62); \
+    Be = KC_ROL64(X##go ^ Do, 55); \
+    Bi = KC_ROL64(X##ku ^ Du, 39); \
+    Bo = KC_ROL64(X##ma ^ Da, 41); \
+    Bu = KC_ROL64(X##se ^ De, 2); \
+    Y##sa = Ba ^ (~Be & Bi); \
+    Ca ^= Y##sa; \
+    Y##se = ~Be ^ (Bi | Bo); \
+    Ce ^= Y##se; \
+    Y##si = Bi ^ (Bo & Bu); \
+    Ci ^= Y##si; \
+    Y##so = Bo ^ (Bu | Ba); \
+    Co ^= Y##so; \
+    Y##su = Bu ^ (Ba & Be); \
+    Cu ^= Y##su;
+
+#define KC_DECLARE_STATE \
+    uint64_t KC_LANES(A), KC_LANES(E); \
+    uint64_t Ca, Ce, Ci, Co, Cu; \
+    uint64_t Da, De, Di, Do, Du; \
+    uint64_t Ba, Be, Bi, Bo, Bu;
+
+// Unrolled by two, so the lanes never have to be copied back
+#define KC_ROUNDS \
+    Ca = Aba ^ Aga ^ Aka ^ Ama ^ Asa; \
+    Ce = Abe ^ Age ^ Ake ^ Ame ^ Ase; \
+    Ci = Abi ^ Agi ^ Aki ^ Ami ^ Asi; \
+    Co = Abo ^ Ago ^ Ako ^ Amo ^ Aso; \
+    Cu = Abu ^ Agu ^ Aku ^ Amu ^ Asu; \
+    for (int round = 0; round < 24; round += 2) { \
+        KC_ROUND(A, E, round) \
+        KC_ROUND(E, A, round + 1) \
+    }
+
+void kc_keccak_init(uint64_t state[25]) {
+    for (int lane = 0; lane < 25; lane++) {
+        state[lane] = KC_COMPLEMENTED(lane) ? ~(uint64_t)0 : 0;
+    }
+}
+
+void kc_keccak_permute(uint64_t state[25]) {
+    KC_DECLARE_STATE
+
+    KC_LOAD(A, state)
+    KC_ROUNDS
+    KC_STORE(A, state)
+}
+
+void kc_keccak_absorb(uint64_t state[25], uint8_t const *data, size_t blocks, uint32_t rate) {
+    KC_DECLARE_STATE
+
+    KC_LOAD(A, state)
+
+    for (; blocks > 0; blocks--, data += rate) {
+        // Every rate is at least 9 lanes, then 13, 17 or 18
+        Aba ^= kc_load64(data +   0); Abe ^= kc_load64(data +   8); Abi ^= kc_load64(data +  16);
+        Abo ^= kc_load64(data +  24); Abu ^= kc_load64(data +  32); Aga ^= kc_load64(data +  40);
+        Age ^= kc_load64(data +  48); Agi ^= kc_load64(data +  56); Ago ^= kc_load64(data +  64);
+        if (rate > 72) {
+            Agu ^= kc_load64(data +  72); Aka ^= kc_load64(data +  80);
+            Ake ^= kc_load64(data +  88); Aki ^= kc_load64(data +  96);
+        }
+        if (rate > 104) {
+            Ako ^= kc_load64(data + 104); Aku ^= kc_load64(data + 112);
+            Ama ^= kc_load64(data + 120); Ame ^= kc_load64(data + 128);
+        }
+        if (rate > 136) {
+            Ami ^= kc_load64(data + 136);
+        }
+
+        KC_ROUNDS
+    }
+
+    KC_STORE(A, state)
+}
+
+void kc_keccak_extract(uint64_t const state[25], uint8_t *out, uint32_t length) {
+    uint8_t bytes[8];
+    uint64_t lane;
+
+    for (uint32_t i = 0; i < (length + 7) / 8; i++) {
+        lane = KC_COMPLEMENTED(i) ? ~state[i] : state[i];
+        for (int j = 0; j < 8; j++) {
+            bytes[j] = lane >> (8 * j);
+        }
+        memcpy(out + 8 * i, bytes, length - 8 * i < 8 ? length - 8 * i : 8);
+    }
+}
+
+#else
+
+// Even and odd halves of the round constants
+static const uint32_t kc_round_constants[24][2] = {
+    {0x00000001, 0x00000000}, {0x00000000, 0x00000089}, {0x00000000, 0x8000008B}, {0x00000000, 0x80008080},
+    {0x00000001, 0x0000008B}, {0x00000001, 0x00008000}, {0x00000001, 0x80008088}, {0x00000001, 0x80000082},
+    {0x00000000, 0x0000000B}, {0x00000000, 0x0000000A}, {0x00000001, 0x00008082}, {0x00000000, 0x00008003},
+    {0x00000001, 0x0000808B}, {0x00000001, 0x8000000B}, {0x00000001, 0x8000008A}, {0x00000001, 0x80000081},
+    {0x00000000, 0x80000081}, {0x00000000, 0x80000008}, {0x00000000, 0x00000083}, {0x00000000, 0x80008003},
+    {0x00000001, 0x80008088}, {0x00000000, 0x80000088}, {0x00000001, 0x00008000}, {0x00000000, 0x80008082},
+};
+
+// n is a constant, and n == 0 gives x | x
+#define KC_ROL32(x, n) (((x) << (n)) | ((x) >> ((32 - (n)) & 31)))
+
+// Bits 0, 2, ..., 30 of x, packed in the low half
+static inline uint32_t kc_unzip32(uint32_t x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+}
+
+// The low half of x, spread over the even bits
+static inline uint32_t kc_zip32(uint32_t x) {
+    x &= 0x0000FFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// A lane of state holds the even bits in its low half, and the odd bits in its high one
+#define KC_LOAD_LANE(X, lane, state, i) \
+    X##lane##0 = (uint32_t)state[i]; \
+    X##lane##1 = (uint32_t)(state[i] >> 32);
+
+#define KC_STORE_LANE(X, lane, state, i) \
+    state[i] = ((uint64_t)X##lane##1 << 32) | X##lane##0;
+
+#define KC_FOR_LANES(MACRO, X, state) \
+    MACRO(X, ba, state,  0) MACRO(X, be, state,  1) MACRO(X, bi, state,  2) MACRO(X, bo, state,  3) MACRO(X, bu, state,  4) \
+    MACRO(X, ga, state,  5) MACRO(X, ge, state,  6) MACRO(X, gi, state,  7) MACRO(X, go, state,  8) MACRO(X, gu, state,  9) \
+    MACRO(X, ka, state, 10) MACRO(X, ke, state, 11) MACRO(X, ki, state, 12) MACRO(X, ko, state, 13) MACRO(X, ku, state, 14) \
+    MACRO(X, ma, state, 15) MACRO(X, me, state, 16) MACRO(X, mi, state, 17) MACRO(X, mo, state, 18) MACRO(X, mu, state, 19) \
+    MACRO(X, sa, state, 20) MACRO(X, se, state, 21) MACRO(X, si, state, 22) MACRO(X, so, state, 23) MACRO(X, su, state, 24)
+
+// Little endian bytes of a lane, interleaved and XORed into it
+#define KC_XOR_LANE(X, lane, data, i) \
+    T0 = kc_load32((data) + 8 * (i)); \
+    T1 = kc_load32((data) + 8 * (i) + 4); \
+    X##lane##0 ^= kc_unzip32(T0) | (kc_unzip32(T1) << 16); \
+    X##lane##1 ^= kc_unzip32(T0 >> 1) | (kc_unzip32(T1 >> 1) << 16);
+
+// A 64-bit rotation by an odd amount moves the even bits to the odd ones and back
+#define KC_RHO(B, X, lane, D, r) \
+    T0 = X##lane##0 ^ D##0; \
+    T1 = X##lane##1 ^ D##1; \
+    B##0 = ((r) & 1) ? KC_ROL32(T1, ((r) + 1) / 2) : KC_ROL32(T0, (r) / 2); \
+    B##1 = ((r) & 1) ? KC_ROL32(T0, (r) / 2) : KC_ROL32(T1, (r) / 2);
+
+// ARM has an AND-NOT instruction, so there's nothing to gain from complementing lanes
+#define KC_CHI(Y, p, half) \
+    Y##p##a##half = B##a##half ^ (~B##e##half & B##i##half); \
+    Y##p##e##half = B##e##half ^ (~B##i##half & B##o##half); \
+    Y##p##i##half = B##i##half ^ (~B##o##half & B##u##half); \
+    Y##p##o##half = B##o##half ^ (~B##u##half & B##a##half); \
+    Y##p##u##half = B##u##half ^ (~B##a##half & B##e##half);
+
+#define KC_THETA_COLUMN(X, c, half) \
+    C##c##half = X##b##c##half ^ X##g##c##half ^ X##k##c##half ^ X##m##c##half ^ X##s##c##half;
+
+// ROL64(C, 1) is ROL32(odd, 1) for the even bits, and the even bits for the odd ones
+#define KC_THETA_D(d, left, right) \
+    D##d##0 = C##left##0 ^ KC_ROL32(C##right##1, 1); \
+    D##d##1 = C##left##1 ^ C##right##0;
+
+#define KC_ROUND(X, Y, round) \
+    KC_THETA_COLUMN(X, a, 0) KC_THETA_COLUMN(X, a, 1) \
+    KC_THETA_COLUMN(X, e, 0) KC_THETA_COLUMN(X, e, 1) \
+    KC_THETA_COLUMN(X, i, 0) KC_THETA_COLUMN(X, i, 1) \
+    KC_THETA_COLUMN(X, o, 0) KC_THETA_COLUMN(X, o, 1) \
+    KC_THETA_COLUMN(X, u, 0) KC_THETA_COLUMN(X, u, 1) \
+    KC_THETA_D(a, u, e) \
+    KC_THETA_D(e, a, i) \
+    KC_THETA_D(i, e, o) \
+    KC_THETA_D(o, i, u) \
+    KC_THETA_D(u, o, a) \
+    \
+    KC_RHO(Ba, X, ba, Da, 0) \
+    KC_RHO(Be, X, ge, De, 44) \
+    KC_RHO(Bi, X, ki, Di, 43) \
+    KC_RHO(Bo, X, mo, Do, 21) \
+    KC_RHO(Bu, X, su, Du, 14) \
+    KC_CHI(Y, b, 0) KC_CHI(Y, b, 1) \
+    Y##ba0 ^= kc_round_constants[round][0]; \
+    Y##ba1 ^= kc_round_constants[round][1]; \
+    \
+    KC_RHO(Ba, X, bo, Do, 28) \
+    KC_RHO(Be, X, gu, Du, 20) \
+    KC_RHO(Bi, X, ka, Da, 3) \
+    KC_RHO(Bo, X, me, De, 45) \
+    KC_RHO(Bu, X, si, Di, 61) \
+    KC_CHI(Y, g, 0) KC_CHI(Y, g, 1) \
+    \
+    KC_RHO(Ba, X, be, De, 1) \
+    KC_RHO(Be, X, gi, Di, 6) \
+    KC_RHO(Bi, X, ko, Do, 25) \
+    KC_RHO(Bo, X, mu, Du, 8) \
+    KC_RHO(Bu, X, sa, Da, 18) \
+    KC_CHI(Y, k, 0) KC_CHI(Y, k, 1) \
+    \
+    KC_RHO(Ba, X, bu, Du, 27) \
+    KC_RHO(Be, X, ga, Da, 36) \
+    KC_RHO(Bi, X, ke, De, 10) \
+    KC_RHO(Bo, X, mi, Di, 15) \
+    KC_RHO(Bu, X, so, Do, 56) \
+    KC_CHI(Y, m, 0) KC_CHI(Y, m, 1) \
+    \
+    KC_RHO(Ba, X, bi, Di, 62) \
+    KC_RHO(Be, X, go, Do, 55) \
+    KC_RHO(Bi, X, ku, Du, 39) \
+    KC_RHO(Bo, X, ma, Da, 41) \
+    KC_RHO(Bu, X, se, De, 2) \
+    KC_CHI(Y, s, 0) KC_CHI(Y, s, 1)
+
+#define KC_LANES32(X) \
+    X##ba0, X##ba1, X##be0, X##be1, X##bi0, X##bi1, X##bo0, X##bo1, X##bu0, X##bu1, \
+    X##ga0, X##ga1, X##ge0, X##ge1, X##gi0, X##gi1, X##go0, X##go1, X##gu0, X##gu1, \
+    X##ka0, X##ka1, X##ke0, X##ke1, X##ki0, X##ki1, X##ko0, X##ko1, X##ku0, X##ku1, \
+    X##ma0, X##ma1, X##me0, X##me1, X##mi0, X##mi1, X##mo0, X##mo1, X##mu0, X##mu1, \
+    X##sa0, X##sa1, X##se0, X##se1, X##si0, X##si1, X##so0, X##so1, X##su0, X##su1
+
+#define KC_DECLARE_STATE \
+    uint32_t KC_LANES32(A); \
+    uint32_t KC_LANES32(E); \
+    uint32_t Ca0, Ca1, Ce0, Ce1, Ci0, Ci1, Co0, Co1, Cu0, Cu1; \
+    uint32_t Da0, Da1, De0, De1, Di0, Di1, Do0, Do1, Du0, Du1; \
+    uint32_t Ba0, Ba1, Be0, Be1, Bi0, Bi1, Bo0, Bo1, Bu0, Bu1; \
+    uint32_t T0, T1;
+
+#define KC_ROUNDS \
+    for (int round = 0; round < 24; round += 2) { \
+        KC_ROUND(A, E, round) \
+        KC_ROUND(E, A, round + 1) \
+    }
+
+void kc_keccak_init(uint64_t state[25]) {
+    memset(state, 0, 25 * sizeof(uint64_t));
+}
+
+void kc_keccak_permute(uint64_t state[25]) {
+    KC_DECLARE_STATE
+
+    KC_FOR_LANES(KC_LOAD_LANE, A, state)
+    KC_ROUNDS
+    KC_FOR_LANES(KC_STORE_LANE, A, state)
+
+    (void)T0;
+    (void)T1;
+}
+
+void kc_keccak_absorb(uint64_t state[25], uint8_t const *data, size_t blocks, uint32_t rate) {
+    KC_DECLARE_STATE
+
+    KC_FOR_LANES(KC_LOAD_LANE, A, state)
+
+    for (; blocks > 0; blocks--, data += rate) {
+        // Every rate is at least 9 lanes, then 13, 17 or 18
+        KC_XOR_LANE(A, ba, data,  0) KC_XOR_LANE(A, be, data,  1) KC_XOR_LANE(A, bi, data,  2)
+        KC_XOR_LANE(A, bo, data,  3) KC_XOR_LANE(A, bu, data,  4) KC_XOR_LANE(A, ga, data,  5)
+        KC_XOR_LANE(A, ge, data,  6) KC_XOR_LANE(A, gi, data,  7) KC_XOR_LANE(A, go, data,  8)
+        if (rate > 72) {
+            KC_XOR_LANE(A, gu, data,  9) KC_XOR_LANE(A, ka, data, 10)
+            KC_XOR_LANE(A, ke, data, 11) KC_XOR_LANE(A, ki, data, 12)
+        }
+        if (rate > 104) {
+            KC_XOR_LANE(A, ko, data, 13) KC_XOR_LANE(A, ku, data, 14)
+            KC_XOR_LANE(A, ma, data, 15) KC_XOR_LANE(A, me, data, 16)
+        }
+        if (rate > 136) {
+            KC_XOR_LANE(A, mi, data, 17)
+        }
+
+        KC_ROUNDS
+    }
+
+    KC_FOR_LANES(KC_STORE_LANE, A, state)
+}
+
+void kc_keccak_extract(uint64_t const state[25], uint8_t *out, uint32_t length) {
+    uint8_t bytes[8];
+    uint32_t even, odd, low, high;
+
+    for (uint32_t i = 0; i < (length + 7) / 8; i++) {
+        even = (uint32_t)state[i];
+        odd = (uint32_t)(state[i] >> 32);
+        low = kc_zip32(even) | (kc_zip32(odd) << 1);
+        high = kc_zip32(even >> 16) | (kc_zip32(odd >> 16) << 1);
+
+        for (int j = 0; j < 4; j++) {
+            bytes[j] = low >> (8 * j);
+            bytes[j + 4] = high >> (8 * j);
+        }
+        memcpy(out + 8 * i, bytes, length - 8 * i < 8 ? length - 8 * i : 8);
+    }
+}
+
+#endif
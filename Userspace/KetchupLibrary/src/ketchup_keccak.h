@@ -0,0 +1,77 @@
+#ifndef _KETCHUP_KECCAK_H
+#define _KETCHUP_KECCAK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Keccak-f[1600], for the software backend. On 64-bit machines the lanes are
+// uint64_t, and some of them are kept complemented, which saves the NOT of
+// most chi steps. 32-bit machines (or KC_KECCAK_INTERLEAVED=1) keep each lane
+// as two uint32_t, its even and its odd bits, so that a 64-bit rotation is
+// two 32-bit ones. Either way the state is only meant for these functions.
+#ifndef KC_KECCAK_INTERLEAVED
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define KC_KECCAK_INTERLEAVED 0
+#else
+#define KC_KECCAK_INTERLEAVED 1
+#endif
+#endif
+
+// Rate of SHA3-224, the biggest of the four
+#define KC_KECCAK_MAX_RATE 144
+
+// Rate of the SHA3 hash with a digest of digest_length bytes
+#define KC_KECCAK_RATE(digest_length) (200 - 2 * (digest_length))
+
+// Round constants of iota, as 64-bit lanes
+extern const uint64_t kc_keccak_round_constants[24];
+
+// Little endian loads, data needn't be aligned
+static inline uint32_t kc_load32(uint8_t const *data) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+#else
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+#endif
+}
+
+static inline uint64_t kc_load64(uint8_t const *data) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+#else
+    return (uint64_t)kc_load32(data) | ((uint64_t)kc_load32(data + 4) << 32);
+#endif
+}
+
+void kc_keccak_init(uint64_t state[25]);
+void kc_keccak_permute(uint64_t state[25]);
+// XORs blocks of rate bytes of data into the state, permuting after each. data
+// needn't be aligned. The state stays in registers from one block to the next.
+void kc_keccak_absorb(uint64_t state[25], uint8_t const *data, size_t blocks, uint32_t rate);
+// Copies the first length bytes of the state, at most the rate, into out
+void kc_keccak_extract(uint64_t const state[25], uint8_t *out, uint32_t length);
+
+// A message for kc_keccak_hash_many, hashed with SHA3 into digest
+struct kc_keccak_job {
+    uint8_t const *data;
+    size_t length;
+    // In bytes, 28, 32, 48 or 64
+    uint32_t digest_length;
+    uint8_t *digest;
+};
+
+// Hashes independent messages several at a time, one per lane of the SIMD
+// registers: 8 with AVX-512, 4 with AVX2 and 2 with NEON (if built with
+// KC_KECCAK_NEON, see ketchup_keccak_multi.c). A lane takes the next
+// job as soon as its message is done, so the messages needn't have the same
+// length, nor the same hash. Without SIMD they are hashed one after the other.
+void kc_keccak_hash_many(struct kc_keccak_job *jobs, size_t count);
+// How many messages kc_keccak_hash_many hashes at once on this machine
+uint32_t kc_keccak_lanes(void);
+
+#endif // _KETCHUP_KECCAK_H
@@ -0,0 +1,269 @@
+#include "ketchup_keccak.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Multi-buffer engine of kc_keccak_hash_many. The permutations of each
+// instruction set come from ketchup_keccak_multi_rounds.h, and the one to use
+// is picked at run time, so the same build runs on any x86-64.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KC_MULTI_X86 1
+#elif defined(__ARM_NEON) && defined(KC_KECCAK_NEON)
+// Opt-in until the NEON engine has been checked against the NIST vectors on
+// ARM: without KC_KECCAK_NEON the messages are hashed one after the other
+#include <arm_neon.h>
+#define KC_MULTI_NEON 1
+#endif
+
+// Most states permuted at once, with AVX-512
+#define KC_MULTI_MAX_LANES 8
+
+// Caps the lanes in use, mostly to test the narrower engines on a wider machine
+#define KC_MULTI_LANES_ENV "KETCHUP_KECCAK_LANES"
+
+typedef void kc_permute_many_function(uint64_t *states);
+
+#if KC_MULTI_X86
+
+#define KC_V __m512i
+#define KC_WIDTH 8
+#define KC_V_LOAD(p) _mm512_load_si512((void const *)(p))
+#define KC_V_STORE(p, v) _mm512_store_si512((void *)(p), v)
+#define KC_V_SET1(x) _mm512_set1_epi64(x)
+#define KC_V_XOR(a, b) _mm512_xor_si512(a, b)
+#define KC_V_XOR3(a, b, c) _mm512_ternarylogic_epi64(a, b, c, 0x96)
+#define KC_V_ROL(v, n) _mm512_rol_epi64(v, n)
+#define KC_V_CHI(a, b, c) _mm512_ternarylogic_epi64(a, b, c, 0xD2)
+#define KC_PERMUTE_MANY kc_permute_avx512
+#define KC_TARGET __attribute__((target("avx512f")))
+#include "ketchup_keccak_multi_rounds.h"
+#undef KC_V
+#undef KC_WIDTH
+#undef KC_V_LOAD
+#undef KC_V_STORE
+#undef KC_V_SET1
+#undef KC_V_XOR
+#undef KC_V_XOR3
+#undef KC_V_ROL
+#undef KC_V_CHI
+#undef KC_PERMUTE_MANY
+#undef KC_TARGET
+
+#define KC_V __m256i
+#define KC_WIDTH 4
+#define KC_V_LOAD(p) _mm256_load_si256((__m256i const *)(p))
+#define KC_V_STORE(p, v) _mm256_store_si256((__m256i *)(p), v)
+#define KC_V_SET1(x) _mm256_set1_epi64x(x)
+#define KC_V_XOR(a, b) _mm256_xor_si256(a, b)
+#define KC_V_XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+#define KC_V_ROL(v, n) _mm256_or_si256(_mm256_slli_epi64(v, n), _mm256_srli_epi64(v, 64 - (n)))
+#define KC_V_CHI(a, b, c) _mm256_xor_si256(a, _mm256_andnot_si256(b, c))
+#define KC_PERMUTE_MANY kc_permute_avx2
+#define KC_TARGET __attribute__((target("avx2")))
+#include "ketchup_keccak_multi_rounds.h"
+#undef KC_V
+#undef KC_WIDTH
+#undef KC_V_LOAD
+#undef KC_V_STORE
+#undef KC_V_SET1
+#undef KC_V_XOR
+#undef KC_V_XOR3
+#undef KC_V_ROL
+#undef KC_V_CHI
+#undef KC_PERMUTE_MANY
+#undef KC_TARGET
+
+#elif KC_MULTI_NEON
+
+// A shift left and a shift right and insert make a rotation. The 32-bit ARM
+// of the board has NEON as long as it's built with -mfpu=neon.
+#define KC_V uint64x2_t
+#define KC_WIDTH 2
+#define KC_V_LOAD(p) vld1q_u64(p)
+#define KC_V_STORE(p, v) vst1q_u64(p, v)
+#define KC_V_SET1(x) vdupq_n_u64(x)
+#define KC_V_XOR(a, b) veorq_u64(a, b)
+#define KC_V_XOR3(a, b, c) veorq_u64(veorq_u64(a, b), c)
+#define KC_V_ROL(v, n) vsriq_n_u64(vshlq_n_u64(v, n), v, 64 - (n))
+#define KC_V_CHI(a, b, c) veorq_u64(a, vbicq_u64(c, b))
+#define KC_PERMUTE_MANY kc_permute_neon
+#define KC_TARGET
+#include "ketchup_keccak_multi_rounds.h"
+#undef KC_V
+#undef KC_WIDTH
+#undef KC_V_LOAD
+#undef KC_V_STORE
+#undef KC_V_SET1
+#undef KC_V_XOR
+#undef KC_V_XOR3
+#undef KC_V_ROL
+#undef KC_V_CHI
+#undef KC_PERMUTE_MANY
+#undef KC_TARGET
+
+#endif
+
+static pthread_once_t kc_multi_once = PTHREAD_ONCE_INIT;
+static uint32_t kc_multi_lanes = 1;
+// NULL when the messages are hashed one after the other
+static kc_permute_many_function *kc_multi_permute;
+
+static void kc_pick_multi(void) {
+    char const *cap = getenv(KC_MULTI_LANES_ENV);
+    unsigned long max_lanes = KC_MULTI_MAX_LANES;
+
+    if (cap != NULL && cap[0] != '\0') {
+        max_lanes = strtoul(cap, NULL, 10);
+    }
+
+#if KC_MULTI_X86
+    __builtin_cpu_init();
+    if (max_lanes >= 8 && __builtin_cpu_supports("avx512f")) {
+        kc_multi_lanes = 8;
+        kc_multi_permute = kc_permute_avx512;
+    } else if (max_lanes >= 4 && __builtin_cpu_supports("avx2")) {
+        kc_multi_lanes = 4;
+        kc_multi_permute = kc_permute_avx2;
+    }
+#elif KC_MULTI_NEON
+    if (max_lanes >= 2) {
+        kc_multi_lanes = 2;
+        kc_multi_permute = kc_permute_neon;
+    }
+#endif
+}
+
+uint32_t kc_keccak_lanes(void) {
+    pthread_once(&kc_multi_once, kc_pick_multi);
+    return kc_multi_lanes;
+}
+
+// SHA3 padding of the last length bytes of a message, shorter than the rate:
+// the 01 domain bits, then 10*1 up to the end of the block
+static void kc_pad_block(uint8_t *block, uint8_t const *data, size_t length, uint32_t rate) {
+    memcpy(block, data, length);
+    memset(block + length, 0, rate - length);
+    block[length] ^= 0x06;
+    block[rate - 1] ^= 0x80;
+}
+
+static void kc_hash_one(struct kc_keccak_job *job) {
+    uint64_t state[25];
+    uint8_t block[KC_KECCAK_MAX_RATE];
+    uint32_t rate = KC_KECCAK_RATE(job->digest_length);
+    size_t blocks = job->length / rate;
+
+    kc_keccak_init(state);
+    kc_keccak_absorb(state, job->data, blocks, rate);
+    kc_pad_block(block, job->data + blocks * rate, job->length - blocks * rate, rate);
+    kc_keccak_absorb(state, block, 1, rate);
+    kc_keccak_extract(state, job->digest, job->digest_length);
+}
+
+struct kc_multi_lane_s {
+    // NULL once the lane has nothing left to do
+    struct kc_keccak_job *job;
+    // What's left of the message
+    uint8_t const *next;
+    size_t remaining;
+    uint32_t rate;
+    // Whether the padded block went in with this permutation
+    int last;
+};
+
+static void kc_start_lane(uint64_t *states, uint32_t width, uint32_t index,
+                          struct kc_multi_lane_s *lane, struct kc_keccak_job *job) {
+    lane->job = job;
+    lane->next = job->data;
+    lane->remaining = job->length;
+    lane->rate = KC_KECCAK_RATE(job->digest_length);
+    lane->last = 0;
+
+    for (int i = 0; i < 25; i++) {
+        states[i * width + index] = 0;
+    }
+}
+
+static void kc_extract_lane(uint64_t const *states, uint32_t width, uint32_t index, struct kc_keccak_job *job) {
+    uint8_t bytes[8];
+
+    for (uint32_t i = 0; i < (job->digest_length + 7) / 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            bytes[j] = states[i * width + index] >> (8 * j);
+        }
+        memcpy(job->digest + 8 * i, bytes, job->digest_length - 8 * i < 8 ? job->digest_length - 8 * i : 8);
+    }
+}
+
+void kc_keccak_hash_many(struct kc_keccak_job *jobs, size_t count) {
+    uint64_t states[25 * KC_MULTI_MAX_LANES] __attribute__((aligned(64)));
+    struct kc_multi_lane_s lanes[KC_MULTI_MAX_LANES];
+    uint8_t block[KC_KECCAK_MAX_RATE];
+    uint8_t const *data;
+    uint32_t width = kc_keccak_lanes();
+    uint32_t active = 0;
+    size_t queued = 0;
+
+    // A lone message would only waste the other lanes
+    if (kc_multi_permute == NULL || count < 2) {
+        for (size_t i = 0; i < count; i++) {
+            kc_hash_one(&jobs[i]);
+        }
+        return;
+    }
+
+    for (uint32_t l = 0; l < width; l++) {
+        lanes[l].job = NULL;
+        if (queued < count) {
+            kc_start_lane(states, width, l, &lanes[l], &jobs[queued++]);
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        // One block into every busy lane, the padded one at the end of a message
+        for (uint32_t l = 0; l < width; l++) {
+            struct kc_multi_lane_s *lane = &lanes[l];
+
+            if (lane->job == NULL) {
+                continue;
+            }
+
+            if (lane->remaining >= lane->rate) {
+                data = lane->next;
+                lane->next += lane->rate;
+                lane->remaining -= lane->rate;
+            } else {
+                kc_pad_block(block, lane->next, lane->remaining, lane->rate);
+                data = block;
+                lane->last = 1;
+            }
+
+            for (uint32_t i = 0; i < lane->rate / 8; i++) {
+                states[i * width + l] ^= kc_load64(data + 8 * i);
+            }
+        }
+
+        kc_multi_permute(states);
+
+        // Finished lanes take the next message in the queue
+        for (uint32_t l = 0; l < width; l++) {
+            struct kc_multi_lane_s *lane = &lanes[l];
+
+            if (lane->job == NULL || !lane->last) {
+                continue;
+            }
+
+            kc_extract_lane(states, width, l, lane->job);
+            if (queued < count) {
+                kc_start_lane(states, width, l, lane, &jobs[queued++]);
+            } else {
+                lane->job = NULL;
+                active--;
+            }
+        }
+    }
+}
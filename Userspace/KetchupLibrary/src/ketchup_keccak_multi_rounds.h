@@ -0,0 +1,99 @@
+// Keccak-f[1600] on KC_WIDTH states at once, one per lane of a vector. This is
+// included by ketchup_keccak_multi.c once per instruction set, after defining:
+//   KC_V                  the vector type, KC_WIDTH lanes of 64 bits
+//   KC_V_LOAD(p)          loads KC_WIDTH lanes from p, aligned on a vector
+//   KC_V_STORE(p, v)      stores them back
+//   KC_V_SET1(x)          x in every lane
+//   KC_V_XOR(a, b)        a ^ b
+//   KC_V_XOR3(a, b, c)    a ^ b ^ c
+//   KC_V_ROL(v, n)        rotates every lane left by n, a constant from 1 to 63
+//   KC_V_CHI(a, b, c)     a ^ (~b & c)
+//   KC_PERMUTE_MANY       the name of the function
+//   KC_TARGET             its attributes, for the instruction set
+// Lane i of state j is at states[i * KC_WIDTH + j], so that one load gets the
+// same lane of every state. The lanes aren't complemented, unlike the ones of
+// ketchup_keccak.c: the vector instructions have an AND-NOT, or a ternary logic.
+
+KC_TARGET static void KC_PERMUTE_MANY(uint64_t *states) {
+    KC_V A[25], B[25], C[5], D[5];
+
+    // Unrolled so that A can live in registers
+#pragma GCC unroll 25
+    for (int i = 0; i < 25; i++) {
+        A[i] = KC_V_LOAD(states + i * KC_WIDTH);
+    }
+
+    for (int round = 0; round < 24; round++) {
+        // theta, its D goes in with rho and pi
+        C[0] = KC_V_XOR3(KC_V_XOR3(A[0], A[5], A[10]), A[15], A[20]);
+        C[1] = KC_V_XOR3(KC_V_XOR3(A[1], A[6], A[11]), A[16], A[21]);
+        C[2] = KC_V_XOR3(KC_V_XOR3(A[2], A[7], A[12]), A[17], A[22]);
+        C[3] = KC_V_XOR3(KC_V_XOR3(A[3], A[8], A[13]), A[18], A[23]);
+        C[4] = KC_V_XOR3(KC_V_XOR3(A[4], A[9], A[14]), A[19], A[24]);
+        D[0] = KC_V_XOR(C[4], KC_V_ROL(C[1], 1));
+        D[1] = KC_V_XOR(C[0], KC_V_ROL(C[2], 1));
+        D[2] = KC_V_XOR(C[1], KC_V_ROL(C[3], 1));
+        D[3] = KC_V_XOR(C[2], KC_V_ROL(C[4], 1));
+        D[4] = KC_V_XOR(C[3], KC_V_ROL(C[0], 1));
+
+        // rho and pi, the rotations have to be constants
+        B[ 0] = KC_V_XOR(A[ 0], D[0]);
+        B[ 1] = KC_V_ROL(KC_V_XOR(A[ 6], D[1]), 44);
+        B[ 2] = KC_V_ROL(KC_V_XOR(A[12], D[2]), 43);
+        B[ 3] = KC_V_ROL(KC_V_XOR(A[18], D[3]), 21);
+        B[ 4] = KC_V_ROL(KC_V_XOR(A[24], D[4]), 14);
+        B[ 5] = KC_V_ROL(KC_V_XOR(A[ 3], D[3]), 28);
+        B[ 6] = KC_V_ROL(KC_V_XOR(A[ 9], D[4]), 20);
+        B[ 7] = KC_V_ROL(KC_V_XOR(A[10], D[0]),  3);
+        B[ 8] = KC_V_ROL(KC_V_XOR(A[16], D[1]), 45);
+        B[ 9] = KC_V_ROL(KC_V_XOR(A[22], D[2]), 61);
+        B[10] = KC_V_ROL(KC_V_XOR(A[ 1], D[1]),  1);
+        B[11] = KC_V_ROL(KC_V_XOR(A[ 7], D[2]),  6);
+        B[12] = KC_V_ROL(KC_V_XOR(A[13], D[3]), 25);
+        B[13] = KC_V_ROL(KC_V_XOR(A[19], D[4]),  8);
+        B[14] = KC_V_ROL(KC_V_XOR(A[20], D[0]), 18);
+        B[15] = KC_V_ROL(KC_V_XOR(A[ 4], D[4]), 27);
+        B[16] = KC_V_ROL(KC_V_XOR(A[ 5], D[0]), 36);
+        B[17] = KC_V_ROL(KC_V_XOR(A[11], D[1]), 10);
+        B[18] = KC_V_ROL(KC_V_XOR(A[17], D[2]), 15);
+        B[19] = KC_V_ROL(KC_V_XOR(A[23], D[3]), 56);
+        B[20] = KC_V_ROL(KC_V_XOR(A[ 2], D[2]), 62);
+        B[21] = KC_V_ROL(KC_V_XOR(A[ 8], D[3]), 55);
+        B[22] = KC_V_ROL(KC_V_XOR(A[14], D[4]), 39);
+        B[23] = KC_V_ROL(KC_V_XOR(A[15], D[0]), 41);
+        B[24] = KC_V_ROL(KC_V_XOR(A[21], D[1]),  2);
+
+        // chi, then iota
+        A[ 0] = KC_V_CHI(B[ 0], B[ 1], B[ 2]);
+        A[ 1] = KC_V_CHI(B[ 1], B[ 2], B[ 3]);
+        A[ 2] = KC_V_CHI(B[ 2], B[ 3], B[ 4]);
+        A[ 3] = KC_V_CHI(B[ 3], B[ 4], B[ 0]);
+        A[ 4] = KC_V_CHI(B[ 4], B[ 0], B[ 1]);
+        A[ 5] = KC_V_CHI(B[ 5], B[ 6], B[ 7]);
+        A[ 6] = KC_V_CHI(B[ 6], B[ 7], B[ 8]);
+        A[ 7] = KC_V_CHI(B[ 7], B[ 8], B[ 9]);
+        A[ 8] = KC_V_CHI(B[ 8], B[ 9], B[ 5]);
+        A[ 9] = KC_V_CHI(B[ 9], B[ 5], B[ 6]);
+        A[10] = KC_V_CHI(B[10], B[11], B[12]);
+        A[11] = KC_V_CHI(B[11], B[12], B[13]);
+        A[12] = KC_V_CHI(B[12], B[13], B[14]);
+        A[13] = KC_V_CHI(B[13], B[14], B[10]);
+        A[14] = KC_V_CHI(B[14], B[10], B[11]);
+        A[15] = KC_V_CHI(B[15], B[16], B[17]);
+        A[16] = KC_V_CHI(B[16], B[17], B[18]);
+        A[17] = KC_V_CHI(B[17], B[18], B[19]);
+        A[18] = KC_V_CHI(B[18], B[19], B[15]);
+        A[19] = KC_V_CHI(B[19], B[15], B[16]);
+        A[20] = KC_V_CHI(B[20], B[21], B[22]);
+        A[21] = KC_V_CHI(B[21], B[22], B[23]);
+        A[22] = KC_V_CHI(B[22], B[23], B[24]);
+        A[23] = KC_V_CHI(B[23], B[24], B[20]);
+        A[24] = KC_V_CHI(B[24], B[20], B[21]);
+        A[0] = KC_V_XOR(A[0], KC_V_SET1(kc_keccak_round_constants[round]));
+    }
+
+#pragma GCC unroll 25
+    for (int i = 0; i < 25; i++) {
+        KC_V_STORE(states + i * KC_WIDTH, A[i]);
+    }
+}
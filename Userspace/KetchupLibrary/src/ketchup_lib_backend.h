@@ -0,0 +1,76 @@
+#ifndef _KETCHUP_LIB_BACKEND_H
+#define _KETCHUP_LIB_BACKEND_H
+
+// Backends of KETCHUP_LIB_MODE_DYNAMIC. Each one is built in a translation unit of
+// its own, which sets KETCHUP_LIB_MODE and KC_BACKEND_PREFIX, includes this header and
+// then the sources of the backend: their public functions get KC_BACKEND_PREFIX instead
+// of kc_sha3 and kc_ring. ketchup_lib_backend_table.h then builds the backend table.
+
+#ifdef KC_BACKEND_PREFIX
+#define KC_CONCAT_(prefix, name) prefix##_##name
+#define KC_CONCAT(prefix, name) KC_CONCAT_(prefix, name)
+#define KC_RENAME(name) KC_CONCAT(KC_BACKEND_PREFIX, name)
+
+#define kc_sha3_512_init     KC_RENAME(512_init)
+#define kc_sha3_384_init     KC_RENAME(384_init)
+#define kc_sha3_256_init     KC_RENAME(256_init)
+#define kc_sha3_224_init     KC_RENAME(224_init)
+#define kc_sha3_update       KC_RENAME(update)
+#define kc_sha3_updatev      KC_RENAME(updatev)
+#define kc_sha3_file         KC_RENAME(file)
+#define kc_sha3_final        KC_RENAME(final)
+#define kc_sha3_close        KC_RENAME(close)
+#define kc_sha3_set_priority KC_RENAME(set_priority)
+#define kc_sha3_nonce_search KC_RENAME(nonce_search)
+#define kc_ring_init         KC_RENAME(ring_init)
+#define kc_ring_arena        KC_RENAME(ring_arena)
+#define kc_ring_submit       KC_RENAME(ring_submit)
+#define kc_ring_wait         KC_RENAME(ring_wait)
+#define kc_ring_reap         KC_RENAME(ring_reap)
+#define kc_ring_close        KC_RENAME(ring_close)
+#endif
+
+#include "../include/ketchup_lib.h"
+
+#include <stddef.h>
+
+// Contexts and rings are passed as the state of the backend
+struct kc_backend_s {
+    char const *name;
+    // Whether it works on this machine, when picking the default backend
+    int (*available)(void);
+
+    size_t context_size;
+    // hash_size is in bits
+    kc_error (*init)(void *context, uint32_t hash_size);
+    void (*update)(void *context, void const *new_data, uint32_t new_data_length);
+    void (*updatev)(void *context, struct iovec const *iov, int iovcnt);
+    kc_error (*file)(void *context, int fd, uint64_t offset, uint64_t length);
+    void (*final)(void *context, uint8_t *digest, uint32_t *digest_length);
+    kc_error (*close)(void *context);
+    kc_error (*set_priority)(void *context, kc_priority priority);
+    kc_error (*nonce_search)(
+        void *context,
+        void const *header, uint32_t header_length,
+        uint32_t nonce_offset, uint32_t nonce_width,
+        uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+        uint32_t *nonce, uint32_t *attempts
+    );
+
+    // ring_init is NULL if the backend has no rings
+    size_t ring_size;
+    kc_error (*ring_init)(void *ring, uint32_t entries, uint32_t arena_size);
+    uint8_t *(*ring_arena)(void *ring);
+    kc_error (*ring_submit)(void *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data);
+    kc_error (*ring_wait)(void *ring, uint32_t min_complete);
+    uint32_t (*ring_reap)(void *ring, kc_ring_completion *completions, uint32_t max_completions);
+    kc_error (*ring_close)(void *ring);
+};
+
+extern struct kc_backend_s const kc_hardware_backend;
+extern struct kc_backend_s const kc_mmio_backend;
+extern struct kc_backend_s const kc_software_backend;
+extern struct kc_backend_s const kc_openssl_backend;
+extern struct kc_backend_s const kc_mock_backend;
+
+#endif // _KETCHUP_LIB_BACKEND_H
@@ -0,0 +1,19 @@
+// The hardware backend, as one of those of KETCHUP_LIB_MODE_DYNAMIC
+#define _GNU_SOURCE
+
+#undef KETCHUP_LIB_MODE
+#define KETCHUP_LIB_MODE 0 // KETCHUP_LIB_MODE_HARDWARE
+#define KC_BACKEND_PREFIX kc_hardware
+
+#include "ketchup_lib_backend.h"
+#include "ketchup_lib_hardware.c"
+
+// The driver is loaded and the process may use it
+static int kc_hardware_available(void) {
+    return access(kc_algorithm_paths[KC_DIGEST_256], R_OK | W_OK) == 0
+        || access(KC_DEVICE_PATH, R_OK | W_OK) == 0;
+}
+
+#define KC_BACKEND_NAME "hardware"
+#define KC_BACKEND_AVAILABLE kc_hardware_available
+#include "ketchup_lib_backend_table.h"
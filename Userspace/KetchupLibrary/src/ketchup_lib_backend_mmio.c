@@ -0,0 +1,19 @@
+// The MMIO backend, as one of those of KETCHUP_LIB_MODE_DYNAMIC
+#define _GNU_SOURCE
+
+#undef KETCHUP_LIB_MODE
+#define KETCHUP_LIB_MODE 2 // KETCHUP_LIB_MODE_MMIO
+#define KC_BACKEND_PREFIX kc_mmio
+
+#include "ketchup_lib_backend.h"
+#include "ketchup_lib_hardware.c"
+
+// Same as the hardware backend
+static int kc_mmio_available(void) {
+    return access(kc_algorithm_paths[KC_DIGEST_256], R_OK | W_OK) == 0
+        || access(KC_DEVICE_PATH, R_OK | W_OK) == 0;
+}
+
+#define KC_BACKEND_NAME "mmio"
+#define KC_BACKEND_AVAILABLE kc_mmio_available
+#include "ketchup_lib_backend_table.h"
@@ -0,0 +1,15 @@
+// The OpenSSL backend, as one of those of KETCHUP_LIB_MODE_DYNAMIC
+#undef KETCHUP_LIB_MODE
+#define KETCHUP_LIB_MODE 1 // KETCHUP_LIB_MODE_OPENSSL
+#define KC_BACKEND_PREFIX kc_openssl
+
+#include "ketchup_lib_backend.h"
+#include "ketchup_lib_openssl.c"
+
+static int kc_openssl_available(void) {
+    return 1;
+}
+
+#define KC_BACKEND_NAME "openssl"
+#define KC_BACKEND_AVAILABLE kc_openssl_available
+#include "ketchup_lib_backend_table.h"
@@ -0,0 +1,15 @@
+// The software backend, as one of those of KETCHUP_LIB_MODE_DYNAMIC
+#undef KETCHUP_LIB_MODE
+#define KETCHUP_LIB_MODE 5 // KETCHUP_LIB_MODE_SOFTWARE
+#define KC_BACKEND_PREFIX kc_software
+
+#include "ketchup_lib_backend.h"
+#include "ketchup_lib_software.c"
+
+static int kc_software_available(void) {
+    return 1;
+}
+
+#define KC_BACKEND_NAME "software"
+#define KC_BACKEND_AVAILABLE kc_software_available
+#include "ketchup_lib_backend_table.h"
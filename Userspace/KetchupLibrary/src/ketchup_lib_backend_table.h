@@ -0,0 +1,102 @@
+// Included at the end of a backend translation unit (see ketchup_lib_backend.h),
+// after defining KC_BACKEND_NAME and KC_BACKEND_AVAILABLE. The functions of the
+// backend take its own kc_sha3_context, so the table points to wrappers taking void *.
+
+static kc_error kc_backend_init(void *context, uint32_t hash_size) {
+    switch (hash_size) {
+        case 512:
+            return kc_sha3_512_init(context);
+        case 384:
+            return kc_sha3_384_init(context);
+        case 256:
+            return kc_sha3_256_init(context);
+        case 224:
+            return kc_sha3_224_init(context);
+        default:
+            return KC_ERR_UNSUPPORTED_SIZE;
+    }
+}
+
+static void kc_backend_update(void *context, void const *new_data, uint32_t new_data_length) {
+    kc_sha3_update(context, new_data, new_data_length);
+}
+
+static void kc_backend_updatev(void *context, struct iovec const *iov, int iovcnt) {
+    kc_sha3_updatev(context, iov, iovcnt);
+}
+
+static kc_error kc_backend_file(void *context, int fd, uint64_t offset, uint64_t length) {
+    return kc_sha3_file(context, fd, offset, length);
+}
+
+static void kc_backend_final(void *context, uint8_t *digest, uint32_t *digest_length) {
+    kc_sha3_final(context, digest, digest_length);
+}
+
+static kc_error kc_backend_close(void *context) {
+    return kc_sha3_close(context);
+}
+
+static kc_error kc_backend_set_priority(void *context, kc_priority priority) {
+    return kc_sha3_set_priority(context, priority);
+}
+
+static kc_error kc_backend_nonce_search(
+    void *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    return kc_sha3_nonce_search(
+        context, header, header_length, nonce_offset, nonce_width,
+        nonce_start, max_attempts, target, nonce, attempts
+    );
+}
+
+static kc_error kc_backend_ring_init(void *ring, uint32_t entries, uint32_t arena_size) {
+    return kc_ring_init(ring, entries, arena_size);
+}
+
+static uint8_t *kc_backend_ring_arena(void *ring) {
+    return kc_ring_arena(ring);
+}
+
+static kc_error kc_backend_ring_submit(void *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    return kc_ring_submit(ring, offset, length, hash_size, user_data);
+}
+
+static kc_error kc_backend_ring_wait(void *ring, uint32_t min_complete) {
+    return kc_ring_wait(ring, min_complete);
+}
+
+static uint32_t kc_backend_ring_reap(void *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    return kc_ring_reap(ring, completions, max_completions);
+}
+
+static kc_error kc_backend_ring_close(void *ring) {
+    return kc_ring_close(ring);
+}
+
+struct kc_backend_s const KC_RENAME(backend) = {
+    .name = KC_BACKEND_NAME,
+    .available = KC_BACKEND_AVAILABLE,
+
+    .context_size = sizeof(kc_sha3_context),
+    .init = kc_backend_init,
+    .update = kc_backend_update,
+    .updatev = kc_backend_updatev,
+    .file = kc_backend_file,
+    .final = kc_backend_final,
+    .close = kc_backend_close,
+    .set_priority = kc_backend_set_priority,
+    .nonce_search = kc_backend_nonce_search,
+
+    .ring_size = sizeof(kc_ring),
+    .ring_init = kc_backend_ring_init,
+    .ring_arena = kc_backend_ring_arena,
+    .ring_submit = kc_backend_ring_submit,
+    .ring_wait = kc_backend_ring_wait,
+    .ring_reap = kc_backend_ring_reap,
+    .ring_close = kc_backend_ring_close,
+};
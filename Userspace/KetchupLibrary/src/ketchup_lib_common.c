@@ -1,61 +1,317 @@
 #include "../include/ketchup_lib.h"
 
-kc_error kc_sha3_512(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Contexts the pool keeps when kc_pool_init wasn't called
+#define KC_POOL_DEFAULT_SIZE 4
+
+// Same order as the hash sizes of the driver
+#define KC_POOL_512 0
+#define KC_POOL_384 1
+#define KC_POOL_256 2
+#define KC_POOL_224 3
+
+typedef kc_error kc_init_function(kc_sha3_context *);
+
+static kc_init_function *const kc_pool_inits[4] = {
+    kc_sha3_512_init,
+    kc_sha3_384_init,
+    kc_sha3_256_init,
+    kc_sha3_224_init,
+};
+
+struct kc_pool_entry {
     kc_sha3_context context;
-    kc_error error;
+    struct kc_pool_entry *next;
+    // Pool generation the context was opened in, see kc_pool_return
+    uint32_t generation;
+};
 
-    error = kc_sha3_512_init(&context);
-    if (error != KC_ERR_NONE) {
-        return error;
+// Contexts of the one-shot helpers. Between messages a context is idle in
+// the list of its hash size, and kc_sha3_final already reset it for the next one.
+static struct {
+    pthread_mutex_t lock;
+    // Signaled when a context is returned or closed
+    pthread_cond_t returned;
+
+    int initialized;
+    // Set by kc_pool_shutdown, the pool then stays off until kc_pool_init
+    int stopped;
+    // Most contexts open at once, over all hash sizes. 0 turns the pool off
+    uint32_t size;
+    // Idle and borrowed, borrowed ones still count after a shutdown
+    uint32_t open;
+
+    struct kc_pool_entry *idle[4];
+
+    // Bumped by kc_pool_shutdown and fork, so that the contexts
+    // borrowed before them are closed instead of coming back
+    uint32_t generation;
+    // Generation of the last fork. The contexts borrowed before it belong to
+    // threads of the parent, the child doesn't count them in open.
+    uint32_t fork_generation;
+} kc_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .returned = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t kc_pool_atfork_once = PTHREAD_ONCE_INIT;
+
+// Closes the idle contexts, called with the lock held
+static void kc_pool_close_idle(void) {
+    struct kc_pool_entry *entry;
+
+    for (int i = 0; i < 4; i++) {
+        while ((entry = kc_pool.idle[i]) != NULL) {
+            kc_pool.idle[i] = entry->next;
+            kc_sha3_close(&entry->context);
+            free(entry);
+            kc_pool.open--;
+        }
     }
+}
 
-    kc_sha3_update(&context, data, data_length);
-    kc_sha3_final(&context, digest, digest_length);
+// Whether a context opened in generation still counts in kc_pool.open
+static int kc_pool_counted(uint32_t generation) {
+    return generation >= kc_pool.fork_generation;
+}
 
-    return kc_sha3_close(&context);
+// An idle MMIO context would keep the peripheral it mapped, and nobody
+// else could use it until the process exits. So they aren't kept.
+static int kc_pool_keeps(kc_sha3_context *context) {
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_MMIO
+    return 0;
+#elif KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_DYNAMIC
+    return strcmp(kc_sha3_backend(context), "mmio") != 0;
+#else
+    return 1;
+#endif
 }
 
-kc_error kc_sha3_384(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
-    kc_sha3_context context;
-    kc_error error;
+static void kc_pool_prepare(void) {
+    pthread_mutex_lock(&kc_pool.lock);
+}
 
-    error = kc_sha3_384_init(&context);
-    if (error != KC_ERR_NONE) {
-        return error;
+static void kc_pool_parent(void) {
+    pthread_mutex_unlock(&kc_pool.lock);
+}
+
+// The child shares the open files of the parent, so it mustn't use the
+// contexts: two processes writing to the same file descriptor would mix
+// their messages. Closing them only drops the child's copies.
+static void kc_pool_child(void) {
+    kc_pool_close_idle();
+    kc_pool.open = 0;
+    kc_pool.generation++;
+    kc_pool.fork_generation = kc_pool.generation;
+    pthread_mutex_unlock(&kc_pool.lock);
+}
+
+static void kc_pool_register_atfork(void) {
+    pthread_atfork(kc_pool_prepare, kc_pool_parent, kc_pool_child);
+}
+
+// Called with the lock held
+static void kc_pool_setup(uint32_t size) {
+    pthread_once(&kc_pool_atfork_once, kc_pool_register_atfork);
+    kc_pool.size = size;
+    kc_pool.initialized = 1;
+    kc_pool.stopped = 0;
+}
+
+kc_error kc_pool_init(uint32_t max_contexts) {
+    pthread_mutex_lock(&kc_pool.lock);
+
+    if (kc_pool.initialized && !kc_pool.stopped) {
+        pthread_mutex_unlock(&kc_pool.lock);
+        return KC_ERR_BUSY;
     }
+    kc_pool_setup(max_contexts);
+
+    pthread_mutex_unlock(&kc_pool.lock);
+    return KC_ERR_NONE;
+}
+
+// The borrowed contexts are closed as they come back, and still count in
+// kc_pool.open until then, so a kc_pool_init right after keeps its bound
+kc_error kc_pool_shutdown(void) {
+    pthread_mutex_lock(&kc_pool.lock);
+
+    kc_pool_close_idle();
+    kc_pool.generation++;
+    kc_pool.initialized = 1;
+    kc_pool.stopped = 1;
+    kc_pool.size = 0;
 
-    kc_sha3_update(&context, data, data_length);
-    kc_sha3_final(&context, digest, digest_length);
+    // The waiters go on without the pool
+    pthread_cond_broadcast(&kc_pool.returned);
+    pthread_mutex_unlock(&kc_pool.lock);
 
-    return kc_sha3_close(&context);
+    return KC_ERR_NONE;
 }
 
-kc_error kc_sha3_256(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
-    kc_sha3_context context;
-    kc_error error;
+// Opens a context for the pool. It's already counted in kc_pool.open.
+static kc_error kc_pool_open(int hash, uint32_t generation, struct kc_pool_entry **entry) {
+    struct kc_pool_entry *fresh = malloc(sizeof(*fresh));
+    kc_error error = fresh ? kc_pool_inits[hash](&fresh->context) : KC_ERR_OTHER;
 
-    error = kc_sha3_256_init(&context);
     if (error != KC_ERR_NONE) {
+        free(fresh);
+
+        pthread_mutex_lock(&kc_pool.lock);
+        if (kc_pool_counted(generation)) {
+            kc_pool.open--;
+            pthread_cond_signal(&kc_pool.returned);
+        }
+        pthread_mutex_unlock(&kc_pool.lock);
         return error;
     }
 
-    kc_sha3_update(&context, data, data_length);
-    kc_sha3_final(&context, digest, digest_length);
+    fresh->generation = generation;
+    *entry = fresh;
+    return KC_ERR_NONE;
+}
 
-    return kc_sha3_close(&context);
+// Takes an idle context of the hash size, opening one if there's room.
+// Sets entry to NULL if the pool is off, the caller then uses a context of its own.
+static kc_error kc_pool_borrow(int hash, struct kc_pool_entry **entry) {
+    struct kc_pool_entry *victim;
+    uint32_t generation;
+
+    pthread_mutex_lock(&kc_pool.lock);
+    if (!kc_pool.initialized) {
+        kc_pool_setup(KC_POOL_DEFAULT_SIZE);
+    }
+
+    for (;;) {
+        if (!kc_pool.initialized || kc_pool.size == 0) {
+            pthread_mutex_unlock(&kc_pool.lock);
+            *entry = NULL;
+            return KC_ERR_NONE;
+        }
+
+        if (kc_pool.idle[hash] != NULL) {
+            *entry = kc_pool.idle[hash];
+            kc_pool.idle[hash] = (*entry)->next;
+            pthread_mutex_unlock(&kc_pool.lock);
+            return KC_ERR_NONE;
+        }
+
+        generation = kc_pool.generation;
+        if (kc_pool.open < kc_pool.size) {
+            kc_pool.open++;
+            pthread_mutex_unlock(&kc_pool.lock);
+            return kc_pool_open(hash, generation, entry);
+        }
+
+        // The pool is full, but maybe of idle contexts of other hash sizes:
+        // one of them makes room for ours instead
+        for (int i = 0; i < 4; i++) {
+            victim = kc_pool.idle[i];
+            if (victim != NULL) {
+                // Its place in kc_pool.open goes to ours
+                kc_pool.idle[i] = victim->next;
+                pthread_mutex_unlock(&kc_pool.lock);
+
+                kc_sha3_close(&victim->context);
+                free(victim);
+                return kc_pool_open(hash, generation, entry);
+            }
+        }
+
+        // Every context is in use
+        pthread_cond_wait(&kc_pool.returned, &kc_pool.lock);
+    }
 }
 
-kc_error kc_sha3_224(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+// Closes a borrowed context instead of giving it back
+static void kc_pool_discard(struct kc_pool_entry *entry) {
+    pthread_mutex_lock(&kc_pool.lock);
+    if (kc_pool_counted(entry->generation)) {
+        kc_pool.open--;
+        pthread_cond_signal(&kc_pool.returned);
+    }
+    pthread_mutex_unlock(&kc_pool.lock);
+
+    kc_sha3_close(&entry->context);
+    free(entry);
+}
+
+static void kc_pool_return(int hash, struct kc_pool_entry *entry) {
+    if (!kc_pool_keeps(&entry->context)) {
+        kc_pool_discard(entry);
+        return;
+    }
+
+    // Borrowed before a shutdown or a fork
+    pthread_mutex_lock(&kc_pool.lock);
+    if (entry->generation != kc_pool.generation) {
+        pthread_mutex_unlock(&kc_pool.lock);
+        kc_pool_discard(entry);
+        return;
+    }
+
+    entry->next = kc_pool.idle[hash];
+    kc_pool.idle[hash] = entry;
+    pthread_cond_signal(&kc_pool.returned);
+    pthread_mutex_unlock(&kc_pool.lock);
+}
+
+static kc_error kc_sha3_oneshot(int hash, void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+    struct kc_pool_entry *entry;
     kc_sha3_context context;
     kc_error error;
 
-    error = kc_sha3_224_init(&context);
+    error = kc_pool_borrow(hash, &entry);
     if (error != KC_ERR_NONE) {
         return error;
     }
 
-    kc_sha3_update(&context, data, data_length);
-    kc_sha3_final(&context, digest, digest_length);
+    // kc_sha3_final leaves it at 0 if the message couldn't be hashed
+    *digest_length = 0;
 
-    return kc_sha3_close(&context);
-}
\ No newline at end of file
+    // Without the pool, the context only lasts for this message
+    if (entry == NULL) {
+        error = kc_pool_inits[hash](&context);
+        if (error != KC_ERR_NONE) {
+            return error;
+        }
+
+        kc_sha3_update(&context, data, data_length);
+        kc_sha3_final(&context, digest, digest_length);
+
+        error = kc_sha3_close(&context);
+        return *digest_length == 0 ? KC_ERR_OTHER : error;
+    }
+
+    kc_sha3_update(&entry->context, data, data_length);
+    kc_sha3_final(&entry->context, digest, digest_length);
+
+    // The context could be stuck in the middle of the message,
+    // and the next caller would get it in its digest
+    if (*digest_length == 0) {
+        kc_pool_discard(entry);
+        return KC_ERR_OTHER;
+    }
+
+    kc_pool_return(hash, entry);
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_512(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+    return kc_sha3_oneshot(KC_POOL_512, data, data_length, digest, digest_length);
+}
+
+kc_error kc_sha3_384(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+    return kc_sha3_oneshot(KC_POOL_384, data, data_length, digest, digest_length);
+}
+
+kc_error kc_sha3_256(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+    return kc_sha3_oneshot(KC_POOL_256, data, data_length, digest, digest_length);
+}
+
+kc_error kc_sha3_224(void const *data, uint32_t data_length, uint8_t *digest, uint32_t *digest_length) {
+    return kc_sha3_oneshot(KC_POOL_224, data, data_length, digest, digest_length);
+}
@@ -0,0 +1,217 @@
+#include "../include/ketchup_lib.h"
+#include "ketchup_lib_backend.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if KETCHUP_LIB_MODE != KETCHUP_LIB_MODE_DYNAMIC
+// TODO: Print a better error message
+#error "INVALID LIB MODE"
+#endif
+
+// Names the default backend
+#define KC_BACKEND_ENV "KETCHUP_BACKEND"
+
+static struct kc_backend_s const *const kc_backends[] = {
+    &kc_hardware_backend,
+    &kc_mmio_backend,
+    &kc_software_backend,
+    &kc_openssl_backend,
+    &kc_mock_backend,
+};
+
+// Tried in order for the default backend, the first available one wins. The
+// MMIO backend keeps its peripheral until the context is closed, so it's
+// only used when asked for. The software backend is at least as fast as
+// OpenSSL (see example/bench.c), which is only there to compare against.
+static struct kc_backend_s const *const kc_preferred_backends[] = {
+    &kc_hardware_backend,
+    &kc_software_backend,
+};
+
+static pthread_once_t kc_default_once = PTHREAD_ONCE_INIT;
+// NULL if KC_BACKEND_ENV names an unknown backend
+static struct kc_backend_s const *kc_default_backend;
+
+static struct kc_backend_s const *kc_find_backend(char const *name) {
+    for (size_t i = 0; i < sizeof(kc_backends) / sizeof(kc_backends[0]); i++) {
+        if (strcmp(kc_backends[i]->name, name) == 0) {
+            return kc_backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void kc_pick_default_backend(void) {
+    char const *name = getenv(KC_BACKEND_ENV);
+
+    if (name != NULL && name[0] != '\0') {
+        kc_default_backend = kc_find_backend(name);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(kc_preferred_backends) / sizeof(kc_preferred_backends[0]); i++) {
+        if (kc_preferred_backends[i]->available()) {
+            kc_default_backend = kc_preferred_backends[i];
+            return;
+        }
+    }
+}
+
+static struct kc_backend_s const *kc_get_default_backend(void) {
+    pthread_once(&kc_default_once, kc_pick_default_backend);
+    return kc_default_backend;
+}
+
+kc_error kc_sha3_init(kc_sha3_context *context, char const *backend, uint32_t hash_size) {
+    struct kc_backend_s const *ops = backend != NULL ? kc_find_backend(backend) : kc_get_default_backend();
+    kc_error error;
+
+    if (ops == NULL) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    context->state = malloc(ops->context_size);
+    if (context->state == NULL) {
+        return KC_ERR_OTHER;
+    }
+
+    error = ops->init(context->state, hash_size);
+    if (error != KC_ERR_NONE) {
+        free(context->state);
+        context->state = NULL;
+        return error;
+    }
+
+    context->backend = ops;
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_512_init(kc_sha3_context *context) {
+    return kc_sha3_init(context, NULL, 512);
+}
+
+kc_error kc_sha3_384_init(kc_sha3_context *context) {
+    return kc_sha3_init(context, NULL, 384);
+}
+
+kc_error kc_sha3_256_init(kc_sha3_context *context) {
+    return kc_sha3_init(context, NULL, 256);
+}
+
+kc_error kc_sha3_224_init(kc_sha3_context *context) {
+    return kc_sha3_init(context, NULL, 224);
+}
+
+char const *kc_sha3_backend(kc_sha3_context const *context) {
+    return context->backend->name;
+}
+
+void kc_sha3_update(kc_sha3_context *context, void const *new_data, uint32_t new_data_length) {
+    context->backend->update(context->state, new_data, new_data_length);
+}
+
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    context->backend->updatev(context->state, iov, iovcnt);
+}
+
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    return context->backend->file(context->state, fd, offset, length);
+}
+
+void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
+    context->backend->final(context->state, digest, digest_length);
+}
+
+kc_error kc_sha3_close(kc_sha3_context *context) {
+    kc_error error = context->backend->close(context->state);
+
+    free(context->state);
+    context->state = NULL;
+
+    return error;
+}
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority) {
+    return context->backend->set_priority(context->state, priority);
+}
+
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    return context->backend->nonce_search(
+        context->state, header, header_length, nonce_offset, nonce_width,
+        nonce_start, max_attempts, target, nonce, attempts
+    );
+}
+
+kc_error kc_ring_init_backend(kc_ring *ring, char const *backend, uint32_t entries, uint32_t arena_size) {
+    struct kc_backend_s const *ops = backend != NULL ? kc_find_backend(backend) : kc_get_default_backend();
+    kc_error error;
+
+    if (ops == NULL) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+    if (ops->ring_init == NULL) {
+        // Only asking for it by name gets a backend without rings an error,
+        // a default backend without them leaves the rings to software
+        if (backend != NULL) {
+            return KC_ERR_INVALID_ARGUMENT;
+        }
+        ops = &kc_software_backend;
+    }
+
+    ring->state = malloc(ops->ring_size);
+    if (ring->state == NULL) {
+        return KC_ERR_OTHER;
+    }
+
+    error = ops->ring_init(ring->state, entries, arena_size);
+    if (error != KC_ERR_NONE) {
+        free(ring->state);
+        ring->state = NULL;
+        return error;
+    }
+
+    ring->backend = ops;
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size) {
+    return kc_ring_init_backend(ring, NULL, entries, arena_size);
+}
+
+char const *kc_ring_backend(kc_ring const *ring) {
+    return ring->backend->name;
+}
+
+uint8_t *kc_ring_arena(kc_ring *ring) {
+    return ring->backend->ring_arena(ring->state);
+}
+
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    return ring->backend->ring_submit(ring->state, offset, length, hash_size, user_data);
+}
+
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete) {
+    return ring->backend->ring_wait(ring->state, min_complete);
+}
+
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    return ring->backend->ring_reap(ring->state, completions, max_completions);
+}
+
+kc_error kc_ring_close(kc_ring *ring) {
+    kc_error error = ring->backend->ring_close(ring->state);
+
+    free(ring->state);
+    ring->state = NULL;
+
+    return error;
+}
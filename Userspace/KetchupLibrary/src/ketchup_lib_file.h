@@ -0,0 +1,114 @@
+#ifndef _KETCHUP_LIB_FILE_H
+#define _KETCHUP_LIB_FILE_H
+
+// kc_sha3_file of the backends that hash in the process (OpenSSL and software):
+// regular files are mapped, anything else (pipes, sockets) is read normally.
+
+#include "../include/ketchup_lib.h"
+
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Chunk size used when the file can't be mapped
+#define KC_FILE_BUFFER_SIZE (64 * 1024)
+
+// Most of a file mapped at once, so that a 32-bit process can hash files bigger
+// than its address space. A multiple of any page size.
+#define KC_FILE_MAP_WINDOW (64 * 1024 * 1024)
+
+// Hashes length bytes of data into the context of the backend
+typedef void kc_file_absorb_function(void *context, uint8_t const *data, size_t length);
+
+// Passes length bytes of fd from offset, or everything up to the end of the
+// file if length is 0, to absorb
+static kc_error kc_file_absorb(void *context, kc_file_absorb_function *absorb, int fd, uint64_t offset, uint64_t length) {
+    struct stat file_stat;
+    uint8_t buffer[KC_FILE_BUFFER_SIZE];
+    uint64_t remaining;
+    ssize_t bytes_read;
+
+    if (fstat(fd, &file_stat) != 0) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    if (S_ISREG(file_stat.st_mode)) {
+        if (offset >= (uint64_t)file_stat.st_size) {
+            return KC_ERR_NONE;
+        }
+
+        if (length == 0 || length > file_stat.st_size - offset) {
+            length = file_stat.st_size - offset;
+        }
+
+        // mmap wants a page aligned offset
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+        while (length > 0) {
+            uint64_t map_offset = offset - offset % page_size;
+            size_t skip = offset - map_offset;
+            size_t chunk = length < KC_FILE_MAP_WINDOW - skip ? length : KC_FILE_MAP_WINDOW - skip;
+
+            uint8_t *map = mmap(NULL, skip + chunk, PROT_READ, MAP_PRIVATE, fd, map_offset);
+            if (map == MAP_FAILED) {
+                break;
+            }
+
+            madvise(map, skip + chunk, MADV_SEQUENTIAL);
+            absorb(context, map + skip, chunk);
+            munmap(map, skip + chunk);
+
+            offset += chunk;
+            length -= chunk;
+        }
+
+        if (length == 0) {
+            return KC_ERR_NONE;
+        }
+        // If it can't be mapped just read the rest
+    }
+
+    // Pipes and sockets can't seek, so they can only be read in order from the start
+    int seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    if (!seekable && offset != 0) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    remaining = length;
+    while (length == 0 || remaining > 0) {
+        size_t to_read = KC_FILE_BUFFER_SIZE;
+        if (length != 0 && remaining < to_read) {
+            to_read = remaining;
+        }
+
+        if (seekable) {
+            bytes_read = pread(fd, buffer, to_read, offset);
+        } else {
+            bytes_read = read(fd, buffer, to_read);
+        }
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBADF || errno == EINVAL) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        if (bytes_read == 0) {
+            break;
+        }
+
+        absorb(context, buffer, bytes_read);
+        offset += bytes_read;
+        remaining -= bytes_read;
+    }
+
+    return KC_ERR_NONE;
+}
+
+#endif // _KETCHUP_LIB_FILE_H
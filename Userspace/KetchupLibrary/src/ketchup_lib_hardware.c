@@ -1,33 +1,112 @@
+// For splice()
+#define _GNU_SOURCE
+
 #include "../include/ketchup_lib.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #define KC_DEVICE_PATH "/dev/ketchup_driver"
 #define WR_PERIPH_HASH_SIZE _IOW(0xFC, 1, uint32_t*)
 #define RD_PERIPH_HASH_SIZE _IOR(0xFC, 2, uint32_t*)
+#define RW_PERIPH_NONCE_SEARCH _IOWR(0xFC, 3, struct kc_nonce_search*)
+#define RW_PERIPH_HASH_FILE _IOWR(0xFC, 4, struct kc_hash_file*)
+#define RW_PERIPH_RING_SETUP _IOWR(0xFC, 5, struct kc_ring_setup*)
+#define WR_PERIPH_RING_ENTER _IOW(0xFC, 6, uint32_t*)
+#define WR_PERIPH_PRIORITY _IOW(0xFC, 7, uint32_t*)
+
+// mmap offset of the registers of the bound peripheral
+#define KC_MMAP_REGISTERS_OFFSET 0x10000000
+
+// Same layout as the one in the driver
+struct kc_nonce_search {
+    uint8_t  header[KC_NONCE_MAX_HEADER_SIZE + 1];
+    uint32_t header_length;
+    uint32_t nonce_offset;
+    uint32_t nonce_width;
+    uint32_t nonce_start;
+    uint32_t max_attempts;
+    uint32_t target_high;
+    uint32_t target_low;
+
+    uint32_t found;
+    uint32_t nonce;
+    uint32_t attempts;
+};
+
+// Same layout as the one in the driver
+struct kc_hash_file {
+    int32_t  fd;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+
+    uint64_t hashed;
+};
+
+// Same layouts as the ones in the driver
+struct kc_ring_setup {
+    uint32_t entries;
+    uint32_t arena_size;
+
+    uint32_t sq_offset;
+    uint32_t cq_offset;
+    uint32_t arena_offset;
+    uint32_t mmap_size;
+};
+
+struct kc_ring_header {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;
+    uint32_t arena_size;
+};
+
+struct kc_ring_sqe {
+    uint64_t user_data;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t hash_size;
+    uint32_t reserved;
+};
+
+struct kc_ring_cqe {
+    uint64_t user_data;
+    int32_t  result;
+    uint32_t digest_length;
+    uint8_t  digest[64];
+};
+
+// The most we ask splice() to move at a time
+#define KC_SPLICE_CHUNK (1024 * 1024)
+
+// Same as UIO_MAXIOV in the kernel, the most iovecs a single writev accepts
+#define KC_IOV_MAX 1024
 
 #define KC_DIGEST_512 0
 #define KC_DIGEST_384 1
 #define KC_DIGEST_256 2
 #define KC_DIGEST_224 3
 
-static kc_error kc_init_peripheral(kc_sha3_context *context, uint8_t digest_length) {
-    int fd = open(KC_DEVICE_PATH, O_RDWR);
-
-    if (fd < 0) {
-        if (fd == -EBUSY) {
-            return KC_ERR_BUSY;
-        }
-        return KC_ERR_OTHER;
-    }
+// Nodes that come with the hash size already set, by KC_DIGEST_*
+static const char *const kc_algorithm_paths[] = {
+    "/dev/ketchup/sha3-512",
+    "/dev/ketchup/sha3-384",
+    "/dev/ketchup/sha3-256",
+    "/dev/ketchup/sha3-224",
+};
 
+static kc_error kc_init_peripheral(kc_sha3_context *context, uint8_t digest_length) {
     uint32_t dev_digest_setting = 0;
-    // TODO: Set the peripheral to the appropriate size
     switch (digest_length) {
         case 512/8:
             dev_digest_setting = KC_DIGEST_512;
@@ -45,15 +124,36 @@ static kc_error kc_init_peripheral(kc_sha3_context *context, uint8_t digest_leng
             return KC_ERR_UNSUPPORTED_SIZE;
     }
 
-    int ioctl_retval = ioctl(fd, WR_PERIPH_HASH_SIZE, &dev_digest_setting);
+    // The node of the algorithm already has the right hash size,
+    // older drivers only have KC_DEVICE_PATH and need the ioctl
+    int fd = open(kc_algorithm_paths[dev_digest_setting], O_RDWR);
 
-    if (ioctl_retval != 0) {
-        close(fd);
-        return KC_ERR_UNSUPPORTED_SIZE;
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(KC_DEVICE_PATH, O_RDWR);
+
+        if (fd >= 0 && ioctl(fd, WR_PERIPH_HASH_SIZE, &dev_digest_setting) != 0) {
+            close(fd);
+            return KC_ERR_UNSUPPORTED_SIZE;
+        }
+    }
+
+    if (fd < 0) {
+        if (errno == EBUSY) {
+            return KC_ERR_BUSY;
+        }
+        return KC_ERR_OTHER;
     }
 
     context->fd = fd;
     context->digest_length = digest_length;
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_MMIO
+    context->registers = NULL;
+    context->hash_size = dev_digest_setting;
+    context->pending_length = 0;
+    context->error = KC_ERR_NONE;
+#else
+    context->staged_length = 0;
+#endif
 
     return KC_ERR_NONE;
 }
@@ -75,10 +175,212 @@ kc_error kc_sha3_224_init(kc_sha3_context *context) {
     return kc_init_peripheral(context, 224/8);
 }
 
+#if KETCHUP_LIB_MODE == KETCHUP_LIB_MODE_MMIO
+
+// Registers of the peripheral, as word indices in the mapped page
+#define KC_REG_CONTROL 0
+#define KC_REG_STATUS  1
+#define KC_REG_INPUT   2
+#define KC_REG_COMMAND 3
+#define KC_REG_OUTPUT  4
+
+// Same limit as the driver, so a faulty peripheral can't lock us up
+#define KC_MMIO_POLL_LIMIT 100
+
+// How much of a file kc_sha3_file reads at a time
+#define KC_MMIO_FILE_CHUNK (16 * 1024)
+
+static inline uint32_t kc_pack_be32(uint8_t const *data) {
+    return ((uint32_t)data[0] << 24)
+         | ((uint32_t)data[1] << 16)
+         | ((uint32_t)data[2] <<  8)
+         | ((uint32_t)data[3]);
+}
+
+// Maps the registers, which is when the driver gives the context a peripheral.
+// The driver can't wait for one inside mmap(), so if they're all busy this
+// returns KC_ERR_BUSY. The context keeps the peripheral until it's closed.
+static kc_error kc_mmio_map(kc_sha3_context *context) {
+    void *registers;
+
+    if (context->registers != NULL) {
+        return KC_ERR_NONE;
+    }
+
+    registers = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, context->fd, KC_MMAP_REGISTERS_OFFSET);
+    if (registers == MAP_FAILED) {
+        return errno == EAGAIN ? KC_ERR_BUSY : KC_ERR_OTHER;
+    }
+
+    context->registers = registers;
+    return KC_ERR_NONE;
+}
+
+// Same as peripheral_send_bytes in the driver
 void kc_sha3_update(kc_sha3_context *context, const void *new_data, uint32_t new_data_length) {
+    uint8_t const *data = new_data;
+    uint32_t length = new_data_length;
+
+    // Once some data is lost the digest would be wrong, so the rest is dropped
+    // too, and kc_sha3_final reports the error
+    if (context->error != KC_ERR_NONE) {
+        return;
+    }
+
+    context->error = kc_mmio_map(context);
+    if (context->error != KC_ERR_NONE) {
+        return;
+    }
+
+    // 1. Complete the pending word
+    while (context->pending_length > 0 && length > 0) {
+        context->pending[context->pending_length++] = *data++;
+        length--;
+
+        if (context->pending_length == 4) {
+            context->registers[KC_REG_INPUT] = kc_pack_be32(context->pending);
+            context->pending_length = 0;
+        }
+    }
+
+    // 2. Stream the whole words
+    for (; length >= 4; length -= 4) {
+        context->registers[KC_REG_INPUT] = kc_pack_be32(data);
+        data += 4;
+    }
+
+    // 3. Keep the tail. If there is one, step 1 emptied the pending word
+    if (length > 0) {
+        memcpy(context->pending, data, length);
+        context->pending_length = length;
+    }
+}
+
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        kc_sha3_update(context, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+// There's no driver in the way to read the file for us, so it goes through a buffer
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    uint8_t buffer[KC_MMIO_FILE_CHUNK];
+    struct stat file_stat;
+    uint64_t remaining = length;
+    ssize_t got;
+    int is_pipe = fstat(fd, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode);
+
+    // Pipes can only be read in order
+    if (is_pipe && offset != 0) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    while (length == 0 || remaining > 0) {
+        size_t to_read = KC_MMIO_FILE_CHUNK;
+        if (length != 0 && remaining < to_read) {
+            to_read = remaining;
+        }
+
+        got = is_pipe ? read(fd, buffer, to_read) : pread(fd, buffer, to_read, offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBADF || errno == EINVAL || errno == ESPIPE) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        // End of file
+        if (got == 0) {
+            break;
+        }
+
+        kc_sha3_update(context, buffer, got);
+        if (context->error != KC_ERR_NONE) {
+            return context->error;
+        }
+        offset += got;
+        remaining -= got;
+    }
+
+    return KC_ERR_NONE;
+}
+
+// Clears the peripheral and the context, so the next message starts from scratch
+static void kc_mmio_reset(kc_sha3_context *context) {
+    if (context->registers != NULL) {
+        context->registers[KC_REG_COMMAND] = 1;
+        context->registers[KC_REG_CONTROL] = context->hash_size << 4;
+    }
+    context->pending_length = 0;
+    context->error = KC_ERR_NONE;
+}
+
+// Same steps as ketchup_read in the driver, but the peripheral stays with the context.
+// If the message couldn't be hashed, *digest_length is set to 0.
+void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
+    volatile uint32_t *registers;
+    uint32_t word;
+    int ready = 0;
+
+    *digest_length = 0;
+
+    if (context->error == KC_ERR_NONE) {
+        context->error = kc_mmio_map(context);
+    }
+    if (context->error != KC_ERR_NONE) {
+        kc_mmio_reset(context);
+        return;
+    }
+    registers = context->registers;
+
+    // 1-2. Send the last packet, with what's left in the pending word
+    registers[KC_REG_CONTROL] = context->pending_length | (1 << 2) | (context->hash_size << 4);
+    registers[KC_REG_INPUT] = kc_pack_be32(context->pending);
+
+    // 3. Wait for the digest, the output isn't worth reading without it
+    for (int i = 0; i < KC_MMIO_POLL_LIMIT && !ready; i++) {
+        ready = registers[KC_REG_STATUS] & 1;
+    }
+
+    // 4. Read it, in big endian order
+    if (ready) {
+        for (uint32_t i = 0; i < context->digest_length / 4; i++) {
+            word = registers[KC_REG_OUTPUT + i];
+            digest[i * 4]     = word >> 24;
+            digest[i * 4 + 1] = word >> 16;
+            digest[i * 4 + 2] = word >> 8;
+            digest[i * 4 + 3] = word;
+        }
+        *digest_length = context->digest_length;
+    }
+
+    // 5. Reset the peripheral for the next message
+    kc_mmio_reset(context);
+}
+
+// Unmapping the registers gives the peripheral back
+kc_error kc_sha3_close(kc_sha3_context *context) {
+    if (context->registers != NULL) {
+        munmap((void *)context->registers, sysconf(_SC_PAGESIZE));
+        context->registers = NULL;
+    }
+
+    if (close(context->fd) < 0) {
+        return KC_ERR_OTHER;
+    }
+
+    return KC_ERR_NONE;
+}
+
+#else
+
+static void kc_write_all(kc_sha3_context *context, void const *data, size_t length) {
     ssize_t data_written;
-    size_t remaining_data = new_data_length;
-    void const *data_ptr = new_data;
+    size_t remaining_data = length;
+    void const *data_ptr = data;
 
     while (remaining_data > 0) {
         data_written = write(context->fd, data_ptr, remaining_data);
@@ -94,18 +396,170 @@ void kc_sha3_update(kc_sha3_context *context, const void *new_data, uint32_t new
     }
 }
 
+// Writes what's in the staging buffer, before anything that reaches the device another way
+static void kc_flush_staging(kc_sha3_context *context) {
+    if (context->staged_length > 0) {
+        kc_write_all(context, context->staging, context->staged_length);
+        context->staged_length = 0;
+    }
+}
+
+void kc_sha3_update(kc_sha3_context *context, const void *new_data, uint32_t new_data_length) {
+    uint32_t rate = 200 - 2 * context->digest_length;
+    uint32_t capacity = KC_STAGING_SIZE - KC_STAGING_SIZE % rate;
+    uint8_t const *data_ptr = new_data;
+    uint32_t to_copy, direct;
+
+    // Top up what's already staged, and send it once it's full
+    if (context->staged_length > 0) {
+        to_copy = capacity - context->staged_length;
+        if (to_copy > new_data_length) {
+            to_copy = new_data_length;
+        }
+
+        memcpy(context->staging + context->staged_length, data_ptr, to_copy);
+        context->staged_length += to_copy;
+        data_ptr += to_copy;
+        new_data_length -= to_copy;
+
+        if (context->staged_length < capacity) {
+            return;
+        }
+        kc_flush_staging(context);
+    }
+
+    // Big buffers skip the copy, in whole blocks so the tail can wait for the next update
+    if (new_data_length >= capacity) {
+        direct = new_data_length - new_data_length % rate;
+        kc_write_all(context, data_ptr, direct);
+        data_ptr += direct;
+        new_data_length -= direct;
+    }
+
+    memcpy(context->staging, data_ptr, new_data_length);
+    context->staged_length = new_data_length;
+}
+
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    ssize_t data_written;
+    int batch;
+
+    kc_flush_staging(context);
+
+    while (iovcnt > 0) {
+        batch = iovcnt < KC_IOV_MAX ? iovcnt : KC_IOV_MAX;
+
+        data_written = writev(context->fd, iov, batch);
+        if (data_written < 0) {
+            // Something bad happened
+            return;
+        }
+
+        // If the write was cut short, send what's left one buffer at a time
+        for (int i = 0; i < batch; i++) {
+            if ((size_t)data_written >= iov[i].iov_len) {
+                data_written -= iov[i].iov_len;
+                continue;
+            }
+
+            kc_write_all(
+                context,
+                (uint8_t const *)iov[i].iov_base + data_written,
+                iov[i].iov_len - data_written
+            );
+            data_written = 0;
+        }
+
+        iov += batch;
+        iovcnt -= batch;
+    }
+}
+
+// Moves the contents of a pipe into the device without copying them to user space
+static kc_error kc_splice_pipe(kc_sha3_context *context, int fd, uint64_t length) {
+    uint64_t remaining = length;
+    ssize_t moved;
+
+    while (length == 0 || remaining > 0) {
+        size_t to_move = KC_SPLICE_CHUNK;
+        if (length != 0 && remaining < to_move) {
+            to_move = remaining;
+        }
+
+        moved = splice(fd, NULL, context->fd, NULL, to_move, SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBADF || errno == EINVAL) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        // Write end closed
+        if (moved == 0) {
+            break;
+        }
+
+        remaining -= moved;
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    struct kc_hash_file request = {0};
+    struct stat file_stat;
+
+    kc_flush_staging(context);
+
+    if (fstat(fd, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode)) {
+        // Pipes can only be read in order
+        if (offset != 0) {
+            return KC_ERR_INVALID_ARGUMENT;
+        }
+        return kc_splice_pipe(context, fd, length);
+    }
+
+    request.fd = fd;
+    request.offset = offset;
+    request.length = length;
+
+    while (ioctl(context->fd, RW_PERIPH_HASH_FILE, &request) != 0) {
+        if (errno != EINTR) {
+            if (errno == EBADF || errno == EINVAL || errno == ESPIPE) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        // Interrupted by a signal, pick up from where the driver stopped
+        request.offset += request.hashed;
+        if (request.length != 0) {
+            request.length -= request.hashed;
+            if (request.length == 0) {
+                break;
+            }
+        }
+    }
+
+    return KC_ERR_NONE;
+}
+
 void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
     ssize_t remaining_data = context->digest_length;
     ssize_t data_read;
 
     uint8_t *digest_ptr = digest;
 
+    kc_flush_staging(context);
+
     while (remaining_data > 0) {
         data_read = read(context->fd, digest_ptr, remaining_data);
         if (data_read < 0) {
-            // Something bad happened
-            // TODO: Check if this is actually realistic, 
-            //       and if it is change the function signature
+            // Something bad happened, a digest_length of 0 says so
+            *digest_length = 0;
             return;
         }
         remaining_data -= data_read;
@@ -123,3 +577,201 @@ kc_error kc_sha3_close(kc_sha3_context *context) {
 
     return KC_ERR_NONE;
 }
+
+#endif
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority) {
+    uint32_t command = priority;
+
+    if (ioctl(context->fd, WR_PERIPH_PRIORITY, &command) != 0) {
+        return errno == EINVAL ? KC_ERR_INVALID_ARGUMENT : KC_ERR_OTHER;
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    struct kc_nonce_search search = {0};
+
+    if (header_length == 0 || header_length > KC_NONCE_MAX_HEADER_SIZE) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    memcpy(search.header, header, header_length);
+    search.header_length = header_length;
+    search.nonce_offset  = nonce_offset;
+    search.nonce_width   = nonce_width;
+    search.nonce_start   = nonce_start;
+    search.max_attempts  = max_attempts;
+    search.target_high   = target >> 32;
+    search.target_low    = target & 0xFFFFFFFF;
+
+    if (ioctl(context->fd, RW_PERIPH_NONCE_SEARCH, &search) != 0) {
+        if (errno == EINVAL) {
+            return KC_ERR_INVALID_ARGUMENT;
+        }
+        // A message is half written to the peripheral
+        if (errno == EBUSY) {
+            return KC_ERR_BUSY;
+        }
+        return KC_ERR_OTHER;
+    }
+
+    *attempts = search.attempts;
+    if (!search.found) {
+        return KC_ERR_NOT_FOUND;
+    }
+
+    *nonce = search.nonce;
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size) {
+    struct kc_ring_setup setup = {0};
+    kc_error error;
+    void *region;
+
+    if (entries == 0 || entries > KC_RING_MAX_ENTRIES || (entries & (entries - 1)) != 0
+        || arena_size == 0 || arena_size > KC_RING_MAX_ARENA) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    int fd = open(KC_DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        if (errno == EBUSY) {
+            return KC_ERR_BUSY;
+        }
+        return KC_ERR_OTHER;
+    }
+
+    setup.entries = entries;
+    setup.arena_size = arena_size;
+    if (ioctl(fd, RW_PERIPH_RING_SETUP, &setup) != 0) {
+        error = errno == EINVAL ? KC_ERR_INVALID_ARGUMENT : KC_ERR_OTHER;
+        close(fd);
+        return error;
+    }
+
+    region = mmap(NULL, setup.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        close(fd);
+        return KC_ERR_OTHER;
+    }
+
+    ring->fd = fd;
+    ring->region = region;
+    ring->region_size = setup.mmap_size;
+    ring->header = region;
+    ring->sqes = (uint8_t *)region + setup.sq_offset;
+    ring->cqes = (uint8_t *)region + setup.cq_offset;
+    ring->arena = (uint8_t *)region + setup.arena_offset;
+    ring->entries = entries;
+    ring->arena_size = arena_size;
+
+    return KC_ERR_NONE;
+}
+
+uint8_t *kc_ring_arena(kc_ring *ring) {
+    return ring->arena;
+}
+
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    struct kc_ring_header *header = ring->header;
+    struct kc_ring_sqe *sqe;
+    uint32_t dev_digest_setting;
+    // Only we write the tail, while the driver moves the head
+    uint32_t tail = header->sq_tail;
+
+    switch (hash_size) {
+        case 512:
+            dev_digest_setting = KC_DIGEST_512;
+            break;
+        case 384:
+            dev_digest_setting = KC_DIGEST_384;
+            break;
+        case 256:
+            dev_digest_setting = KC_DIGEST_256;
+            break;
+        case 224:
+            dev_digest_setting = KC_DIGEST_224;
+            break;
+        default:
+            return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    if ((uint64_t)offset + length > ring->arena_size) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    if (tail - __atomic_load_n(&header->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+        return KC_ERR_BUSY;
+    }
+
+    sqe = &((struct kc_ring_sqe *)ring->sqes)[tail & (ring->entries - 1)];
+    sqe->user_data = user_data;
+    sqe->offset = offset;
+    sqe->length = length;
+    sqe->hash_size = dev_digest_setting;
+
+    // Publish the entry only once it's complete
+    __atomic_store_n(&header->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete) {
+    while (ioctl(ring->fd, WR_PERIPH_RING_ENTER, &min_complete) != 0) {
+        if (errno != EINTR) {
+            return errno == EINVAL ? KC_ERR_INVALID_ARGUMENT : KC_ERR_OTHER;
+        }
+    }
+
+    return KC_ERR_NONE;
+}
+
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    struct kc_ring_header *header = ring->header;
+    struct kc_ring_cqe *cqe;
+    uint32_t head = header->cq_head;
+    uint32_t tail = __atomic_load_n(&header->cq_tail, __ATOMIC_ACQUIRE);
+    uint32_t reaped = 0;
+
+    while (head != tail && reaped < max_completions) {
+        cqe = &((struct kc_ring_cqe *)ring->cqes)[head & (ring->entries - 1)];
+
+        completions[reaped].user_data = cqe->user_data;
+        if (cqe->result == 0) {
+            completions[reaped].error = KC_ERR_NONE;
+        } else if (cqe->result == -EINVAL) {
+            completions[reaped].error = KC_ERR_INVALID_ARGUMENT;
+        } else {
+            completions[reaped].error = KC_ERR_OTHER;
+        }
+        completions[reaped].digest_length = cqe->digest_length;
+        memcpy(completions[reaped].digest, cqe->digest, cqe->digest_length);
+
+        head++;
+        reaped++;
+    }
+
+    // Hand the slots back to the driver
+    __atomic_store_n(&header->cq_head, head, __ATOMIC_RELEASE);
+
+    return reaped;
+}
+
+kc_error kc_ring_close(kc_ring *ring) {
+    munmap(ring->region, ring->region_size);
+
+    if (close(ring->fd) < 0) {
+        return KC_ERR_OTHER;
+    }
+
+    return KC_ERR_NONE;
+}
@@ -0,0 +1,592 @@
+// For splice() in the device backend
+#define _GNU_SOURCE
+
+#include "../include/ketchup_lib.h"
+
+#include <openssl/evp.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if KETCHUP_LIB_MODE != KETCHUP_LIB_MODE_HYBRID
+// TODO: Print a better error message
+#error "INVALID LIB MODE"
+#endif
+
+// The device half of this backend is the hardware backend itself. Its
+// functions are renamed, so that the ones below can route to them.
+#define kc_sha3_512_init     kc_device_512_init
+#define kc_sha3_384_init     kc_device_384_init
+#define kc_sha3_256_init     kc_device_256_init
+#define kc_sha3_224_init     kc_device_224_init
+#define kc_sha3_update       kc_device_update
+#define kc_sha3_updatev      kc_device_updatev
+#define kc_sha3_file         kc_device_file
+#define kc_sha3_final        kc_device_final
+#define kc_sha3_close        kc_device_close
+#define kc_sha3_set_priority kc_device_set_priority
+#define kc_sha3_nonce_search kc_device_nonce_search
+#define kc_ring_init         kc_device_ring_init
+#define kc_ring_arena        kc_device_ring_arena
+#define kc_ring_submit       kc_device_ring_submit
+#define kc_ring_wait         kc_device_ring_wait
+#define kc_ring_reap         kc_device_ring_reap
+#define kc_ring_close        kc_device_ring_close
+
+#include "ketchup_lib_hardware.c"
+
+#undef kc_sha3_512_init
+#undef kc_sha3_384_init
+#undef kc_sha3_256_init
+#undef kc_sha3_224_init
+#undef kc_sha3_update
+#undef kc_sha3_updatev
+#undef kc_sha3_file
+#undef kc_sha3_final
+#undef kc_sha3_close
+#undef kc_sha3_set_priority
+#undef kc_sha3_nonce_search
+#undef kc_ring_init
+#undef kc_ring_arena
+#undef kc_ring_submit
+#undef kc_ring_wait
+#undef kc_ring_reap
+#undef kc_ring_close
+
+// Longest message that can be hashed in software, and so the biggest buffer of a context
+#define KC_HYBRID_MAX_THRESHOLD (64 * 1024)
+
+// Messages of each size hashed both ways while calibrating, the fastest of them counts
+#define KC_HYBRID_ROUNDS 16
+
+// Sets the threshold, skipping the calibration
+#define KC_HYBRID_ENV "KETCHUP_HYBRID_THRESHOLD"
+#define KC_HYBRID_CACHE_FILE "ketchup_hybrid_threshold"
+
+// Chunk size used to read files in software
+#define KC_HYBRID_FILE_CHUNK (16 * 1024)
+
+// A submission of the OpenSSL ring
+struct kc_ring_request_s {
+    uint64_t user_data;
+    uint32_t offset;
+    uint32_t length;
+    EVP_MD const *algorithm;
+};
+
+typedef enum kc_route_e {
+    // Still short enough for software, kept in the buffer
+    KC_ROUTE_BUFFER,
+    KC_ROUTE_DEVICE,
+    // Too long for the buffer, but the device couldn't be opened
+    KC_ROUTE_SOFTWARE
+} kc_route;
+
+static pthread_once_t kc_hybrid_once = PTHREAD_ONCE_INIT;
+static uint32_t kc_hybrid_crossover;
+
+static uint64_t kc_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Hashes messages of growing sizes with the device and with OpenSSL, and returns
+// the longest one where OpenSSL was still faster. Sets measured to 0 if there's no device.
+static uint32_t kc_hybrid_calibrate(int *measured) {
+    kc_sha3_context device;
+    uint8_t digest[KC_MAX_MD_SIZE];
+    uint32_t digest_length, threshold = 0;
+    uint64_t start, elapsed, hardware, software;
+    uint8_t *data;
+
+    *measured = 0;
+    if (kc_device_256_init(&device) != KC_ERR_NONE) {
+        return KC_HYBRID_MAX_THRESHOLD;
+    }
+
+    data = calloc(KC_HYBRID_MAX_THRESHOLD, 1);
+    if (data == NULL) {
+        kc_device_close(&device);
+        return KC_HYBRID_MAX_THRESHOLD;
+    }
+
+    for (uint32_t size = 64; size <= KC_HYBRID_MAX_THRESHOLD; size *= 2) {
+        hardware = UINT64_MAX;
+        software = UINT64_MAX;
+
+        for (int round = 0; round < KC_HYBRID_ROUNDS; round++) {
+            start = kc_now_ns();
+            kc_device_update(&device, data, size);
+            kc_device_final(&device, digest, &digest_length);
+            elapsed = kc_now_ns() - start;
+            if (elapsed < hardware) {
+                hardware = elapsed;
+            }
+
+            start = kc_now_ns();
+            EVP_Digest(data, size, digest, NULL, EVP_sha3_256(), NULL);
+            elapsed = kc_now_ns() - start;
+            if (elapsed < software) {
+                software = elapsed;
+            }
+        }
+
+        // Past this point the device only gets further ahead
+        if (hardware < software) {
+            break;
+        }
+        threshold = size;
+    }
+
+    free(data);
+    kc_device_close(&device);
+
+    *measured = 1;
+    return threshold;
+}
+
+// Where the threshold is cached between runs, following the XDG base directories
+static FILE *kc_hybrid_cache_open(char const *mode) {
+    char path[4096];
+    char const *cache = getenv("XDG_CACHE_HOME");
+    char const *home = getenv("HOME");
+
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/" KC_HYBRID_CACHE_FILE, cache);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/.cache/" KC_HYBRID_CACHE_FILE, home);
+    } else {
+        return NULL;
+    }
+
+    return fopen(path, mode);
+}
+
+static void kc_hybrid_setup(void) {
+    char const *forced = getenv(KC_HYBRID_ENV);
+    unsigned long threshold;
+    int measured;
+    FILE *cache;
+
+    if (forced != NULL && forced[0] != '\0') {
+        threshold = strtoul(forced, NULL, 0);
+        kc_hybrid_crossover = threshold < KC_HYBRID_MAX_THRESHOLD ? threshold : KC_HYBRID_MAX_THRESHOLD;
+        return;
+    }
+
+    cache = kc_hybrid_cache_open("r");
+    if (cache != NULL) {
+        if (fscanf(cache, "%lu", &threshold) == 1 && threshold <= KC_HYBRID_MAX_THRESHOLD) {
+            kc_hybrid_crossover = threshold;
+            fclose(cache);
+            return;
+        }
+        fclose(cache);
+    }
+
+    kc_hybrid_crossover = kc_hybrid_calibrate(&measured);
+
+    // Without the device there was nothing to measure, so it's
+    // measured again next time in case the device shows up
+    if (measured) {
+        cache = kc_hybrid_cache_open("w");
+        if (cache != NULL) {
+            fprintf(cache, "%u\n", kc_hybrid_crossover);
+            fclose(cache);
+        }
+    }
+}
+
+uint32_t kc_hybrid_threshold(void) {
+    pthread_once(&kc_hybrid_once, kc_hybrid_setup);
+    return kc_hybrid_crossover;
+}
+
+static kc_error kc_hybrid_init(kc_sha3_context *context, EVP_MD const *algorithm, uint32_t digest_length) {
+    context->fd = -1;
+    context->digest_length = digest_length;
+    context->algorithm = algorithm;
+    context->openssl_context = NULL;
+    context->priority = -1;
+    context->route = KC_ROUTE_BUFFER;
+    context->buffer_length = 0;
+    context->threshold = kc_hybrid_threshold();
+    context->buffer = NULL;
+
+    if (context->threshold > 0) {
+        context->buffer = malloc(context->threshold);
+        if (context->buffer == NULL) {
+            return KC_ERR_OTHER;
+        }
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_512_init(kc_sha3_context *context) {
+    return kc_hybrid_init(context, EVP_sha3_512(), 512/8);
+}
+
+kc_error kc_sha3_384_init(kc_sha3_context *context) {
+    return kc_hybrid_init(context, EVP_sha3_384(), 384/8);
+}
+
+kc_error kc_sha3_256_init(kc_sha3_context *context) {
+    return kc_hybrid_init(context, EVP_sha3_256(), 256/8);
+}
+
+kc_error kc_sha3_224_init(kc_sha3_context *context) {
+    return kc_hybrid_init(context, EVP_sha3_224(), 224/8);
+}
+
+// Opens the device the first time a message needs it, then it stays open
+static kc_error kc_hybrid_open_device(kc_sha3_context *context) {
+    kc_error error;
+
+    if (context->fd >= 0) {
+        return KC_ERR_NONE;
+    }
+
+    switch (context->digest_length) {
+        case 512/8:
+            error = kc_device_512_init(context);
+            break;
+        case 384/8:
+            error = kc_device_384_init(context);
+            break;
+        case 256/8:
+            error = kc_device_256_init(context);
+            break;
+        default:
+            error = kc_device_224_init(context);
+            break;
+    }
+    if (error != KC_ERR_NONE) {
+        context->fd = -1;
+        return error;
+    }
+
+    if (context->priority >= 0) {
+        kc_device_set_priority(context, context->priority);
+    }
+
+    return KC_ERR_NONE;
+}
+
+// The message got too long for the buffer: it goes on in the
+// device, or in software if the device can't be opened
+static void kc_hybrid_spill(kc_sha3_context *context) {
+    if (kc_hybrid_open_device(context) == KC_ERR_NONE) {
+        context->route = KC_ROUTE_DEVICE;
+        kc_device_update(context, context->buffer, context->buffer_length);
+    } else {
+        if (context->openssl_context == NULL) {
+            context->openssl_context = EVP_MD_CTX_new();
+        }
+        context->route = KC_ROUTE_SOFTWARE;
+        EVP_DigestInit_ex(context->openssl_context, context->algorithm, NULL);
+        EVP_DigestUpdate(context->openssl_context, context->buffer, context->buffer_length);
+    }
+
+    context->buffer_length = 0;
+}
+
+void kc_sha3_update(kc_sha3_context *context, void const *new_data, uint32_t new_data_length) {
+    if (new_data_length == 0) {
+        return;
+    }
+
+    if (context->route == KC_ROUTE_BUFFER) {
+        if (new_data_length <= context->threshold - context->buffer_length) {
+            memcpy(context->buffer + context->buffer_length, new_data, new_data_length);
+            context->buffer_length += new_data_length;
+            return;
+        }
+        kc_hybrid_spill(context);
+    }
+
+    if (context->route == KC_ROUTE_DEVICE) {
+        kc_device_update(context, new_data, new_data_length);
+    } else {
+        EVP_DigestUpdate(context->openssl_context, new_data, new_data_length);
+    }
+}
+
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        // Once the message is in the device, the rest goes in a single writev
+        if (context->route == KC_ROUTE_DEVICE) {
+            kc_device_updatev(context, iov + i, iovcnt - i);
+            return;
+        }
+        kc_sha3_update(context, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    uint8_t buffer[KC_HYBRID_FILE_CHUNK];
+    struct stat file_stat;
+    uint64_t remaining = length;
+    ssize_t got;
+    int is_pipe;
+
+    // Files are seldom short, and the driver reads them without copies
+    if (context->route == KC_ROUTE_BUFFER) {
+        kc_hybrid_spill(context);
+    }
+    if (context->route == KC_ROUTE_DEVICE) {
+        return kc_device_file(context, fd, offset, length);
+    }
+
+    // Same as the MMIO backend, without a device
+    is_pipe = fstat(fd, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode);
+    if (is_pipe && offset != 0) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    while (length == 0 || remaining > 0) {
+        size_t to_read = KC_HYBRID_FILE_CHUNK;
+        if (length != 0 && remaining < to_read) {
+            to_read = remaining;
+        }
+
+        got = is_pipe ? read(fd, buffer, to_read) : pread(fd, buffer, to_read, offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBADF || errno == EINVAL || errno == ESPIPE) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        // End of file
+        if (got == 0) {
+            break;
+        }
+
+        EVP_DigestUpdate(context->openssl_context, buffer, got);
+        offset += got;
+        remaining -= got;
+    }
+
+    return KC_ERR_NONE;
+}
+
+void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
+    unsigned int length = 0;
+
+    switch (context->route) {
+        case KC_ROUTE_BUFFER:
+            EVP_Digest(context->buffer, context->buffer_length, digest, &length, context->algorithm, NULL);
+            *digest_length = length;
+            break;
+        case KC_ROUTE_DEVICE:
+            kc_device_final(context, digest, digest_length);
+            break;
+        default:
+            EVP_DigestFinal_ex(context->openssl_context, digest, &length);
+            *digest_length = length;
+            break;
+    }
+
+    // The next message starts in the buffer again, but the device stays open for it
+    context->route = KC_ROUTE_BUFFER;
+    context->buffer_length = 0;
+}
+
+kc_error kc_sha3_close(kc_sha3_context *context) {
+    free(context->buffer);
+    EVP_MD_CTX_free(context->openssl_context);
+
+    if (context->fd >= 0) {
+        return kc_device_close(context);
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority) {
+    if (priority > KC_PRIORITY_BULK && priority != KC_PRIORITY_AUTO) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    // Only matters once the device is open
+    context->priority = priority;
+    if (context->fd >= 0) {
+        return kc_device_set_priority(context, priority);
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    // The search runs inside the peripheral, whatever the size of the header
+    kc_error error = kc_hybrid_open_device(context);
+    if (error != KC_ERR_NONE) {
+        return error;
+    }
+
+    return kc_device_nonce_search(
+        context, header, header_length, nonce_offset, nonce_width,
+        nonce_start, max_attempts, target, nonce, attempts
+    );
+}
+
+static kc_error kc_hybrid_ring_free(kc_ring *ring) {
+    free(ring->arena);
+    free(ring->requests);
+    free(ring->completions);
+    ring->arena = NULL;
+    ring->requests = NULL;
+    ring->completions = NULL;
+
+    return KC_ERR_NONE;
+}
+
+// The ring of the driver if the device can be opened, otherwise
+// everything is hashed with OpenSSL in kc_ring_wait
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size) {
+    kc_error error = kc_device_ring_init(ring, entries, arena_size);
+    if (error == KC_ERR_NONE || error == KC_ERR_INVALID_ARGUMENT) {
+        return error;
+    }
+
+    ring->fd = -1;
+    ring->arena = calloc(arena_size, 1);
+    ring->requests = calloc(entries, sizeof(struct kc_ring_request_s));
+    ring->completions = calloc(entries, sizeof(struct kc_ring_completion_s));
+    if (ring->arena == NULL || ring->requests == NULL || ring->completions == NULL) {
+        kc_hybrid_ring_free(ring);
+        return KC_ERR_OTHER;
+    }
+
+    ring->entries = entries;
+    ring->arena_size = arena_size;
+    ring->sq_head = ring->sq_tail = 0;
+    ring->cq_head = ring->cq_tail = 0;
+
+    return KC_ERR_NONE;
+}
+
+uint8_t *kc_ring_arena(kc_ring *ring) {
+    return ring->arena;
+}
+
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    struct kc_ring_request_s *request;
+    EVP_MD const *algorithm;
+
+    if (ring->fd >= 0) {
+        return kc_device_ring_submit(ring, offset, length, hash_size, user_data);
+    }
+
+    switch (hash_size) {
+        case 512:
+            algorithm = EVP_sha3_512();
+            break;
+        case 384:
+            algorithm = EVP_sha3_384();
+            break;
+        case 256:
+            algorithm = EVP_sha3_256();
+            break;
+        case 224:
+            algorithm = EVP_sha3_224();
+            break;
+        default:
+            return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    if ((uint64_t)offset + length > ring->arena_size) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    if (ring->sq_tail - ring->sq_head >= ring->entries) {
+        return KC_ERR_BUSY;
+    }
+
+    request = &ring->requests[ring->sq_tail & (ring->entries - 1)];
+    request->user_data = user_data;
+    request->offset = offset;
+    request->length = length;
+    request->algorithm = algorithm;
+    ring->sq_tail++;
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete) {
+    struct kc_ring_request_s *request;
+    struct kc_ring_completion_s *completion;
+    unsigned int digest_length;
+
+    if (ring->fd >= 0) {
+        return kc_device_ring_wait(ring, min_complete);
+    }
+
+    if (min_complete > ring->entries) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    // Like the driver, only take a submission if there's room for its completion
+    while (ring->sq_head != ring->sq_tail && ring->cq_tail - ring->cq_head < ring->entries) {
+        request = &ring->requests[ring->sq_head & (ring->entries - 1)];
+        completion = &ring->completions[ring->cq_tail & (ring->entries - 1)];
+
+        EVP_Digest(
+            ring->arena + request->offset, request->length,
+            completion->digest, &digest_length,
+            request->algorithm, NULL
+        );
+        completion->user_data = request->user_data;
+        completion->error = KC_ERR_NONE;
+        completion->digest_length = digest_length;
+
+        ring->sq_head++;
+        ring->cq_tail++;
+    }
+
+    return KC_ERR_NONE;
+}
+
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    uint32_t reaped = 0;
+
+    if (ring->fd >= 0) {
+        return kc_device_ring_reap(ring, completions, max_completions);
+    }
+
+    while (ring->cq_head != ring->cq_tail && reaped < max_completions) {
+        completions[reaped] = ring->completions[ring->cq_head & (ring->entries - 1)];
+        ring->cq_head++;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+kc_error kc_ring_close(kc_ring *ring) {
+    if (ring->fd >= 0) {
+        return kc_device_ring_close(ring);
+    }
+
+    return kc_hybrid_ring_free(ring);
+}
@@ -0,0 +1,190 @@
+#include "ketchup_lib_backend.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// A backend for testing programs without a peripheral nor OpenSSL. Its digest
+// isn't a hash: it's the message XORed onto itself every digest_length bytes,
+// with the length of the message XORed onto the first 8 bytes. Whoever knows
+// the message can then check what reached the backend, and in which order.
+
+#define KC_MOCK_FILE_CHUNK (4 * 1024)
+
+struct kc_mock_context {
+    uint32_t digest_length;
+    uint64_t message_length;
+    uint8_t fold[KC_MAX_MD_SIZE];
+};
+
+static int kc_mock_available(void) {
+    // Only used when asked for by name
+    return 0;
+}
+
+static kc_error kc_mock_init(void *context, uint32_t hash_size) {
+    struct kc_mock_context *mock = context;
+
+    if (hash_size != 512 && hash_size != 384 && hash_size != 256 && hash_size != 224) {
+        return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    mock->digest_length = hash_size / 8;
+    mock->message_length = 0;
+    memset(mock->fold, 0, sizeof(mock->fold));
+
+    return KC_ERR_NONE;
+}
+
+static void kc_mock_update(void *context, void const *new_data, uint32_t new_data_length) {
+    struct kc_mock_context *mock = context;
+    uint8_t const *data = new_data;
+
+    for (uint32_t i = 0; i < new_data_length; i++) {
+        mock->fold[mock->message_length % mock->digest_length] ^= data[i];
+        mock->message_length++;
+    }
+}
+
+static void kc_mock_updatev(void *context, struct iovec const *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        kc_mock_update(context, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+static kc_error kc_mock_file(void *context, int fd, uint64_t offset, uint64_t length) {
+    uint8_t buffer[KC_MOCK_FILE_CHUNK];
+    struct stat file_stat;
+    uint64_t remaining = length;
+    ssize_t got;
+    int is_pipe;
+
+    is_pipe = fstat(fd, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode);
+    if (is_pipe && offset != 0) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    while (length == 0 || remaining > 0) {
+        size_t to_read = KC_MOCK_FILE_CHUNK;
+        if (length != 0 && remaining < to_read) {
+            to_read = remaining;
+        }
+
+        got = is_pipe ? read(fd, buffer, to_read) : pread(fd, buffer, to_read, offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBADF || errno == EINVAL || errno == ESPIPE) {
+                return KC_ERR_INVALID_ARGUMENT;
+            }
+            return KC_ERR_OTHER;
+        }
+
+        // End of file
+        if (got == 0) {
+            break;
+        }
+
+        kc_mock_update(context, buffer, got);
+        offset += got;
+        remaining -= got;
+    }
+
+    return KC_ERR_NONE;
+}
+
+static void kc_mock_final(void *context, uint8_t *digest, uint32_t *digest_length) {
+    struct kc_mock_context *mock = context;
+
+    memcpy(digest, mock->fold, mock->digest_length);
+    for (int i = 0; i < 8; i++) {
+        digest[i] ^= mock->message_length >> (8 * (7 - i));
+    }
+    *digest_length = mock->digest_length;
+
+    kc_mock_init(mock, mock->digest_length * 8);
+}
+
+static kc_error kc_mock_close(void *context) {
+    return KC_ERR_NONE;
+}
+
+static kc_error kc_mock_set_priority(void *context, kc_priority priority) {
+    // Same contract as the other backends
+    if (priority > KC_PRIORITY_BULK && priority != KC_PRIORITY_AUTO) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    return KC_ERR_NONE;
+}
+
+static kc_error kc_mock_nonce_search(
+    void *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    uint8_t message[KC_NONCE_MAX_HEADER_SIZE];
+    uint8_t digest[KC_MAX_MD_SIZE];
+    uint32_t digest_length;
+    uint32_t current_nonce = nonce_start;
+    uint32_t attempt_count = 0;
+    uint64_t leading;
+
+    // Same constraints as the peripheral
+    if (header_length == 0 || header_length > KC_NONCE_MAX_HEADER_SIZE
+        || nonce_width < 1 || nonce_width > 4
+        || nonce_offset % 4 != 0
+        || nonce_offset > header_length || nonce_width > header_length - nonce_offset) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    memcpy(message, header, header_length);
+
+    do {
+        for (uint32_t i = 0; i < nonce_width; i++) {
+            message[nonce_offset + i] = current_nonce >> (8 * (nonce_width - 1 - i));
+        }
+
+        kc_mock_update(context, message, header_length);
+        kc_mock_final(context, digest, &digest_length);
+        attempt_count++;
+
+        leading = 0;
+        for (int i = 0; i < 8; i++) {
+            leading = (leading << 8) | digest[i];
+        }
+
+        if (leading < target) {
+            *nonce = current_nonce;
+            *attempts = attempt_count;
+            return KC_ERR_NONE;
+        }
+
+        current_nonce++;
+    } while (max_attempts == 0 || attempt_count < max_attempts);
+
+    *attempts = attempt_count;
+    return KC_ERR_NOT_FOUND;
+}
+
+struct kc_backend_s const kc_mock_backend = {
+    .name = "mock",
+    .available = kc_mock_available,
+
+    .context_size = sizeof(struct kc_mock_context),
+    .init = kc_mock_init,
+    .update = kc_mock_update,
+    .updatev = kc_mock_updatev,
+    .file = kc_mock_file,
+    .final = kc_mock_final,
+    .close = kc_mock_close,
+    .set_priority = kc_mock_set_priority,
+    .nonce_search = kc_mock_nonce_search,
+
+    // No rings
+    .ring_init = NULL,
+};
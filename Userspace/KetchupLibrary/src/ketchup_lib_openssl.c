@@ -1,9 +1,20 @@
 #include "../include/ketchup_lib.h"
+#include "ketchup_lib_file.h"
 
 #include <openssl/evp.h>
 #include <openssl/evperr.h>
 #include <openssl/types.h>
 
+#include <string.h>
+#include <stdlib.h>
+
+struct kc_ring_request_s {
+    uint64_t user_data;
+    uint32_t offset;
+    uint32_t length;
+    EVP_MD const *algorithm;
+};
+
 #if KETCHUP_LIB_MODE != KETCHUP_LIB_MODE_OPENSSL 
 // TODO: Print a better error message
 #error "INVALID LIB MODE"
@@ -53,6 +64,19 @@ void kc_sha3_update(kc_sha3_context *context, void const *new_data, uint32_t new
     EVP_DigestUpdate(context->openssl_context, new_data, new_data_length);
 }
 
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        EVP_DigestUpdate(context->openssl_context, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+static void kc_openssl_absorb(void *context, uint8_t const *data, size_t length) {
+    EVP_DigestUpdate(((kc_sha3_context *)context)->openssl_context, data, length);
+}
+
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    return kc_file_absorb(context, kc_openssl_absorb, fd, offset, length);
+}
 
 void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
     EVP_DigestFinal(context->openssl_context, digest, digest_length);
@@ -63,4 +87,185 @@ kc_error kc_sha3_close(kc_sha3_context *context) {
     EVP_MD_CTX_free(context->openssl_context);
 
     return KC_ERR_NONE;
-}
\ No newline at end of file
+}
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority) {
+    // Nothing to wait for, but keep the same contract as the hardware
+    if (priority > KC_PRIORITY_BULK && priority != KC_PRIORITY_AUTO) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    uint8_t message[KC_NONCE_MAX_HEADER_SIZE];
+    uint8_t digest[KC_MAX_MD_SIZE];
+    uint32_t current_nonce = nonce_start;
+    uint32_t attempt_count = 0;
+    uint64_t leading;
+
+    // Same constraints as the peripheral
+    if (header_length == 0 || header_length > KC_NONCE_MAX_HEADER_SIZE
+        || nonce_width < 1 || nonce_width > 4
+        || nonce_offset % 4 != 0
+        || nonce_offset > header_length || nonce_width > header_length - nonce_offset) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    memcpy(message, header, header_length);
+
+    do {
+        // Write the nonce big endian, truncated to its width
+        for (uint32_t i = 0; i < nonce_width; i++) {
+            message[nonce_offset + i] = current_nonce >> (8 * (nonce_width - 1 - i));
+        }
+
+        EVP_DigestInit(context->openssl_context, context->algorithm);
+        EVP_DigestUpdate(context->openssl_context, message, header_length);
+        EVP_DigestFinal(context->openssl_context, digest, NULL);
+        attempt_count++;
+
+        leading = 0;
+        for (int i = 0; i < 8; i++) {
+            leading = (leading << 8) | digest[i];
+        }
+
+        if (leading < target) {
+            EVP_DigestInit(context->openssl_context, context->algorithm);
+            *nonce = current_nonce;
+            *attempts = attempt_count;
+            return KC_ERR_NONE;
+        }
+
+        current_nonce++;
+    } while (max_attempts == 0 || attempt_count < max_attempts);
+
+    EVP_DigestInit(context->openssl_context, context->algorithm);
+    *attempts = attempt_count;
+    return KC_ERR_NOT_FOUND;
+}
+
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size) {
+    if (entries == 0 || entries > KC_RING_MAX_ENTRIES || (entries & (entries - 1)) != 0
+        || arena_size == 0 || arena_size > KC_RING_MAX_ARENA) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    ring->arena = calloc(arena_size, 1);
+    ring->requests = calloc(entries, sizeof(struct kc_ring_request_s));
+    ring->completions = calloc(entries, sizeof(struct kc_ring_completion_s));
+    if (ring->arena == NULL || ring->requests == NULL || ring->completions == NULL) {
+        kc_ring_close(ring);
+        return KC_ERR_OTHER;
+    }
+
+    ring->entries = entries;
+    ring->arena_size = arena_size;
+    ring->sq_head = ring->sq_tail = 0;
+    ring->cq_head = ring->cq_tail = 0;
+
+    return KC_ERR_NONE;
+}
+
+uint8_t *kc_ring_arena(kc_ring *ring) {
+    return ring->arena;
+}
+
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    struct kc_ring_request_s *request;
+    EVP_MD const *algorithm;
+
+    switch (hash_size) {
+        case 512:
+            algorithm = EVP_sha3_512();
+            break;
+        case 384:
+            algorithm = EVP_sha3_384();
+            break;
+        case 256:
+            algorithm = EVP_sha3_256();
+            break;
+        case 224:
+            algorithm = EVP_sha3_224();
+            break;
+        default:
+            return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    if ((uint64_t)offset + length > ring->arena_size) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    if (ring->sq_tail - ring->sq_head >= ring->entries) {
+        return KC_ERR_BUSY;
+    }
+
+    request = &ring->requests[ring->sq_tail & (ring->entries - 1)];
+    request->user_data = user_data;
+    request->offset = offset;
+    request->length = length;
+    request->algorithm = algorithm;
+    ring->sq_tail++;
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete) {
+    struct kc_ring_request_s *request;
+    struct kc_ring_completion_s *completion;
+    unsigned int digest_length;
+
+    if (min_complete > ring->entries) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    // Like the driver, only take a submission if there's room for its completion
+    while (ring->sq_head != ring->sq_tail && ring->cq_tail - ring->cq_head < ring->entries) {
+        request = &ring->requests[ring->sq_head & (ring->entries - 1)];
+        completion = &ring->completions[ring->cq_tail & (ring->entries - 1)];
+
+        EVP_Digest(
+            ring->arena + request->offset, request->length,
+            completion->digest, &digest_length,
+            request->algorithm, NULL
+        );
+        completion->user_data = request->user_data;
+        completion->error = KC_ERR_NONE;
+        completion->digest_length = digest_length;
+
+        ring->sq_head++;
+        ring->cq_tail++;
+    }
+
+    return KC_ERR_NONE;
+}
+
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    uint32_t reaped = 0;
+
+    while (ring->cq_head != ring->cq_tail && reaped < max_completions) {
+        completions[reaped] = ring->completions[ring->cq_head & (ring->entries - 1)];
+        ring->cq_head++;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+kc_error kc_ring_close(kc_ring *ring) {
+    free(ring->arena);
+    free(ring->requests);
+    free(ring->completions);
+    ring->arena = NULL;
+    ring->requests = NULL;
+    ring->completions = NULL;
+
+    return KC_ERR_NONE;
+}
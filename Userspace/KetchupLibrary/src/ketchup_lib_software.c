@@ -0,0 +1,297 @@
+#include "../include/ketchup_lib.h"
+#include "ketchup_keccak.h"
+#include "ketchup_lib_file.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+struct kc_ring_request_s {
+    uint64_t user_data;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t digest_length;
+};
+
+// Submissions handed to the multi-buffer engine at once by kc_ring_wait
+#define KC_RING_BATCH 256
+
+#if KETCHUP_LIB_MODE != KETCHUP_LIB_MODE_SOFTWARE
+// TODO: Print a better error message
+#error "INVALID LIB MODE"
+#endif
+
+static void kc_software_reset(kc_sha3_context *context) {
+    kc_keccak_init(context->state);
+    context->block_length = 0;
+}
+
+static kc_error kc_software_init(kc_sha3_context *context, uint32_t digest_length) {
+    context->digest_length = digest_length;
+    context->rate = KC_KECCAK_RATE(digest_length);
+    kc_software_reset(context);
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_512_init(kc_sha3_context *context) {
+    return kc_software_init(context, 512/8);
+}
+
+kc_error kc_sha3_384_init(kc_sha3_context *context) {
+    return kc_software_init(context, 384/8);
+}
+
+kc_error kc_sha3_256_init(kc_sha3_context *context) {
+    return kc_software_init(context, 256/8);
+}
+
+kc_error kc_sha3_224_init(kc_sha3_context *context) {
+    return kc_software_init(context, 224/8);
+}
+
+static void kc_software_absorb(kc_sha3_context *context, uint8_t const *data, size_t length) {
+    size_t to_copy, blocks;
+
+    // Finish the block started by the previous updates
+    if (context->block_length > 0) {
+        to_copy = context->rate - context->block_length;
+        if (to_copy > length) {
+            to_copy = length;
+        }
+
+        memcpy(context->block + context->block_length, data, to_copy);
+        context->block_length += to_copy;
+        data += to_copy;
+        length -= to_copy;
+
+        if (context->block_length < context->rate) {
+            return;
+        }
+        kc_keccak_absorb(context->state, context->block, 1, context->rate);
+        context->block_length = 0;
+    }
+
+    // Whole blocks are absorbed straight from the caller's buffer
+    blocks = length / context->rate;
+    if (blocks > 0) {
+        kc_keccak_absorb(context->state, data, blocks, context->rate);
+        data += blocks * context->rate;
+        length -= blocks * context->rate;
+    }
+
+    memcpy(context->block, data, length);
+    context->block_length = length;
+}
+
+void kc_sha3_update(kc_sha3_context *context, void const *new_data, uint32_t new_data_length) {
+    kc_software_absorb(context, new_data, new_data_length);
+}
+
+void kc_sha3_updatev(kc_sha3_context *context, struct iovec const *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        kc_software_absorb(context, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+static void kc_software_absorb_file(void *context, uint8_t const *data, size_t length) {
+    kc_software_absorb(context, data, length);
+}
+
+kc_error kc_sha3_file(kc_sha3_context *context, int fd, uint64_t offset, uint64_t length) {
+    return kc_file_absorb(context, kc_software_absorb_file, fd, offset, length);
+}
+
+void kc_sha3_final(kc_sha3_context *context, uint8_t *digest, uint32_t *digest_length) {
+    // SHA3 padding: the 01 domain bits, then 10*1 up to the end of the block
+    memset(context->block + context->block_length, 0, context->rate - context->block_length);
+    context->block[context->block_length] ^= 0x06;
+    context->block[context->rate - 1] ^= 0x80;
+    kc_keccak_absorb(context->state, context->block, 1, context->rate);
+
+    // The digest is always shorter than the rate, so a single squeeze is enough
+    kc_keccak_extract(context->state, digest, context->digest_length);
+    *digest_length = context->digest_length;
+
+    kc_software_reset(context);
+}
+
+kc_error kc_sha3_close(kc_sha3_context *context) {
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_set_priority(kc_sha3_context *context, kc_priority priority) {
+    // Nothing to wait for, but keep the same contract as the hardware
+    if (priority > KC_PRIORITY_BULK && priority != KC_PRIORITY_AUTO) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_sha3_nonce_search(
+    kc_sha3_context *context,
+    void const *header, uint32_t header_length,
+    uint32_t nonce_offset, uint32_t nonce_width,
+    uint32_t nonce_start, uint32_t max_attempts, uint64_t target,
+    uint32_t *nonce, uint32_t *attempts
+) {
+    uint8_t message[KC_NONCE_MAX_HEADER_SIZE];
+    uint8_t digest[KC_MAX_MD_SIZE];
+    uint32_t digest_length;
+    uint32_t current_nonce = nonce_start;
+    uint32_t attempt_count = 0;
+    uint64_t leading;
+
+    // Same constraints as the peripheral
+    if (header_length == 0 || header_length > KC_NONCE_MAX_HEADER_SIZE
+        || nonce_width < 1 || nonce_width > 4
+        || nonce_offset % 4 != 0
+        || nonce_offset > header_length || nonce_width > header_length - nonce_offset) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    memcpy(message, header, header_length);
+    kc_software_reset(context);
+
+    do {
+        // Write the nonce big endian, truncated to its width
+        for (uint32_t i = 0; i < nonce_width; i++) {
+            message[nonce_offset + i] = current_nonce >> (8 * (nonce_width - 1 - i));
+        }
+
+        kc_software_absorb(context, message, header_length);
+        kc_sha3_final(context, digest, &digest_length);
+        attempt_count++;
+
+        leading = 0;
+        for (int i = 0; i < 8; i++) {
+            leading = (leading << 8) | digest[i];
+        }
+
+        if (leading < target) {
+            *nonce = current_nonce;
+            *attempts = attempt_count;
+            return KC_ERR_NONE;
+        }
+
+        current_nonce++;
+    } while (max_attempts == 0 || attempt_count < max_attempts);
+
+    *attempts = attempt_count;
+    return KC_ERR_NOT_FOUND;
+}
+
+kc_error kc_ring_init(kc_ring *ring, uint32_t entries, uint32_t arena_size) {
+    if (entries == 0 || entries > KC_RING_MAX_ENTRIES || (entries & (entries - 1)) != 0
+        || arena_size == 0 || arena_size > KC_RING_MAX_ARENA) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    ring->arena = calloc(arena_size, 1);
+    ring->requests = calloc(entries, sizeof(struct kc_ring_request_s));
+    ring->completions = calloc(entries, sizeof(struct kc_ring_completion_s));
+    if (ring->arena == NULL || ring->requests == NULL || ring->completions == NULL) {
+        kc_ring_close(ring);
+        return KC_ERR_OTHER;
+    }
+
+    ring->entries = entries;
+    ring->arena_size = arena_size;
+    ring->sq_head = ring->sq_tail = 0;
+    ring->cq_head = ring->cq_tail = 0;
+
+    return KC_ERR_NONE;
+}
+
+uint8_t *kc_ring_arena(kc_ring *ring) {
+    return ring->arena;
+}
+
+kc_error kc_ring_submit(kc_ring *ring, uint32_t offset, uint32_t length, uint32_t hash_size, uint64_t user_data) {
+    struct kc_ring_request_s *request;
+
+    if (hash_size != 512 && hash_size != 384 && hash_size != 256 && hash_size != 224) {
+        return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    if ((uint64_t)offset + length > ring->arena_size) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    if (ring->sq_tail - ring->sq_head >= ring->entries) {
+        return KC_ERR_BUSY;
+    }
+
+    request = &ring->requests[ring->sq_tail & (ring->entries - 1)];
+    request->user_data = user_data;
+    request->offset = offset;
+    request->length = length;
+    request->digest_length = hash_size / 8;
+    ring->sq_tail++;
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_ring_wait(kc_ring *ring, uint32_t min_complete) {
+    struct kc_keccak_job jobs[KC_RING_BATCH];
+    struct kc_ring_request_s *request;
+    struct kc_ring_completion_s *completion;
+    uint32_t count;
+
+    if (min_complete > ring->entries) {
+        return KC_ERR_INVALID_ARGUMENT;
+    }
+
+    // Like the driver, only take a submission if there's room for its completion.
+    // The messages are independent, so they go through the SIMD lanes together.
+    for (;;) {
+        count = 0;
+        while (count < KC_RING_BATCH && ring->sq_head != ring->sq_tail
+               && ring->cq_tail - ring->cq_head < ring->entries) {
+            request = &ring->requests[ring->sq_head & (ring->entries - 1)];
+            completion = &ring->completions[ring->cq_tail & (ring->entries - 1)];
+
+            jobs[count].data = ring->arena + request->offset;
+            jobs[count].length = request->length;
+            jobs[count].digest_length = request->digest_length;
+            jobs[count].digest = completion->digest;
+            completion->user_data = request->user_data;
+            completion->digest_length = request->digest_length;
+            completion->error = KC_ERR_NONE;
+
+            ring->sq_head++;
+            ring->cq_tail++;
+            count++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+        kc_keccak_hash_many(jobs, count);
+    }
+
+    return KC_ERR_NONE;
+}
+
+uint32_t kc_ring_reap(kc_ring *ring, kc_ring_completion *completions, uint32_t max_completions) {
+    uint32_t reaped = 0;
+
+    while (ring->cq_head != ring->cq_tail && reaped < max_completions) {
+        completions[reaped] = ring->completions[ring->cq_head & (ring->entries - 1)];
+        ring->cq_head++;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+kc_error kc_ring_close(kc_ring *ring) {
+    free(ring->arena);
+    free(ring->requests);
+    free(ring->completions);
+    ring->arena = NULL;
+    ring->requests = NULL;
+    ring->completions = NULL;
+
+    return KC_ERR_NONE;
+}
@@ -0,0 +1,100 @@
+#include "../include/ketchup_uring.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <string.h>
+
+#if KETCHUP_LIB_MODE != KETCHUP_LIB_MODE_HARDWARE
+#error "The io_uring interface needs the hardware backend"
+#endif
+
+#define KC_DEVICE_PATH "/dev/ketchup_driver"
+
+// cmd_op of the hash command
+#define KC_URING_CMD_HASH 1
+
+// Same layout as the one in the driver
+struct kc_uring_hash {
+    uint64_t data;
+    uint64_t digest;
+    uint32_t length;
+    uint32_t hash_size;
+};
+
+#define KC_DIGEST_512 0
+#define KC_DIGEST_384 1
+#define KC_DIGEST_256 2
+#define KC_DIGEST_224 3
+
+kc_error kc_uring_open(int *fd) {
+    int new_fd = open(KC_DEVICE_PATH, O_RDWR);
+
+    if (new_fd < 0) {
+        if (errno == EBUSY) {
+            return KC_ERR_BUSY;
+        }
+        return KC_ERR_OTHER;
+    }
+
+    *fd = new_fd;
+    return KC_ERR_NONE;
+}
+
+kc_error kc_uring_close(int fd) {
+    if (close(fd) < 0) {
+        return KC_ERR_OTHER;
+    }
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_uring_prep_hash(
+    struct io_uring_sqe *sqe, int fd,
+    void const *data, uint32_t length,
+    uint32_t hash_size, uint8_t *digest
+) {
+    struct kc_uring_hash command = {0};
+
+    switch (hash_size) {
+        case 512:
+            command.hash_size = KC_DIGEST_512;
+            break;
+        case 384:
+            command.hash_size = KC_DIGEST_384;
+            break;
+        case 256:
+            command.hash_size = KC_DIGEST_256;
+            break;
+        case 224:
+            command.hash_size = KC_DIGEST_224;
+            break;
+        default:
+            return KC_ERR_UNSUPPORTED_SIZE;
+    }
+
+    command.data = (uintptr_t)data;
+    command.digest = (uintptr_t)digest;
+    command.length = length;
+
+    io_uring_prep_rw(IORING_OP_URING_CMD, sqe, fd, NULL, 0, 0);
+    sqe->cmd_op = KC_URING_CMD_HASH;
+    // This has to come last, since the command area overlaps some of the fields set above
+    memcpy(sqe->cmd, &command, sizeof(command));
+
+    return KC_ERR_NONE;
+}
+
+kc_error kc_uring_result(struct io_uring_cqe const *cqe) {
+    switch (cqe->res) {
+        case 0:
+            return KC_ERR_NONE;
+        case -EINVAL:
+            return KC_ERR_INVALID_ARGUMENT;
+        case -EBUSY:
+            return KC_ERR_BUSY;
+        default:
+            return KC_ERR_OTHER;
+    }
+}
@@ -1,15 +1,60 @@
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include <string.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+// Usage:
+//   multiproc [-n]
+//     The demo: 9 processes hash one message each, after holding their fd open for a second.
+//   multiproc -s ITERATIONS [-p PROCS] [-n]
+//     Stress test: PROCS processes (9 by default) hash ITERATIONS messages each as fast
+//     as they can, so they're all fighting for the peripherals. Every message takes and
+//     gives back a peripheral, so this mostly measures how the driver hands them out.
+// -n opens the device in non-blocking mode.
+
 #define PROCS_TO_OPEN 9
+#define MAX_PROCS 256
 #define BUFSIZE 512
 #define DEVICE_LOCATION "/dev/ketchup_driver"
+#define BINDING_STATS "/sys/class/keccak_accelerators/ketchup_driver/binding_stats"
+#define MESSAGE "Hello World!"
+// First byte of the SHA3-512 digest of MESSAGE
+#define EXPECTED_DIGEST_0 0x32
+
+struct stress_result {
+    uint64_t messages;
+    uint64_t errors;
+    uint64_t retries;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long long read_binds(void) {
+    long long binds = -1;
+    FILE *stats = fopen(BINDING_STATS, "r");
+
+    if (stats) {
+        if (fscanf(stats, "binds: %lld", &binds) != 1) {
+            binds = -1;
+        }
+        fclose(stats);
+    }
+    return binds;
+}
 
 void child(int start_fd, int output_fd, int is_blocking) {
     char buffer[BUFSIZE] = {0};
@@ -28,7 +73,14 @@ void child(int start_fd, int output_fd, int is_blocking) {
 
     sleep(1);
 
-    write(fd, "Hello World!", strlen("Hello World!"));
+    // The peripheral is only bound here, so in non-blocking
+    // mode this is where we find out that they're all taken
+    if (write(fd, MESSAGE, strlen(MESSAGE)) < 0) {
+        sprintf(buffer, "Error: write (%d) %s", errno, strerror(errno));
+        write(output_fd, buffer, strlen(buffer));
+        close(fd);
+        return;
+    }
     int diglen = read(fd, digest, 64);
 
     sprintf(buffer, "len = %d, digest[0] = %02x", diglen, digest[0]);
@@ -37,6 +89,114 @@ void child(int start_fd, int output_fd, int is_blocking) {
     close(fd);
 }
 
+// Hashes the same message over and over. In non-blocking mode, when all the
+// peripherals are taken or the digest isn't ready, it just tries again.
+void stress_child(int start_fd, int output_fd, int is_blocking, long iterations) {
+    struct stress_result result = {0};
+    uint8_t digest[64];
+    char go;
+    uint64_t start, elapsed;
+    ssize_t retval;
+
+    int fd = open(DEVICE_LOCATION, (is_blocking ? 0 : O_NONBLOCK) | O_RDWR);
+    read(start_fd, &go, 1);
+
+    for (long i = 0; fd >= 0 && i < iterations; i++) {
+        start = now_ns();
+
+        while ((retval = write(fd, MESSAGE, strlen(MESSAGE))) < 0 && errno == EAGAIN) {
+            result.retries++;
+            sched_yield();
+        }
+        if (retval >= 0) {
+            while ((retval = read(fd, digest, sizeof(digest))) < 0 && errno == EAGAIN) {
+                result.retries++;
+                sched_yield();
+            }
+        }
+
+        elapsed = now_ns() - start;
+        if (retval != sizeof(digest) || digest[0] != EXPECTED_DIGEST_0) {
+            result.errors++;
+            continue;
+        }
+
+        result.messages++;
+        result.total_ns += elapsed;
+        if (elapsed > result.max_ns) {
+            result.max_ns = elapsed;
+        }
+    }
+
+    if (fd < 0) {
+        result.errors = iterations;
+    } else {
+        close(fd);
+    }
+    write(output_fd, &result, sizeof(result));
+}
+
+int stress(unsigned int procs, long iterations, int is_blocking) {
+    int start_pipe[2], tmp_pipe[2];
+    int output_pipes[MAX_PROCS];
+    char dummy[MAX_PROCS] = {0};
+    struct stress_result result, total = {0};
+    long long binds_before, binds_after;
+    uint64_t start, elapsed;
+
+    printf("Stressing with %u processes, %ld messages each (blocking = %d)\n", procs, iterations, is_blocking);
+    fflush(stdout);
+
+    pipe(start_pipe);
+    for (unsigned int i = 0; i < procs; i++) {
+        pipe(tmp_pipe);
+        if (fork() == 0) {
+            stress_child(start_pipe[0], tmp_pipe[1], is_blocking, iterations);
+            exit(0);
+        }
+        output_pipes[i] = tmp_pipe[0];
+    }
+
+    binds_before = read_binds();
+    start = now_ns();
+    write(start_pipe[1], dummy, procs);
+
+    for (unsigned int i = 0; i < procs; i++) {
+        wait(NULL);
+    }
+    elapsed = now_ns() - start;
+    binds_after = read_binds();
+
+    for (unsigned int i = 0; i < procs; i++) {
+        memset(&result, 0, sizeof(result));
+        read(output_pipes[i], &result, sizeof(result));
+
+        total.messages += result.messages;
+        total.errors += result.errors;
+        total.retries += result.retries;
+        total.total_ns += result.total_ns;
+        if (result.max_ns > total.max_ns) {
+            total.max_ns = result.max_ns;
+        }
+    }
+
+    printf("messages:      %llu (%llu errors)\n", (unsigned long long)total.messages, (unsigned long long)total.errors);
+    printf("elapsed:       %.3f s\n", elapsed / 1e9);
+    printf("throughput:    %.0f messages/s\n", total.messages / (elapsed / 1e9));
+    if (total.messages > 0) {
+        printf("avg latency:   %llu ns\n", (unsigned long long)(total.total_ns / total.messages));
+    }
+    printf("max latency:   %llu ns\n", (unsigned long long)total.max_ns);
+    if (!is_blocking) {
+        printf("EAGAIN:        %llu\n", (unsigned long long)total.retries);
+    }
+    if (binds_before >= 0 && binds_after >= 0) {
+        printf("binds:         %lld\n", binds_after - binds_before);
+    }
+
+    return total.errors == 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
     int start_pipe[2], tmp_pipe[2];
     int output_pipes[PROCS_TO_OPEN];
@@ -44,9 +204,34 @@ int main(int argc, char *argv[]) {
     pid_t pid, pids[PROCS_TO_OPEN];
     char buffer[BUFSIZE];
 
-    int start_fd, is_blocking;
+    int start_fd, is_blocking = 1, procs = PROCS_TO_OPEN, opt;
+    long iterations = 0;
 
-    is_blocking = argc < 2 || (strcmp(argv[1], "-n") != 0);
+    while ((opt = getopt(argc, argv, "ns:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                is_blocking = 0;
+                break;
+            case 's':
+                iterations = atol(optarg);
+                break;
+            case 'p':
+                procs = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n] [-s ITERATIONS [-p PROCS]]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (procs < 1 || procs > MAX_PROCS || iterations < 0) {
+        fprintf(stderr, "Between 1 and %d processes, and a positive number of iterations\n", MAX_PROCS);
+        return 1;
+    }
+
+    if (iterations > 0) {
+        return stress(procs, iterations, is_blocking);
+    }
 
     printf("Starting processess... (blocking = %d)\n", is_blocking);
 
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <stdio.h>
+
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// More than the peripherals we have, so some handles have to wait for one
+#define HANDLES_TO_OPEN 9
+#define MAX_EVENTS 16
+#define HANDLE_LOCATION "/dev/ketchup_handle"
+
+// Where each handle is in its hash
+typedef enum {
+    WAITING_PERIPHERAL,
+    WAITING_DIGEST,
+    DONE
+} HandleState;
+
+typedef struct {
+    int fd;
+    HandleState state;
+} Handle;
+
+// Returns 1 once the handle is done
+int try_read_digest(Handle *handle, int index) {
+    char digest[64] = {0};
+
+    int diglen = read(handle->fd, digest, 64);
+    if (diglen < 0 && errno == EAGAIN) {
+        // Not ready yet, epoll will tell us when it is
+        return 0;
+    }
+
+    printf("handle %d: len = %d, digest[0] = %02x\n", index, diglen, digest[0] & 0xFF);
+    handle->state = DONE;
+
+    // This gives the peripheral back, waking up the handles still waiting
+    close(handle->fd);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    Handle handles[HANDLES_TO_OPEN];
+    struct epoll_event event, events[MAX_EVENTS];
+    int epoll_fd, remaining = HANDLES_TO_OPEN;
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        printf("Error: couldn't create the epoll instance (%d) %s\n", errno, strerror(errno));
+        return 1;
+    }
+
+    // Opening a handle never blocks, it gets a peripheral only once one is free
+    for (int i = 0; i < HANDLES_TO_OPEN; i++) {
+        handles[i].fd = open(HANDLE_LOCATION, O_RDWR | O_NONBLOCK);
+        handles[i].state = WAITING_PERIPHERAL;
+
+        if (handles[i].fd < 0) {
+            printf("Error: couldn't open handle %d (%d) %s\n", i, errno, strerror(errno));
+            return 1;
+        }
+
+        event.events = EPOLLOUT | EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handles[i].fd, &event);
+    }
+
+    printf("Opened %d handles, waiting for peripherals\n", HANDLES_TO_OPEN);
+
+    while (remaining > 0) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        for (int e = 0; e < ready; e++) {
+            int i = events[e].data.u32;
+            Handle *handle = &handles[i];
+
+            if (handle->state == WAITING_PERIPHERAL && (events[e].events & EPOLLOUT)) {
+                // The handle got a peripheral
+                printf("handle %d: got a peripheral\n", i);
+                write(handle->fd, "Hello World!", strlen("Hello World!"));
+                handle->state = WAITING_DIGEST;
+
+                // Most of the time the digest is ready right away
+                remaining -= try_read_digest(handle, i);
+            } else if (handle->state == WAITING_DIGEST && (events[e].events & EPOLLIN)) {
+                remaining -= try_read_digest(handle, i);
+            }
+        }
+    }
+
+    printf("All done!\n");
+    close(epoll_fd);
+
+    return 0;
+}
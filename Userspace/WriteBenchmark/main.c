@@ -0,0 +1,74 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Measures how long write() on the driver takes per KB of data, for
+// different write sizes. Run it once with the old driver and once with the
+// new one to compare them.
+
+#define DEVICE_LOCATION "/dev/ketchup_driver"
+#define TOTAL_BYTES (1024 * 1024)
+#define MAX_CHUNK 1024
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main(void) {
+    static uint8_t buffer[MAX_CHUNK];
+    uint8_t digest[64];
+    size_t chunk_sizes[] = {4, 16, 64, 256, 1024};
+    uint64_t start, elapsed, syscalls;
+    size_t sent;
+
+    int fd = open(DEVICE_LOCATION, O_RDWR);
+    if (fd < 0) {
+        printf("Error: could not open %s: %s\n", DEVICE_LOCATION, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_CHUNK; i++) {
+        buffer[i] = i;
+    }
+
+    printf("%10s %12s %12s %14s\n", "chunk", "syscalls", "ns/syscall", "ns/KB");
+    for (size_t i = 0; i < sizeof(chunk_sizes)/sizeof(chunk_sizes[0]); i++) {
+        size_t chunk = chunk_sizes[i];
+
+        sent = 0;
+        syscalls = 0;
+        start = now_ns();
+        while (sent < TOTAL_BYTES) {
+            ssize_t written = write(fd, buffer, chunk);
+            if (written < 0) {
+                printf("Error: write failed: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+            }
+            sent += written;
+            syscalls++;
+        }
+        elapsed = now_ns() - start;
+
+        // Finish the message so that the peripheral is clean for the next run
+        read(fd, digest, sizeof(digest));
+
+        printf(
+            "%10zu %12llu %12llu %14llu\n",
+            chunk,
+            (unsigned long long)syscalls,
+            (unsigned long long)(elapsed / syscalls),
+            (unsigned long long)(elapsed / (TOTAL_BYTES / 1024))
+        );
+    }
+
+    close(fd);
+    return 0;
+}